@@ -27,6 +27,7 @@
 #define NBT_WARN -5
 #define NBT_NOMEM -6
 #define NBT_LNOMEM -7
+#define NBT_PARTIAL -8
 
 typedef enum {
     nbt_end = 0,
@@ -59,17 +60,71 @@ struct nbt_lookup_t{
     long index;
 };
 
+struct nbt_path_t {
+    struct nbt_lookup_t* path;
+    int path_size;
+};
+
 struct nbt_index_t {
     int start;
     int end;
     int len;
 };
 
+/* A string inside the NBT data, it is not terminated */
+struct nbt_string_view {
+    const char* str;
+    int len;
+};
+
+/* The elements of an array inside the NBT data, still big-endian */
+struct nbt_array_view {
+    const char* data;
+    int len; // Number of elements
+    int width; // Bytes per element
+};
+
 struct nbt_parser_setting_t {
     const int list_meta_init_len;
 
     void* (*alloc) (size_t size);
     void (*free) (void* mem);
+
+    /* Store lists of fixed width primitives as one token */
+    const bool collapse_lists;
+
+    /* Let the parser own the tokens, and grow them and the list metadata when needed */
+    const bool auto_grow;
+
+    /* Record the tokens of the elements of lists of compounds and lists, so that any element is found without a scan */
+    const bool index_lists;
+};
+
+/* Hooks of a builder that owns its buffer, NULL hooks use malloc, realloc and free */
+struct nbt_build_setting_t {
+    /* Starting size of the buffer, which is doubled whenever it is full */
+    const size_t init_len;
+
+    void* (*alloc) (size_t size);
+    void* (*realloc) (void* mem, size_t size);
+    void (*free) (void* mem);
+};
+
+/* Where a streaming builder writes the data, as it is built */
+struct nbt_build_sink_t {
+    /* Appends `len` bytes to the output, returns 0 on success */
+    int (*write) (void* ctx, const char* data, size_t len);
+
+    /* Overwrites `len` bytes at `offset` in the output already written, returns 0 on success. NULL if the output cannot be rewritten */
+    int (*patch) (void* ctx, size_t offset, const char* data, size_t len);
+
+    void* ctx;
+
+    /* Number of bytes kept before they are written */
+    size_t flush_len;
+
+    /* Most bytes the buffer may hold, 0 for no limit. Without `patch` an open list is held until it is closed */
+    size_t max_len;
 };
 
 typedef struct nbt_parser nbt_parser;
@@ -78,21 +133,70 @@ typedef struct nbt_build nbt_build;
 
 typedef struct nbt_token_t nbt_tok;
 
+typedef struct nbt_compact_token_t nbt_ctok;
+
+typedef struct nbt_query_t nbt_query;
+
+typedef struct nbt_query_cache_t nbt_query_cache;
+
+typedef struct nbt_iter_t nbt_iter;
+
 /* Normal interface */
 
 // nbt_utils.c
 void nbt_init_parser(nbt_parser* parser, struct nbt_sized_buffer* content, const struct nbt_parser_setting_t* setting);
 void nbt_clear_parser(nbt_parser* parser, struct nbt_sized_buffer* content);
 void nbt_destroy_parser(nbt_parser* parser);
+nbt_tok* nbt_get_tokens(nbt_parser* parser, int* tok_len);
+int nbt_compact_tokens(nbt_parser* parser, nbt_tok* tok, const int tok_len, nbt_ctok* ctok);
+void nbt_destroy_compact_tokens(nbt_parser* parser, nbt_ctok* ctok);
 
 // nbt_tok.c
 int nbt_tokenise(nbt_parser* parser, nbt_tok* tok, const int tok_len);
+int nbt_tokenise_paths(nbt_parser* parser, nbt_tok* tok, const int tok_len, const struct nbt_path_t* paths, int path_count);
+int nbt_tokenise_parallel(nbt_parser* parser, nbt_tok* tok, const int tok_len, int threads);
+int nbt_skip(struct nbt_sized_buffer* buf, int offset, nbt_type_t type);
 
 // nbt_find.c
 int nbt_find(nbt_tok* tok, const int tok_len, nbt_parser* parser, struct nbt_lookup_t* path, int path_size, struct nbt_index_t* res);
+int nbt_find_compact(nbt_ctok* tok, nbt_parser* parser, struct nbt_lookup_t* path, int path_size, struct nbt_index_t* res);
+int nbt_first_child(nbt_tok* tok, const int tok_len, int index);
+int nbt_next_sibling(nbt_tok* tok, const int tok_len, int index);
+nbt_query* nbt_compile_query(const struct nbt_parser_setting_t* setting, const struct nbt_lookup_t* path, int path_size);
+void nbt_destroy_query(nbt_query* query);
+int nbt_find_query(nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* query, struct nbt_index_t* res);
+int nbt_iter_init(nbt_iter* it, nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* query);
+int nbt_iter_next(nbt_iter* it, struct nbt_index_t* res);
+int nbt_build_index(nbt_parser* parser, nbt_tok* tok, const int tok_len, int min_children);
+void nbt_destroy_index(nbt_parser* parser);
+int nbt_find_batch(nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* const* queries, int query_count, struct nbt_index_t* res, int* status);
+
+int nbt_get_byte(nbt_parser* parser, const struct nbt_index_t* res, int8_t* value);
+int nbt_get_short(nbt_parser* parser, const struct nbt_index_t* res, int16_t* value);
+int nbt_get_int(nbt_parser* parser, const struct nbt_index_t* res, int32_t* value);
+int nbt_get_long(nbt_parser* parser, const struct nbt_index_t* res, int64_t* value);
+int nbt_get_float(nbt_parser* parser, const struct nbt_index_t* res, float* value);
+int nbt_get_double(nbt_parser* parser, const struct nbt_index_t* res, double* value);
+int nbt_get_string(nbt_parser* parser, const struct nbt_index_t* res, struct nbt_string_view* view);
+int nbt_get_array(nbt_parser* parser, const struct nbt_index_t* res, const nbt_type_t type, struct nbt_array_view* view);
+int8_t nbt_array_byte(const struct nbt_array_view* view, int index);
+int32_t nbt_array_int(const struct nbt_array_view* view, int index);
+int64_t nbt_array_long(const struct nbt_array_view* view, int index);
+int nbt_extract_column(nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* list, const nbt_query* field, const nbt_type_t type, const int width, void* out, const int out_len, uint8_t* missing);
+
+// nbt_query.c
+nbt_query* nbt_compile_expr(const struct nbt_parser_setting_t* setting, const char* expr);
+nbt_query_cache* nbt_create_query_cache(const struct nbt_parser_setting_t* setting);
+const nbt_query* nbt_cache_query(nbt_query_cache* cache, const char* expr);
+void nbt_destroy_query_cache(nbt_query_cache* cache);
 
 // nbt_build.c
 void nbt_init_build(nbt_build* b);
+int nbt_init_growable_build(nbt_build* b, const struct nbt_build_setting_t* setting);
+int nbt_init_stream_build(nbt_build* b, const struct nbt_build_setting_t* setting, const struct nbt_build_sink_t* sink);
+int nbt_flush_build(nbt_build* b);
+char* nbt_finish_build(nbt_build* b, size_t* len);
+void nbt_destroy_build(nbt_build* b);
 int nbt_start_compound(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len);
 int nbt_end_compound(nbt_build* b, char* buf, const int buf_len);
 int nbt_start_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len);
@@ -107,4 +211,10 @@ int nbt_add_byte_array(nbt_build* b, char* buf, const int buf_len, char* name, c
 int nbt_add_string(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, char payload[], unsigned short payload_len);
 int nbt_add_int_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, int payload[], int payload_len);
 int nbt_add_long_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, long payload[], int payload_len);
+int nbt_add_char_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const char payload[], int payload_len);
+int nbt_add_short_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const short payload[], int payload_len);
+int nbt_add_integer_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const int payload[], int payload_len);
+int nbt_add_long_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const long payload[], int payload_len);
+int nbt_add_float_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const float payload[], int payload_len);
+int nbt_add_double_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const double payload[], int payload_len);
 
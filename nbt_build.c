@@ -5,55 +5,117 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 
-static int nbt_add_raw_nbt(nbt_build* b, const int skip_size, const char* bytes, const int bytes_size, char* buf, const int buf_size)
+static void nbt_build_free(const struct nbt_build_setting_t* setting, void* mem)
 {
-     if (skip_size > b->offset) return -1;
+    if (setting->free) {
+        setting->free(mem);
+        return;
+    }
+
+    free(mem);
+}
 
-    /* Calculate new length */
-    int new_len = b->offset + bytes_size;
+/* Grows the buffer of a growable builder to at least `needed` bytes, doubling its size */
+static int nbt_grow_build(nbt_build* b, const size_t needed)
+{
+    const struct nbt_build_setting_t* setting = b->setting;
+    if (needed > INT_MAX) return NBT_NOMEM;
 
-    /* Check if it exceeds buffer */
-    if (new_len >= buf_size) return -1;
-    
-    /* Copy bytes to the back */
-    if (b->offset != skip_size) memmove(buf + skip_size + bytes_size, buf + skip_size, b->offset - skip_size);
+    size_t len = b->buf_len ? b->buf_len : 64;
+    while (len < needed) len *= 2;
+    if (len > INT_MAX) len = INT_MAX;
 
-    /* Copy bytes into buffer */
-    memcpy(buf + skip_size, bytes, bytes_size);
+    char* buf;
+    if (setting->realloc || !setting->alloc) {
+        buf = setting->realloc ? setting->realloc(b->buf, len) : realloc(b->buf, len);
+        if (!buf) return NBT_NOMEM;
+    }
+    else {
+        /* Only alloc and free were given */
+        buf = setting->alloc(len);
+        if (!buf) return NBT_NOMEM;
+
+        if (b->buf) {
+            memcpy(buf, b->buf, b->offset - b->flushed);
+            nbt_build_free(setting, b->buf);
+        }
+    }
 
-    /* Calculate any excess bytes */
-    if (skip_size + bytes_size > b->offset) b->offset = skip_size + bytes_size;
+    b->buf = buf;
+    b->buf_len = len;
 
     return 0;
 }
 
-static int nbt_allocate_raw_nbt(nbt_build* b, const int skip_size, const int bytes_size, char* buf, const int buf_size)
+/* Writes the bytes of a streaming builder that are done with to the sink, keeping the headers of open lists if they cannot be patched */
+static int nbt_flush_stream(nbt_build* b)
 {
-    if (skip_size > b->offset) return -1;
+    size_t limit = b->offset;
+
+    if (!b->sink->patch) {
+        for (int depth = 1; depth <= b->current_depth; depth++)
+        {
+            const struct nbtb_state* state = &b->stack[depth];
+            bool list = state->state == S_LST_VAL_OR_CLOSE || state->state == S_NXT_LST_VAL_OR_CLOSE;
+
+            if (list && state->payload < limit) limit = state->payload;
+        }
+    }
+
+    if (limit <= b->flushed) return 0;
 
-    /* Calculate new length */
-    int new_len = b->offset + bytes_size;
+    if (b->sink->write(b->sink->ctx, b->buf, limit - b->flushed)) return NBT_WARN;
 
-    /* Check if it exceeds buffer */
-    if (new_len >= buf_size) return -1;
-    
-    /* Copy bytes to the back */
-    if (b->offset != skip_size) memmove(buf + skip_size + bytes_size, buf + skip_size, b->offset - skip_size);
+    memmove(b->buf, b->buf + (limit - b->flushed), b->offset - limit);
+    b->flushed = limit;
 
     return 0;
 }
 
-static int nbt_replace_raw_nbt(nbt_build* b, const int skip_size, const char* bytes, const int bytes_size, char* buf, const int buf_size)
-{ 
-    /* Copy bytes into buffer */
-    memcpy(buf + skip_size, bytes, bytes_size);
+/*
+ * Reserves `len` bytes at the end of the buffer, the only bounds check made for a tag. A builder owning its buffer points `buf` to it.
+ * Offsets in the builder count every byte built, the buffer of a streaming builder only holds those from `flushed` on.
+ */
+static int nbt_reserve(nbt_build* b, char** buf, const int buf_len, const size_t len, char** out)
+{
+    if (b->setting) {
+        if (b->sink && b->offset - b->flushed >= b->sink->flush_len && nbt_flush_stream(b)) return NBT_WARN;
+
+        size_t buffered = b->offset - b->flushed;
+        if (b->sink && b->sink->max_len && len > b->sink->max_len - buffered) return NBT_NOMEM;
+        if (len > b->buf_len - buffered && nbt_grow_build(b, buffered + len)) return NBT_NOMEM;
+        *buf = b->buf;
+    }
+    else if (buf_len < 0 || b->offset > (size_t)buf_len || len > (size_t)buf_len - b->offset) {
+        return NBT_NOMEM;
+    }
+
+    *out = *buf + (b->offset - b->flushed);
+    b->offset += len;
 
-    /* Calculate any excess bytes */
-    if (skip_size + bytes_size > b->offset) b->offset = skip_size + bytes_size;
     return 0;
 }
 
+static void nbt_put_short(char* out, const uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value;
+}
+
+static void nbt_put_int(char* out, const uint32_t value)
+{
+    uint32_t big = bswap_32(value);
+    memcpy(out, &big, 4);
+}
+
+static void nbt_put_long(char* out, const uint64_t value)
+{
+    uint64_t big = bswap_64(value);
+    memcpy(out, &big, 8);
+}
+
 static int nbtb_incre_state(nbt_build* b, enum nbtb_state_type new_state)
 {
     if (b->current_depth >= MAX_DEPTH) return -1;
@@ -81,17 +143,57 @@ static int nbt_change_state(nbt_build* b, enum nbtb_state_type new_state)
     return 0;
 }
 
-static void incre_list_meta(nbt_build* b, char* buf, int buf_len)
+/* Only counted in the state, the header is written once by nbt_end_list */
+static void incre_list_meta(nbt_build* b)
 {
-    int list_count = 0;
-    swap_char_4(buf + b->top->payload + 1, (char*)&list_count);
+    b->top->count++;
+}
 
-    list_count++;
+/*
+ * Writes the type and name of a tag in a compound, or counts an element of a list, and reserves `payload_len` bytes after it.
+ * On success `payload` points to the reserved bytes.
+ */
+static int nbt_begin_tag(nbt_build* b, char* buf, const int buf_len, const nbt_type_t type, const char* name, const short name_len, const size_t payload_len, char** payload)
+{
+    switch (b->top->state)
+    {
+    case S_CMP:
+        if (type != nbt_compound) return NBT_WARN; // Only a compound can be the root
+        /* Fall through */
+    case S_OBJ_OR_CLOSE: {
+        char* out;
+        int res = nbt_reserve(b, &buf, buf_len, 1 + 2 + (size_t)(uint16_t)name_len + payload_len, &out);
+        if (res) return res;
 
-    char new_list_count[4];
-    swap_char_4((char*)&list_count, new_list_count);
+        out[0] = type;
+        nbt_put_short(out + 1, name_len);
+        memcpy(out + 3, name, (uint16_t)name_len);
 
-    nbt_replace_raw_nbt(b, b->top->payload + 1, new_list_count, 4, buf, buf_len);
+        *payload = out + 3 + (uint16_t)name_len;
+        return 0;
+    }
+
+    case S_LST_VAL_OR_CLOSE:
+    case S_NXT_LST_VAL_OR_CLOSE: {
+        /* The first element sets the type of the list */
+        if (b->top->state == S_NXT_LST_VAL_OR_CLOSE && b->top->type != type) return NBT_WARN;
+
+        char* out;
+        int res = nbt_reserve(b, &buf, buf_len, payload_len, &out);
+        if (res) return res;
+
+        b->top->type = type;
+
+        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
+        incre_list_meta(b);
+
+        *payload = out;
+        return 0;
+    }
+
+    default:
+        return NBT_WARN;
+    }
 }
 
 void nbt_init_build(nbt_build* b)
@@ -101,51 +203,76 @@ void nbt_init_build(nbt_build* b)
 
     b->top = &b->stack[0];
     b->offset = 0;
+
+    b->buf = NULL;
+    b->buf_len = 0;
+    b->setting = NULL;
+
+    b->sink = NULL;
+    b->flushed = 0;
 }
 
-int nbt_start_compound(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len)
+int nbt_init_growable_build(nbt_build* b, const struct nbt_build_setting_t* setting)
 {
-    /* update state */
-    switch (b->top->state)
-    {
-    case S_CMP:
-    case S_OBJ_OR_CLOSE: {
-        if (nbtb_incre_state(b, S_OBJ_OR_CLOSE)) return NBT_WARN;
+    nbt_init_build(b);
+    b->setting = setting;
 
-        int total_len = 1 + 2 + name_len;
+    if (setting->init_len) return nbt_grow_build(b, setting->init_len);
 
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
+    return 0;
+}
 
-        char id = nbt_compound;
-        char len[2];
-        swap_char_2((char*)&name_len, len);
+int nbt_init_stream_build(nbt_build* b, const struct nbt_build_setting_t* setting, const struct nbt_build_sink_t* sink)
+{
+    if (!sink->write) return NBT_WARN;
 
-        nbt_replace_raw_nbt(b, b->offset, &id, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
+    int res = nbt_init_growable_build(b, setting);
+    b->sink = sink;
 
-        break;
-    }    
-    
-    case S_LST_VAL_OR_CLOSE: {
-        char id = nbt_compound;
-        nbt_replace_raw_nbt(b, b->top->payload, &id, 1, buf, buf_len);
-
-        if (nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE)) return NBT_WARN;
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)nbt_compound) return NBT_WARN;
+    return res;
+}
 
-        incre_list_meta(b, buf, buf_len);
+int nbt_flush_build(nbt_build* b)
+{
+    if (!b->sink) return NBT_WARN;
 
-        if (nbtb_incre_state(b, S_OBJ_OR_CLOSE)) return NBT_WARN;        
-        break;
-    }
+    return nbt_flush_stream(b);
+}
 
-    default:
-        return NBT_WARN;
-        break;
-    }
+char* nbt_finish_build(nbt_build* b, size_t* len)
+{
+    if (!b->setting || b->sink || b->current_depth != 0 || b->offset == 0) return NULL;
+
+    char* buf = b->buf;
+    *len = b->offset;
+
+    /* The caller owns the buffer now, the builder can start again */
+    b->buf = NULL;
+    b->buf_len = 0;
+    b->offset = 0;
+
+    return buf;
+}
+
+void nbt_destroy_build(nbt_build* b)
+{
+    if (!b->setting) return;
+
+    if (b->buf) nbt_build_free(b->setting, b->buf);
+
+    b->buf = NULL;
+    b->buf_len = 0;
+    b->offset = 0;
+    b->flushed = 0;
+}
+
+int nbt_start_compound(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len)
+{
+    char* payload;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_compound, name, name_len, 0, &payload);
+    if (res) return res;
+
+    if (nbtb_incre_state(b, S_OBJ_OR_CLOSE)) return NBT_WARN;
 
     return 0;
 }
@@ -166,57 +293,30 @@ int nbt_end_compound(nbt_build* b, char* buf, const int buf_len)
         break;
     }
 
-    char payload = nbt_end;
+    char* out;
+    int res = nbt_reserve(b, &buf, buf_len, 1, &out);
+    if (res) return res;
 
-    if (nbt_add_raw_nbt(b, b->offset, &payload, 1, buf, buf_len)) return NBT_NOMEM;
+    *out = nbt_end;
 
     return 0;
 }
 
 int nbt_start_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len)
 {
-    int total_len = 0;
-    /* update state */
-    switch (b->top->state)
-    {
-    case S_OBJ_OR_CLOSE: {
-        total_len = 1 + 2 + name_len + 5;
-
-        char id = nbt_list;
-        char len[2];
-        swap_char_2((char*)&name_len, len);
-
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-        nbt_replace_raw_nbt(b, b->offset, &id, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
-
-        break;
-    }
-    case S_LST_VAL_OR_CLOSE: {
-        char id = nbt_list;
-        nbt_replace_raw_nbt(b, b->top->payload, &id, 1, buf, buf_len);
-
-        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)nbt_list) return NBT_WARN;
+    if (b->top->state == S_CMP) return NBT_WARN;
 
-        incre_list_meta(b, buf, buf_len);
-        if (nbt_allocate_raw_nbt(b, b->offset, 5, buf, buf_len)) return NBT_NOMEM;
-        break;
-    }
-
-    default:
-        return NBT_WARN;
-        break;
-    }
+    /* The type of the elements and their count, set as they are added */
+    char* prefix;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_list, name, name_len, 5, &prefix);
+    if (res) return res;
 
     if (nbtb_incre_state(b, S_LST_VAL_OR_CLOSE)) return NBT_WARN;
-    b->top->payload = b->offset;
+    b->top->payload = b->offset - 5;
+    b->top->type = nbt_end;
+    b->top->count = 0;
 
-    char prefix[5] = {0};
-    nbt_replace_raw_nbt(b, b->offset, prefix, 5, buf, buf_len);
+    memset(prefix, 0, 5);
 
     return 0;
 }
@@ -228,68 +328,47 @@ int nbt_end_list(nbt_build* b, char* buf, const int buf_len)
     {
     case S_NXT_LST_VAL_OR_CLOSE:    
     case S_LST_VAL_OR_CLOSE:
-        if (nbt_decre_state(b)) return NBT_WARN;
         break;
     default:
         return NBT_WARN;
         break;
     }
-    return 0;
-}
-
-int nbt_add_single(nbt_build* b, char* buf, const int buf_len, nbt_type_t type, char* name, const short name_len, char* nbt_payload, const int payload_len)
-{  
-    /* update state */
-    switch (b->top->state)
-    {
-    case S_OBJ_OR_CLOSE: {
-        int total_len = 1 + 2 + name_len + payload_len;
-
-        char _name_len[2];
-        swap_char_2((char*)&name_len, _name_len);
-
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-        nbt_replace_raw_nbt(b, b->offset, (const char*)&type, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, _name_len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
-
-        break;
-    }
 
-    case S_LST_VAL_OR_CLOSE: {
-        nbt_replace_raw_nbt(b, b->top->payload, (const char*)&type, 1, buf, buf_len);
+    char header[5];
+    header[0] = b->top->type;
+    nbt_put_int(header + 1, b->top->count);
 
-        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)type) return NBT_WARN;
-
-        if (nbt_allocate_raw_nbt(b, b->offset, payload_len, buf, buf_len)) return NBT_NOMEM;
-
-        incre_list_meta(b, buf, buf_len);
-        break;
+    if (b->top->payload >= b->flushed) {
+        char* list = (b->setting ? b->buf : buf) + (b->top->payload - b->flushed);
+        memcpy(list, header, 5);
     }
-
-    default:
+    else if (b->sink->patch(b->sink->ctx, b->top->payload, header, 5)) { // Written to the sink before the elements were all there
         return NBT_WARN;
-        break;
     }
 
-    nbt_replace_raw_nbt(b, b->offset, nbt_payload, payload_len, buf, buf_len);
+    if (nbt_decre_state(b)) return NBT_WARN;
     return 0;
 }
 
-int nbt_add_char(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, char payload)
+static int nbt_add_single(nbt_build* b, char* buf, const int buf_len, nbt_type_t type, char* name, const short name_len, const char* nbt_payload, const int payload_len)
 {
-    char nbt_payload = payload;
+    char* payload;
+    int res = nbt_begin_tag(b, buf, buf_len, type, name, name_len, payload_len, &payload);
+    if (res) return res;
 
-    return nbt_add_single(b, buf, buf_len, nbt_byte, name, name_len, &nbt_payload, 1);
+    memcpy(payload, nbt_payload, payload_len);
+    return 0;
+}
+
+int nbt_add_char(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, char payload)
+{
+    return nbt_add_single(b, buf, buf_len, nbt_byte, name, name_len, &payload, 1);
 }
 
 int nbt_add_short(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, short payload)
 {
-    char nbt_payload[4];
-    swap_char_2((char*)&payload, nbt_payload);
+    char nbt_payload[2];
+    nbt_put_short(nbt_payload, payload);
 
     return nbt_add_single(b, buf, buf_len, nbt_short, name, name_len, nbt_payload, 2);
 }
@@ -297,253 +376,173 @@ int nbt_add_short(nbt_build* b, char* buf, const int buf_len, char* name, const
 int nbt_add_integer(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, int payload)
 {
     char nbt_payload[4];
-    swap_char_4((char*)&payload, nbt_payload);
-    
+    nbt_put_int(nbt_payload, payload);
+
     return nbt_add_single(b, buf, buf_len, nbt_int, name, name_len, nbt_payload, 4);
 }
 
 int nbt_add_long(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, long payload)
 {
     char nbt_payload[8];
-    swap_char_8((char*)&payload, nbt_payload);
-    
+    nbt_put_long(nbt_payload, payload);
+
     return nbt_add_single(b, buf, buf_len, nbt_long, name, name_len, nbt_payload, 8);
 }
 
 int nbt_add_float(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, float payload)
 {
+    uint32_t bits;
+    memcpy(&bits, &payload, 4);
+
     char nbt_payload[4];
-    swap_char_4((char*)&payload, nbt_payload);
-    
+    nbt_put_int(nbt_payload, bits);
+
     return nbt_add_single(b, buf, buf_len, nbt_float, name, name_len, nbt_payload, 4);
 }
 
 int nbt_add_double(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, double payload)
 {
+    uint64_t bits;
+    memcpy(&bits, &payload, 8);
+
     char nbt_payload[8];
-    swap_char_8((char*)&payload, nbt_payload);
-    
+    nbt_put_long(nbt_payload, bits);
+
     return nbt_add_single(b, buf, buf_len, nbt_double, name, name_len, nbt_payload, 8);
 }
 
 int nbt_add_byte_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, char payload[], int payload_len)
 {
-    int total_len = 0;
+    if (payload_len < 0) return NBT_WARN;
 
-    /* Update state */
-    switch (b->top->state)
-    {
-    case S_OBJ_OR_CLOSE: {
-        total_len = 1 + 2 + name_len + 2 + payload_len;
-
-        char id = nbt_byte_array;
+    char* out;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_byte_array, name, name_len, 4 + (size_t)payload_len, &out);
+    if (res) return res;
 
-        char _name_len[2];
-        swap_char_2((char*)&name_len, _name_len);
-
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-        nbt_replace_raw_nbt(b, b->offset, &id, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, _name_len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
-
-        break;
-    }
-
-    case S_LST_VAL_OR_CLOSE: {
-        char id = nbt_byte_array;
-        nbt_replace_raw_nbt(b, b->top->payload, &id, 1, buf, buf_len);
-
-        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)nbt_byte_array) return NBT_WARN;
-
-        total_len = 4 + payload_len;
-        nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len);
-
-        incre_list_meta(b, buf, buf_len);
-        break;
-    }
-
-    default:
-        return NBT_WARN;
-        break;
-    }
-
-    char _payload_len[4];
-    swap_char_4((char*)&payload_len, _payload_len);
-
-    nbt_replace_raw_nbt(b, b->offset, _payload_len, 4, buf, buf_len);
-    nbt_replace_raw_nbt(b, b->offset, payload, payload_len, buf, buf_len);
+    nbt_put_int(out, payload_len);
+    memcpy(out + 4, payload, payload_len);
 
     return 0;
 }
 
 int nbt_add_string(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, char payload[], unsigned short payload_len)
 {
-    int total_len = 0;
+    char* out;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_string, name, name_len, 2 + (size_t)payload_len, &out);
+    if (res) return res;
 
-    /* Update state */
-    switch (b->top->state)
-    {
-    case S_OBJ_OR_CLOSE: {
-        total_len = 1 + 2 + name_len + 2 + payload_len;
+    nbt_put_short(out, payload_len);
+    memcpy(out + 2, payload, payload_len);
 
-        char id = nbt_string;
+    return 0;
+}
 
-        char _name_len[2];
-        swap_char_2((char*)&name_len, _name_len);
+/* The payload is encoded straight into the buffer, so the array of the caller is left as it was */
+int nbt_add_int_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, int payload[], int payload_len)
+{
+    if (payload_len < 0) return NBT_WARN;
 
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-        nbt_replace_raw_nbt(b, b->offset, &id, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, _name_len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
+    char* out;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_int_array, name, name_len, 4 + (size_t)payload_len * 4, &out);
+    if (res) return res;
 
-        break;
-    }
+    nbt_put_int(out, payload_len);
+    nbt_encode_ints(out + 4, payload, payload_len);
 
-    case S_LST_VAL_OR_CLOSE: {
-        char id = nbt_string;
-        nbt_replace_raw_nbt(b, b->top->payload, &id, 1, buf, buf_len);
+    return 0;
+}
 
-        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)nbt_string) return NBT_WARN;
+int nbt_add_long_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, long payload[], int payload_len)
+{
+    if (payload_len < 0) return NBT_WARN;
 
-        total_len = 2 + payload_len;
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
+    char* out;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_long_array, name, name_len, 4 + (size_t)payload_len * 8, &out);
+    if (res) return res;
 
-        incre_list_meta(b, buf, buf_len);
-        break;
+    nbt_put_int(out, payload_len);
+    if (sizeof(long) == 8) {
+        nbt_encode_longs(out + 4, payload, payload_len);
     }
-
-    default:
-        return NBT_WARN;
-        break;
+    else {
+        for (int i = 0; i < payload_len; i++)
+        {
+            nbt_put_long(out + 4 + (size_t)i * 8, payload[i]);
+        }
     }
 
-    char _payload_len[2];
-    swap_char_2((char*)&payload_len, _payload_len);
-
-    nbt_replace_raw_nbt(b, b->offset, _payload_len, 2, buf, buf_len);
-    nbt_replace_raw_nbt(b, b->offset, payload, payload_len, buf, buf_len);
-
     return 0;
 }
 
-int nbt_add_int_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, int payload[], int payload_len)
+/* Writes a whole list of `payload_len` numbers of `width` bytes, with its header */
+static int nbt_add_list(nbt_build* b, char* buf, const int buf_len, const nbt_type_t type, char* name, const short name_len, const void* payload, const int payload_len, const int width)
 {
-    int total_len = 0;
-
-    /* Update state */
-    switch (b->top->state)
-    {
-    case S_OBJ_OR_CLOSE: {
-        total_len = 1 + 2 + name_len + 2 + payload_len * sizeof(int);
-
-        char id = nbt_int_array;
+    if (payload_len < 0) return NBT_WARN;
 
-        char _name_len[2];
-        swap_char_2((char*)&name_len, _name_len);
+    char* out;
+    int res = nbt_begin_tag(b, buf, buf_len, nbt_list, name, name_len, 5 + (size_t)payload_len * width, &out);
+    if (res) return res;
 
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-        nbt_replace_raw_nbt(b, b->offset, &id, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, _name_len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
+    out[0] = type;
+    nbt_put_int(out + 1, payload_len);
+    out += 5;
 
+    switch (width) {
+    case 1:
+        memcpy(out, payload, payload_len);
         break;
-    }
-
-    case S_LST_VAL_OR_CLOSE: {
-        char id = nbt_int_array;
-        nbt_replace_raw_nbt(b, b->top->payload, &id, 1, buf, buf_len);
-
-        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)nbt_int_array) return NBT_WARN;
-
-        total_len = 4 + payload_len * sizeof(int);
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-
-        incre_list_meta(b, buf, buf_len);
+    case 2:
+        for (int i = 0; i < payload_len; i++)
+        {
+            nbt_put_short(out + i * 2, ((const short*)payload)[i]);
+        }
         break;
-    }
-
-    default:
-        return NBT_WARN;
+    case 4:
+        nbt_encode_ints(out, payload, payload_len);
+        break;
+    case 8:
+        /* Doubles are always 8 bytes, a long may not be */
+        if (type == nbt_double || sizeof(long) == 8) {
+            nbt_encode_longs(out, payload, payload_len);
+        }
+        else {
+            for (int i = 0; i < payload_len; i++)
+            {
+                nbt_put_long(out + (size_t)i * 8, ((const long*)payload)[i]);
+            }
+        }
         break;
     }
 
-    char _payload_len[4];
-    swap_char_4((char*)&payload_len, _payload_len);
-
-    for (size_t i = 0; i < payload_len; i++)
-    {
-        safe_swap_4((char*)&payload[i], (char*)&payload[i]);
-    }
-
-    nbt_replace_raw_nbt(b, b->offset, _payload_len, 4, buf, buf_len);
-    nbt_replace_raw_nbt(b, b->offset, (char*)payload, payload_len * sizeof(int), buf, buf_len);
-
     return 0;
 }
 
-int nbt_add_long_array(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, long payload[], int payload_len)
+int nbt_add_char_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const char payload[], int payload_len)
 {
-    int total_len = 0;
-
-    /* Update state */
-    switch (b->top->state)
-    {
-    case S_OBJ_OR_CLOSE: {
-        total_len = 1 + 2 + name_len + 2 + payload_len * sizeof(long);
-
-        char id = nbt_long_array;
-
-        char _name_len[2];
-        swap_char_2((char*)&name_len, _name_len);
-
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-        nbt_replace_raw_nbt(b, b->offset, &id, 1, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, _name_len, 2, buf, buf_len);
-        nbt_replace_raw_nbt(b, b->offset, name, name_len, buf, buf_len);
-
-        break;
-    }
-
-    case S_LST_VAL_OR_CLOSE: {
-        char id = nbt_long_array;
-        nbt_replace_raw_nbt(b, b->top->payload, &id, 1, buf, buf_len);
-
-        nbt_change_state(b, S_NXT_LST_VAL_OR_CLOSE);
-    } /* Fall through */
-    case S_NXT_LST_VAL_OR_CLOSE: {
-        if (buf[b->top->payload] != (char)nbt_long_array) return NBT_WARN;
-
-        total_len = 4 + payload_len * sizeof(long);
-        if (nbt_allocate_raw_nbt(b, b->offset, total_len, buf, buf_len)) return NBT_NOMEM;
-
-        incre_list_meta(b, buf, buf_len);
-        break;
-    }
+    return nbt_add_list(b, buf, buf_len, nbt_byte, name, name_len, payload, payload_len, 1);
+}
 
-    default:
-        return NBT_WARN;
-        break;
-    }
+int nbt_add_short_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const short payload[], int payload_len)
+{
+    return nbt_add_list(b, buf, buf_len, nbt_short, name, name_len, payload, payload_len, 2);
+}
 
-    char _payload_len[4];
-    swap_char_4((char*)&payload_len, _payload_len);
+int nbt_add_integer_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const int payload[], int payload_len)
+{
+    return nbt_add_list(b, buf, buf_len, nbt_int, name, name_len, payload, payload_len, 4);
+}
 
-    for (size_t i = 0; i < payload_len; i++)
-    {
-        safe_swap_8((char*)&payload[i], (char*)&payload[i]);
-    }
+int nbt_add_long_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const long payload[], int payload_len)
+{
+    return nbt_add_list(b, buf, buf_len, nbt_long, name, name_len, payload, payload_len, 8);
+}
 
-    nbt_replace_raw_nbt(b, b->offset, _payload_len, 4, buf, buf_len);
-    nbt_replace_raw_nbt(b, b->offset, (char*)payload, payload_len * sizeof(long), buf, buf_len);
+int nbt_add_float_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const float payload[], int payload_len)
+{
+    return nbt_add_list(b, buf, buf_len, nbt_float, name, name_len, payload, payload_len, 4);
+}
 
-    return 0;
-}
\ No newline at end of file
+int nbt_add_double_list(nbt_build* b, char* buf, const int buf_len, char* name, const short name_len, const double payload[], int payload_len)
+{
+    return nbt_add_list(b, buf, buf_len, nbt_double, name, name_len, payload, payload_len, 8);
+}
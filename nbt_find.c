@@ -9,97 +9,1015 @@
 #include <ctype.h>
 #include <byteswap.h>
 
-static bool check_if_in_list(struct nbt_lookup_t* lookup, int index)
+/* Steps parsed from an expression may leave the type to be any type */
+static bool nbt_type_matches(const nbt_type_t type, const nbt_type_t step_type)
+{
+    if (step_type == NBT_ANY_TYPE) return type >= nbt_end;
+
+    return type == step_type;
+}
+
+static bool check_if_in_list(const struct nbt_query_step* steps, int index)
 {
     if (index <= 0) return false;
 
-    if (lookup[index - 1].type != nbt_list) return false;
+    if (steps[index - 1].type != nbt_list) return false;
 
     return true;
 }
 
-static int nbt_get_identifier_index(int current_token, nbt_tok* tok, int max_token)
+static int nbt_get_identifier_index(int current_token, const struct nbt_tok_view* tok)
 {
     for (size_t i = 1; i < 6; i++)
     {
-        if (nbt_tok_return_type(tok, current_token + i, max_token) == nbt_identifier) return current_token + i;
+        if (nbt_view_return_type(tok, current_token + i) == nbt_identifier) return current_token + i;
     }
     return NBT_WARN;
 }
 
-static int nbt_get_pr_index(int current_token, nbt_tok* tok, int max_token)
+static int nbt_get_pr_index(int current_token, const struct nbt_tok_view* tok)
 {
     for (size_t i = 0; i < 3; i++)
     {
-        if (nbt_tok_return_type(tok, current_token + i, max_token) == nbt_primitive) return current_token + i;
+        if (nbt_view_return_type(tok, current_token + i) == nbt_primitive) return current_token + i;
     }
     return NBT_WARN;
 }
 
-static int nbt_cmp_tok_id(int token_id, nbt_tok* tok, const int tok_len, nbt_parser* parser, char* str_2)
+/* The identifier token holds the length prefix, so names of the wrong length are rejected without reading the data */
+static bool nbt_cmp_tok_id(int token_id, const struct nbt_tok_view* tok, nbt_parser* parser, const struct nbt_query_step* step)
+{
+    if (nbt_view_return_type(tok, token_id) != nbt_identifier) return false;
+    if (nbt_view_return_len(tok, token_id) != step->name_len + 2) return false;
+
+    char* source_str = parser->nbt_data->content + nbt_view_return_start(tok, token_id) + 2;
+    return nbt_name_equals(source_str, step->name, step->name_len, &step->key);
+}
+
+/* Elements of a collapsed list are found from their offset in the list */
+static int nbt_find_collapsed(int token_id, const struct nbt_tok_view* tok, nbt_parser* parser, const struct nbt_query_step* steps, int current_path, int path_size, struct nbt_index_t* res)
+{
+    if (current_path != path_size - 1) return NBT_WARN;
+
+    int start = nbt_view_return_start(tok, token_id);
+
+    /* The type ID of the elements is before the number of entries */
+    nbt_type_t type = parser->nbt_data->content[start - 5];
+    if (!nbt_type_matches(type, steps[current_path].type)) return NBT_WARN;
+
+    int width = nbt_view_return_len(tok, token_id) / char_to_int(parser->nbt_data->content + start - 4);
+
+    long index = steps[current_path - 1].index;
+    if (index < 0) index = 0;
+    if (index * width >= nbt_view_return_len(tok, token_id)) return NBT_WARN;
+
+    res->start = start + index * width;
+    res->end = res->start + width - 1;
+    res->len = width;
+
+    return 0;
+}
+
+/* Returns the child of `compound` matching `step`, NBT_WARN if there is none, or NBT_NOT_AVAIL if the compound is not indexed */
+static int nbt_index_lookup(const struct nbt_tok_view* tok, nbt_parser* parser, int compound, const struct nbt_query_step* step)
 {
-    if (nbt_tok_return_type(tok, token_id, tok_len) != nbt_identifier) return false;
+    const struct nbt_child_index_t* index = parser->child_index;
+    if (!index || compound >= index->tok_len) return NBT_NOT_AVAIL;
+    if (tok->tok ? index->tok != tok->tok : index->ctok != tok->ctok) return NBT_NOT_AVAIL;
+
+    int32_t offset = index->tables[compound];
+    if (offset < 0) return NBT_NOT_AVAIL;
 
-    char _str_len[2];
+    const int32_t* table = index->slots + offset;
+    uint32_t mask = table[0] - 1;
 
-    for (size_t i = 0; i < 2; i++)
+    for (uint32_t slot = step->hash & mask;; slot = (slot + 1) & mask)
     {
-        _str_len[i] = parser->nbt_data->content[nbt_tok_return_start(tok, token_id, tok_len) + i];
-    }
+        int32_t child = table[slot + 1];
+        if (child < 0) return NBT_WARN;
 
-    unsigned short str_len = char_to_ushort(_str_len);
-   
-    char* source_str = parser->nbt_data->content + nbt_tok_return_start(tok, token_id, tok_len) + 2;
-    return strncmp(source_str, str_2, str_len);
+        if (nbt_cmp_tok_id(child + 1, tok, parser, step)) {
+            return nbt_type_matches(nbt_view_return_type(tok, child), step->type) ? child : NBT_WARN;
+        }
+    }
 }
 
+/* Returns element `k` of `list` without walking the elements before it, NBT_WARN if there is none, or NBT_NOT_AVAIL if the list has to be scanned */
+static int nbt_list_element(const struct nbt_tok_view* tok, nbt_parser* parser, int list, long k)
+{
+    int end = nbt_view_return_next(tok, list);
 
-int nbt_find(nbt_tok* tok, const int tok_len, nbt_parser* parser, struct nbt_lookup_t* path, int path_size, struct nbt_index_t* res)
-{   
-    int parent_index = NBT_NOT_AVAIL;
+    int first = list + 1;
+    if (first < end && nbt_view_return_type(tok, first) == nbt_identifier) first++;
+    if (first >= end) return NBT_WARN;
+
+    nbt_type_t type = nbt_view_return_type(tok, first);
+    if (type == nbt_primitive) return NBT_NOT_AVAIL; // Collapsed, found from its offset
+
+    if (type != nbt_compound && type != nbt_list) {
+        /* Every element is a tag and its primitive */
+        long width = nbt_view_return_next(tok, first) - first;
+        if (width <= 0) return NBT_NOT_AVAIL;
+
+        return k < (end - first) / width ? first + k * width : NBT_WARN;
+    }
+
+    const struct nbt_list_index_t* index = parser->list_index;
+    if (!index || index->tok != tok->tok || index->tok_len > tok->len || list >= index->tok_len) return NBT_NOT_AVAIL;
+
+    int32_t offset = index->tables[list];
+    if (offset < 0) return NBT_NOT_AVAIL;
+
+    const int32_t* table = index->elements + offset;
+    return k < table[0] ? table[k + 1] : NBT_WARN;
+}
+
+/*
+ * Matches the path against the tokens in [first, end), the first step against the tokens that have no parent among them.
+ * Returns the matched token, which is the primitive of a collapsed list for one of its elements, or NBT_WARN.
+ */
+static int nbt_find_range(const struct nbt_tok_view* tok, nbt_parser* parser, const struct nbt_query_step* steps, int path_size, int first, int end, struct nbt_index_t* res)
+{
     int current_path = 0;
-    
-    int i = 0;
-    for (; i < tok_len; i++)
-    {
-        if (nbt_tok_return_parent(tok, i, tok_len) != parent_index) continue;
-        if (nbt_tok_return_type(tok, i, tok_len) != path[current_path].type) continue;
+    long skip = 0; // Elements left to skip in the current list
 
-        if (check_if_in_list(path, current_path) == false) { // Current token is not in a list
+    /* Only the children of the last matched token are visited, other tokens are skipped along with their children */
+    int i = first;
+    while (i < end)
+    {
+        int next = nbt_view_return_next(tok, i);
+        if (next <= i) return NBT_WARN;
 
-            /* Check the name of the token */
-            int id = nbt_get_identifier_index(i, tok, tok_len);
-            if (id == NBT_WARN) continue;
+        if (nbt_view_return_type(tok, i) == nbt_primitive && check_if_in_list(steps, current_path)) {
+            if (nbt_find_collapsed(i, tok, parser, steps, current_path, path_size, res)) return NBT_WARN;
+            return i;
+        }
+        if (!nbt_type_matches(nbt_view_return_type(tok, i), steps[current_path].type)) {
+            i = next;
+            continue;
+        }
 
-            if (nbt_cmp_tok_id(id, tok, tok_len, parser, path[current_path].name)) continue;
+        if (check_if_in_list(steps, current_path) == false) { // Current token is not in a list
 
-            current_path++;
-            parent_index = i;
+            /* Check the name of the token */
+            int id = nbt_get_identifier_index(i, tok);
+            if (id == NBT_WARN || !nbt_cmp_tok_id(id, tok, parser, &steps[current_path])) {
+                i = next;
+                continue;
+            }
         }
         else { // Current token is in a list
             /* Check the number of tokens to skip */
-
-            // debug("List detected. Current path %d");
-            if (path[current_path - 1].index <= 0) {
-                current_path++;
-                parent_index = i;
+            if (skip > 0) {
+                skip--;
+                i = next;
+                continue;
             }
-            else {
-                path[current_path - 1].index--;
-            }    
         }
-        
+
+        if (steps[current_path].type == nbt_list) skip = steps[current_path].index;
+        current_path++;
+
+        nbt_type_t type = nbt_view_return_type(tok, i);
         if (current_path == path_size) {
-            if (path[current_path - 1].type != nbt_compound && path[current_path - 1].type != nbt_list) {
-                i = nbt_get_pr_index(i, tok, tok_len);
+            int result = i;
+            if (type != nbt_compound && type != nbt_list) {
+                result = nbt_get_pr_index(i, tok);
             }
 
-            res->start = nbt_tok_return_start(tok, i, tok_len);
-            res->end = nbt_tok_return_end(tok, i, tok_len);
-            res->len = nbt_tok_return_len(tok, i, tok_len);
+            res->start = nbt_view_return_start(tok, result);
+            res->end = nbt_view_return_end(tok, result);
+            res->len = nbt_view_return_len(tok, result);
+
+            return i;
+        }
+
+        /* Go into the children of the matched token */
+        end = next;
 
-            return 0;
-        }  
+        if (type == nbt_compound) {
+            int child = nbt_index_lookup(tok, parser, i, &steps[current_path]);
+            if (child == NBT_WARN) return NBT_WARN;
+            if (child != NBT_NOT_AVAIL) {
+                i = child;
+                continue;
+            }
+        }
+        else if (type == nbt_list && skip > 0) {
+            int element = nbt_list_element(tok, parser, i, skip);
+            if (element == NBT_WARN) return NBT_WARN;
+            if (element != NBT_NOT_AVAIL) {
+                skip = 0;
+                i = element;
+                continue;
+            }
+        }
+
+        i++;
     }
     return NBT_WARN;
 }
+
+static int nbt_find_view(const struct nbt_tok_view* tok, nbt_parser* parser, const struct nbt_query_step* steps, int path_size, struct nbt_index_t* res)
+{
+    return nbt_find_range(tok, parser, steps, path_size, 0, tok->len, res) < 0 ? NBT_WARN : 0;
+}
+
+static unsigned short nbt_name_len(const char* name)
+{
+    const char* nul = memchr(name, '\0', MAX_NAME_LEN);
+    if (!nul) return MAX_NAME_LEN;
+
+    return nul - name;
+}
+
+static void nbt_fill_step(struct nbt_query_step* step, const struct nbt_lookup_t* lookup, const char* name)
+{
+    step->type = lookup->type;
+    step->name = name;
+    step->name_len = nbt_name_len(lookup->name);
+    step->key = nbt_make_name_key(name, step->name_len);
+    step->hash = 0; // Only needed by the child index
+    step->index = lookup->index;
+    step->any_name = false;
+    step->any_index = false;
+    step->predicates = NULL;
+    step->predicate_count = 0;
+}
+
+/* Paths up to this long are run without allocating */
+#define NBT_LOOKUP_STEPS 16
+
+/* Runs a path given as lookups */
+static int nbt_find_lookup(const struct nbt_tok_view* tok, nbt_parser* parser, struct nbt_lookup_t* path, int path_size, struct nbt_index_t* res)
+{
+    if (path_size <= 0 || path_size > MAX_NEST_DEPTH) return NBT_WARN;
+
+    struct nbt_query_step local_steps[NBT_LOOKUP_STEPS];
+    struct nbt_query_step* steps = local_steps;
+    if (path_size > NBT_LOOKUP_STEPS) {
+        steps = nbt_alloc(parser, sizeof(struct nbt_query_step) * path_size);
+        if (!steps) return NBT_NOMEM;
+    }
+
+    for (int i = 0; i < path_size; i++)
+    {
+        nbt_fill_step(&steps[i], &path[i], path[i].name);
+        if (parser->child_index) steps[i].hash = nbt_hash_name(steps[i].name, steps[i].name_len);
+    }
+
+    int result = nbt_find_view(tok, parser, steps, path_size, res);
+
+    if (steps != local_steps) nbt_free(parser, steps);
+    return result;
+}
+
+int nbt_find(nbt_tok* tok, const int tok_len, nbt_parser* parser, struct nbt_lookup_t* path, int path_size, struct nbt_index_t* res)
+{
+    struct nbt_tok_view view = {.tok = tok, .ctok = NULL, .len = tok_len};
+
+    return nbt_find_lookup(&view, parser, path, path_size, res);
+}
+
+int nbt_find_compact(nbt_ctok* tok, nbt_parser* parser, struct nbt_lookup_t* path, int path_size, struct nbt_index_t* res)
+{
+    struct nbt_tok_view view = {.tok = NULL, .ctok = tok, .len = tok->tok_len};
+
+    return nbt_find_lookup(&view, parser, path, path_size, res);
+}
+
+/* The predicates of the query are right after its steps */
+nbt_query* nbt_alloc_query(const struct nbt_parser_setting_t* setting, int size, int predicate_count, size_t names_len, char** names)
+{
+    if (size <= 0 || size > MAX_NEST_DEPTH) return NULL;
+
+    /* The query, its steps, its predicates and a copy of every name are kept in one allocation */
+    nbt_query* query = nbt_setting_alloc(setting, sizeof(nbt_query) + sizeof(struct nbt_query_step) * size + sizeof(struct nbt_predicate) * predicate_count + names_len);
+    if (!query) return NULL;
+
+    query->steps = (struct nbt_query_step*)(query + 1);
+    query->size = size;
+    query->wildcards = false;
+    query->setting = setting;
+
+    *names = (char*)((struct nbt_predicate*)(query->steps + size) + predicate_count);
+
+    return query;
+}
+
+nbt_query* nbt_compile_query(const struct nbt_parser_setting_t* setting, const struct nbt_lookup_t* path, int path_size)
+{
+    size_t names_len = 0;
+    for (int i = 0; i < path_size; i++)
+    {
+        names_len += nbt_name_len(path[i].name) + 1;
+    }
+
+    char* names;
+    nbt_query* query = nbt_alloc_query(setting, path_size, 0, names_len, &names);
+    if (!query) return NULL;
+
+    for (int i = 0; i < path_size; i++)
+    {
+        size_t name_len = nbt_name_len(path[i].name);
+        memcpy(names, path[i].name, name_len);
+        names[name_len] = '\0';
+
+        nbt_fill_step(&query->steps[i], &path[i], names);
+        query->steps[i].hash = nbt_hash_name(names, query->steps[i].name_len);
+        names += name_len + 1;
+    }
+
+    return query;
+}
+
+void nbt_destroy_query(nbt_query* query)
+{
+    if (!query) return;
+
+    nbt_setting_free(query->setting, query);
+}
+
+int nbt_find_query(nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* query, struct nbt_index_t* res)
+{
+    /* Wildcards may have to look further than the first matching child, which only the iterator does */
+    if (query->wildcards) {
+        nbt_iter it;
+        if (nbt_iter_init(&it, tok, tok_len, parser, query)) return NBT_WARN;
+
+        return nbt_iter_next(&it, res) >= 0 ? 0 : NBT_WARN;
+    }
+
+    struct nbt_tok_view view = {.tok = tok, .ctok = NULL, .len = tok_len};
+
+    return nbt_find_view(&view, parser, query->steps, query->size, res);
+}
+
+int nbt_iter_init(nbt_iter* it, nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* query)
+{
+    if (query->size > MAX_DEPTH) return NBT_WARN;
+
+    it->query = query;
+    it->tok = (struct nbt_tok_view){.tok = tok, .ctok = NULL, .len = tok_len};
+    it->parser = parser;
+
+    it->depth = 0;
+    it->frames[0] = (struct nbt_iter_frame){.pos = 0, .end = tok_len, .collapsed = NBT_NOT_AVAIL};
+
+    return 0;
+}
+
+/* Starts walking the elements of a collapsed list, only those the list step selects */
+static void nbt_iter_open_collapsed(nbt_iter* it, struct nbt_iter_frame* frame, const int token_id)
+{
+    const struct nbt_query_step* steps = it->query->steps;
+    const int start = nbt_view_return_start(&it->tok, token_id);
+
+    if (it->depth != it->query->size - 1) return;
+    if (!nbt_type_matches(it->parser->nbt_data->content[start - 5], steps[it->depth].type)) return;
+
+    long entries = char_to_int(it->parser->nbt_data->content + start - 4);
+    long index = steps[it->depth - 1].index > 0 ? steps[it->depth - 1].index : 0;
+
+    /* Predicates need compounds */
+    if (steps[it->depth - 1].predicate_count) return;
+
+    frame->collapsed = token_id;
+    if (steps[it->depth - 1].any_index) {
+        frame->element = 0;
+        frame->collapsed_end = entries;
+    }
+    else {
+        frame->element = index;
+        frame->collapsed_end = index < entries ? index + 1 : index;
+    }
+}
+
+int nbt_iter_next(nbt_iter* it, struct nbt_index_t* res)
+{
+    const struct nbt_query_step* steps = it->query->steps;
+    const int size = it->query->size;
+    const struct nbt_tok_view* tok = &it->tok;
+
+    while (it->depth >= 0)
+    {
+        struct nbt_iter_frame* frame = &it->frames[it->depth];
+        const struct nbt_query_step* step = &steps[it->depth];
+
+        if (frame->collapsed != NBT_NOT_AVAIL) {
+            if (frame->element >= frame->collapsed_end) {
+                frame->collapsed = NBT_NOT_AVAIL;
+                continue;
+            }
+
+            int start = nbt_view_return_start(tok, frame->collapsed);
+            int width = nbt_view_return_len(tok, frame->collapsed) / char_to_int(it->parser->nbt_data->content + start - 4);
+
+            res->start = start + frame->element * width;
+            res->end = res->start + width - 1;
+            res->len = width;
+
+            frame->element++;
+            return frame->collapsed;
+        }
+
+        if (frame->pos >= frame->end) {
+            it->depth--;
+            continue;
+        }
+
+        int i = frame->pos;
+        int next = nbt_view_return_next(tok, i);
+        if (next <= i) {
+            it->depth = NBT_NOT_AVAIL;
+            return NBT_WARN;
+        }
+        frame->pos = next;
+
+        nbt_type_t type = nbt_view_return_type(tok, i);
+        if (type == nbt_identifier) continue;
+
+        if (frame->in_list && type == nbt_primitive) {
+            nbt_iter_open_collapsed(it, frame, i);
+            continue;
+        }
+
+        long element = frame->element++;
+        if (!nbt_type_matches(type, step->type)) continue;
+
+        bool wildcard;
+        if (frame->in_list) {
+            long index = steps[it->depth - 1].index > 0 ? steps[it->depth - 1].index : 0;
+
+            const struct nbt_query_step* list_step = &steps[it->depth - 1];
+            wildcard = list_step->any_index || list_step->predicate_count;
+            if (!wildcard && element != index) continue;
+
+            if (list_step->predicate_count && (type != nbt_compound || !nbt_match_predicates(tok, it->parser, i, list_step))) continue;
+        }
+        else {
+            wildcard = step->any_name;
+            if (!wildcard) {
+                int id = nbt_get_identifier_index(i, tok);
+                if (id == NBT_WARN || !nbt_cmp_tok_id(id, tok, it->parser, step)) continue;
+            }
+        }
+
+        /* Without a wildcard only the first match is followed, like in nbt_find */
+        if (!wildcard) frame->pos = frame->end;
+
+        if (it->depth == size - 1) {
+            int result = i;
+            if (type != nbt_compound && type != nbt_list) result = nbt_get_pr_index(i, tok);
+
+            res->start = nbt_view_return_start(tok, result);
+            res->end = nbt_view_return_end(tok, result);
+            res->len = nbt_view_return_len(tok, result);
+
+            return i;
+        }
+
+        it->depth++;
+        it->frames[it->depth] = (struct nbt_iter_frame){.pos = i + 1, .end = next, .in_list = type == nbt_list, .collapsed = NBT_NOT_AVAIL};
+
+        /* Go straight to the element a list step selects */
+        if (type == nbt_list && !step->any_index && !step->predicate_count && step->index > 0) {
+            int element = nbt_list_element(tok, it->parser, i, step->index);
+            if (element >= 0) {
+                it->frames[it->depth].pos = element;
+                it->frames[it->depth].element = step->index;
+            }
+            else if (element == NBT_WARN) {
+                it->frames[it->depth].pos = next;
+            }
+        }
+    }
+
+    return NBT_WARN;
+}
+
+/* Returns the number of children of a compound, names are not counted */
+static int nbt_count_children(nbt_tok* tok, int compound)
+{
+    int children = 0;
+
+    for (int i = compound + 1; i < tok[compound].next; i = tok[i].next)
+    {
+        if (tok[i].next <= i) return 0;
+        if (tok[i].type != nbt_identifier) children++;
+    }
+
+    return children;
+}
+
+int nbt_build_index(nbt_parser* parser, nbt_tok* tok, const int tok_len, int min_children)
+{
+    nbt_destroy_index(parser);
+
+    if (min_children < 1) min_children = 1;
+
+    /* Size every table to keep it at most half full */
+    size_t slots = 0;
+    for (int i = 0; i < tok_len; i++)
+    {
+        if (tok[i].type != nbt_compound) continue;
+
+        int children = nbt_count_children(tok, i);
+        if (children < min_children) continue;
+
+        uint32_t capacity = 2;
+        while (capacity < (uint32_t)children * 2) capacity *= 2;
+        slots += capacity + 1;
+    }
+
+    size_t size = sizeof(struct nbt_child_index_t) + sizeof(int32_t) * (tok_len + slots);
+    struct nbt_child_index_t* index = nbt_alloc(parser, size);
+    if (!index) return NBT_NOMEM;
+
+    index->tok = tok;
+    index->ctok = NULL;
+    index->tok_len = tok_len;
+    index->tables = (int32_t*)(index + 1);
+    index->slots = index->tables + tok_len;
+    index->size = size;
+
+    size_t offset = 0;
+    for (int i = 0; i < tok_len; i++)
+    {
+        index->tables[i] = -1;
+        if (tok[i].type != nbt_compound) continue;
+
+        int children = nbt_count_children(tok, i);
+        if (children < min_children) continue;
+
+        uint32_t capacity = 2;
+        while (capacity < (uint32_t)children * 2) capacity *= 2;
+
+        int32_t* table = index->slots + offset;
+        table[0] = capacity;
+        memset(table + 1, 0xff, sizeof(int32_t) * capacity);
+
+        for (int child = i + 1; child < tok[i].next; child = tok[child].next)
+        {
+            if (tok[child].type == nbt_identifier) continue;
+
+            nbt_tok* id = &tok[child + 1];
+            uint32_t hash = nbt_hash_name(parser->nbt_data->content + id->start + 2, id->len - 2);
+
+            uint32_t slot = hash & (capacity - 1);
+            while (table[slot + 1] >= 0) slot = (slot + 1) & (capacity - 1);
+            table[slot + 1] = child;
+        }
+
+        index->tables[i] = offset;
+        offset += capacity + 1;
+    }
+
+    parser->child_index = index;
+
+    return 0;
+}
+
+void nbt_destroy_index(nbt_parser* parser)
+{
+    nbt_free(parser, parser->child_index);
+    parser->child_index = NULL;
+}
+
+struct nbt_batch_state {
+    const struct nbt_tok_view* tok;
+    nbt_parser* parser;
+
+    const nbt_query* const* queries;
+    struct nbt_index_t* res;
+    int* status;
+};
+
+static void nbt_batch_result(struct nbt_batch_state* st, int token_id, int query)
+{
+    nbt_type_t type = nbt_view_return_type(st->tok, token_id);
+
+    if (type != nbt_compound && type != nbt_list) {
+        token_id = nbt_get_pr_index(token_id, st->tok);
+        if (token_id == NBT_WARN) return;
+    }
+
+    st->res[query].start = nbt_view_return_start(st->tok, token_id);
+    st->res[query].end = nbt_view_return_end(st->tok, token_id);
+    st->res[query].len = nbt_view_return_len(st->tok, token_id);
+    st->status[query] = 0;
+}
+
+/*
+ * Matches the queries in `active` against the children of a token, which are in [first, end).
+ * Every query goes into the first child its step matches, like in nbt_find, and queries that go into the same child are walked together.
+ * `active` is reordered, the queries for each child are put right after it.
+ */
+static void nbt_batch_level(struct nbt_batch_state* st, int first, int end, const int depth, const bool in_list, int* active, int count)
+{
+    int* sub = active + count;
+    int element = 0;
+
+    for (int i = first; i < end && count > 0;)
+    {
+        int next = nbt_view_return_next(st->tok, i);
+        if (next <= i) return;
+
+        nbt_type_t type = nbt_view_return_type(st->tok, i);
+        if (type == nbt_identifier) {
+            i = next;
+            continue;
+        }
+
+        int sub_count = 0;
+        for (int k = 0; k < count;)
+        {
+            int query = active[k];
+            const struct nbt_query_step* steps = st->queries[query]->steps;
+            const int size = st->queries[query]->size;
+
+            bool matched = false;
+            if (in_list && type == nbt_primitive) {
+                st->status[query] = nbt_find_collapsed(i, st->tok, st->parser, steps, depth, size, &st->res[query]);
+                active[k] = active[--count];
+                continue;
+            }
+            if (nbt_type_matches(type, steps[depth].type)) {
+                if (in_list) {
+                    long index = steps[depth - 1].index;
+                    matched = element == (index > 0 ? index : 0);
+                }
+                else {
+                    int id = nbt_get_identifier_index(i, st->tok);
+                    matched = id != NBT_WARN && nbt_cmp_tok_id(id, st->tok, st->parser, &steps[depth]);
+                }
+            }
+
+            if (!matched) {
+                k++;
+                continue;
+            }
+
+            active[k] = active[--count];
+            if (depth + 1 == size) {
+                nbt_batch_result(st, i, query);
+            }
+            else {
+                sub[sub_count++] = query;
+            }
+        }
+
+        if (sub_count) nbt_batch_level(st, i + 1, next, depth + 1, type == nbt_list, sub, sub_count);
+
+        if (in_list) element++;
+        i = next;
+    }
+}
+
+int nbt_find_batch(nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* const* queries, int query_count, struct nbt_index_t* res, int* status)
+{
+    if (query_count <= 0) return 0;
+
+    int max_size = 0;
+    for (int i = 0; i < query_count; i++)
+    {
+        status[i] = NBT_WARN;
+        if (queries[i]->size > max_size) max_size = queries[i]->size;
+    }
+
+    /* Every level of the walk keeps the queries still going through it, small batches do not need an allocation */
+    int stack_active[256];
+    int* active = stack_active;
+
+    size_t active_len = (size_t)query_count * (max_size + 1);
+    if (active_len > 256) {
+        active = nbt_alloc(parser, sizeof(int) * active_len);
+        if (!active) return NBT_NOMEM;
+    }
+
+    int active_count = 0;
+    for (int i = 0; i < query_count; i++)
+    {
+        if (queries[i]->wildcards) {
+            status[i] = nbt_find_query(tok, tok_len, parser, queries[i], &res[i]);
+            continue;
+        }
+        active[active_count++] = i;
+    }
+
+    struct nbt_tok_view view = {.tok = tok, .ctok = NULL, .len = tok_len};
+    struct nbt_batch_state st = {.tok = &view, .parser = parser, .queries = queries, .res = res, .status = status};
+    nbt_batch_level(&st, 0, tok_len, 0, false, active, active_count);
+
+    if (active != stack_active) nbt_free(parser, active);
+
+    int found = 0;
+    for (int i = 0; i < query_count; i++)
+    {
+        if (status[i] == 0) found++;
+    }
+
+    return found;
+}
+
+int nbt_first_child(nbt_tok* tok, const int tok_len, int index)
+{
+    int next = nbt_tok_return_next(tok, index, tok_len);
+    if (next == NBT_WARN) return NBT_WARN;
+
+    int child = index + 1;
+
+    /* The name of a tag is not a child */
+    if (child < next && nbt_tok_return_type(tok, child, tok_len) == nbt_identifier) child++;
+    if (child >= next) return NBT_WARN;
+
+    return child;
+}
+
+int nbt_next_sibling(nbt_tok* tok, const int tok_len, int index)
+{
+    int next = nbt_tok_return_next(tok, index, tok_len);
+    if (next == NBT_WARN || next >= tok_len) return NBT_WARN;
+
+    if (nbt_tok_return_parent(tok, next, tok_len) != nbt_tok_return_parent(tok, index, tok_len)) return NBT_WARN;
+
+    return next;
+}
+
+/* Checks that a result is a value of `len` bytes inside the NBT data */
+static const char* nbt_get_value(nbt_parser* parser, const struct nbt_index_t* res, const int len)
+{
+    if (res->len != len || res->start < 0 || res->start + len > parser->nbt_data->len) return NULL;
+
+    return parser->nbt_data->content + res->start;
+}
+
+int nbt_get_byte(nbt_parser* parser, const struct nbt_index_t* res, int8_t* value)
+{
+    const char* data = nbt_get_value(parser, res, 1);
+    if (!data) return NBT_WARN;
+
+    *value = data[0];
+    return 0;
+}
+
+int nbt_get_short(nbt_parser* parser, const struct nbt_index_t* res, int16_t* value)
+{
+    const char* data = nbt_get_value(parser, res, 2);
+    if (!data) return NBT_WARN;
+
+    *value = char_to_short(data);
+    return 0;
+}
+
+int nbt_get_int(nbt_parser* parser, const struct nbt_index_t* res, int32_t* value)
+{
+    const char* data = nbt_get_value(parser, res, 4);
+    if (!data) return NBT_WARN;
+
+    *value = char_to_int(data);
+    return 0;
+}
+
+int nbt_get_long(nbt_parser* parser, const struct nbt_index_t* res, int64_t* value)
+{
+    const char* data = nbt_get_value(parser, res, 8);
+    if (!data) return NBT_WARN;
+
+    *value = char_to_long(data);
+    return 0;
+}
+
+int nbt_get_float(nbt_parser* parser, const struct nbt_index_t* res, float* value)
+{
+    const char* data = nbt_get_value(parser, res, 4);
+    if (!data) return NBT_WARN;
+
+    *value = char_to_float(data);
+    return 0;
+}
+
+int nbt_get_double(nbt_parser* parser, const struct nbt_index_t* res, double* value)
+{
+    const char* data = nbt_get_value(parser, res, 8);
+    if (!data) return NBT_WARN;
+
+    *value = char_to_double(data);
+    return 0;
+}
+
+int nbt_get_string(nbt_parser* parser, const struct nbt_index_t* res, struct nbt_string_view* view)
+{
+    if (res->len < 2) return NBT_WARN;
+
+    const char* data = nbt_get_value(parser, res, res->len);
+    if (!data || char_to_ushort(data) != res->len - 2) return NBT_WARN;
+
+    view->str = data + 2;
+    view->len = res->len - 2;
+    return 0;
+}
+
+int nbt_get_array(nbt_parser* parser, const struct nbt_index_t* res, const nbt_type_t type, struct nbt_array_view* view)
+{
+    int width;
+    switch (type) {
+        case nbt_byte_array: width = 1; break;
+        case nbt_int_array: width = 4; break;
+        case nbt_long_array: width = 8; break;
+        default: return NBT_WARN;
+    }
+
+    if (res->len < 4) return NBT_WARN;
+
+    const char* data = nbt_get_value(parser, res, res->len);
+    if (!data) return NBT_WARN;
+
+    int32_t count = char_to_int(data);
+    if (count < 0 || (int64_t)count * width != res->len - 4) return NBT_WARN;
+
+    view->data = data + 4;
+    view->len = count;
+    view->width = width;
+    return 0;
+}
+
+int8_t nbt_array_byte(const struct nbt_array_view* view, int index)
+{
+    return view->data[index];
+}
+
+int32_t nbt_array_int(const struct nbt_array_view* view, int index)
+{
+    return char_to_int(view->data + (size_t)index * 4);
+}
+
+int64_t nbt_array_long(const struct nbt_array_view* view, int index)
+{
+    return char_to_long(view->data + (size_t)index * 8);
+}
+
+/* Size of the native value of a type, 0 if it has none */
+static int nbt_native_size(const nbt_type_t type)
+{
+    switch (type) {
+        case nbt_byte: return 1;
+        case nbt_short: return 2;
+        case nbt_int: return 4;
+        case nbt_long: return 8;
+        case nbt_float: return 4;
+        case nbt_double: return 8;
+        default: return 0;
+    }
+}
+
+/* Decodes `count` big-endian values of `type` into the native array `out` */
+static void nbt_store_values(const char* data, const nbt_type_t type, const int count, void* out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        switch (type) {
+            case nbt_byte: ((int8_t*)out)[i] = data[i]; break;
+            case nbt_short: ((int16_t*)out)[i] = char_to_short(data + i * 2); break;
+            case nbt_int: ((int32_t*)out)[i] = char_to_int(data + i * 4); break;
+            case nbt_long: ((int64_t*)out)[i] = char_to_long(data + i * 8); break;
+            case nbt_float: ((float*)out)[i] = char_to_float(data + i * 4); break;
+            case nbt_double: ((double*)out)[i] = char_to_double(data + i * 8); break;
+            default: break;
+        }
+    }
+}
+
+/* Stores the elements of the list token `list`, which must be `width` values of `type` */
+static bool nbt_store_list(const struct nbt_tok_view* tok, nbt_parser* parser, const int list, const nbt_type_t type, const int width, char* out)
+{
+    const char* content = parser->nbt_data->content;
+    const int size = nbt_native_size(type);
+    const int end = nbt_view_return_next(tok, list);
+
+    int stored = 0;
+    for (int i = list + 1; i < end; i = nbt_view_return_next(tok, i))
+    {
+        if (nbt_view_return_next(tok, i) <= i) return false;
+
+        nbt_type_t elem_type = nbt_view_return_type(tok, i);
+        if (elem_type == nbt_identifier) continue;
+
+        if (elem_type == nbt_primitive) { // Collapsed
+            int start = nbt_view_return_start(tok, i);
+            if (content[start - 5] != type || char_to_int(content + start - 4) != width) return false;
+
+            nbt_store_values(content + start, type, width, out);
+            return true;
+        }
+
+        if (elem_type != type || stored == width) return false;
+
+        int value = nbt_get_pr_index(i, tok);
+        if (value == NBT_WARN || nbt_view_return_len(tok, value) != size) return false;
+
+        nbt_store_values(content + nbt_view_return_start(tok, value), type, 1, out + stored * size);
+        stored++;
+    }
+
+    return stored == width;
+}
+
+/* Stores the value at token `t` found at `res`, returns false if it is not `width` values of `type` */
+static bool nbt_store_column_value(const struct nbt_tok_view* tok, nbt_parser* parser, const int t, const struct nbt_index_t* res, const nbt_type_t type, const int width, char* out)
+{
+    const char* content = parser->nbt_data->content;
+
+    nbt_type_t found = nbt_view_return_type(tok, t);
+    if (found == nbt_primitive) found = content[nbt_view_return_start(tok, t) - 5]; // An element of a collapsed list
+
+    if (found == type) {
+        if (width != 1 || res->len != nbt_native_size(type)) return false;
+
+        nbt_store_values(content + res->start, type, 1, out);
+        return true;
+    }
+
+    if ((found == nbt_byte_array && type == nbt_byte) || (found == nbt_int_array && type == nbt_int) || (found == nbt_long_array && type == nbt_long)) {
+        if (char_to_int(content + res->start) != width) return false;
+
+        nbt_store_values(content + res->start + 4, type, width, out);
+        return true;
+    }
+
+    if (found == nbt_list) return nbt_store_list(tok, parser, t, type, width, out);
+
+    return false;
+}
+
+int nbt_extract_column(nbt_tok* tok, const int tok_len, nbt_parser* parser, const nbt_query* list, const nbt_query* field, const nbt_type_t type, const int width, void* out, const int out_len, uint8_t* missing)
+{
+    const int size = nbt_native_size(type);
+    if (!size || width <= 0 || (field && field->wildcards)) return NBT_WARN;
+
+    struct nbt_tok_view view = {.tok = tok, .ctok = NULL, .len = tok_len};
+    const char* content = parser->nbt_data->content;
+
+    /* Find the list */
+    nbt_iter it;
+    struct nbt_index_t res;
+    if (nbt_iter_init(&it, tok, tok_len, parser, list)) return NBT_WARN;
+
+    int list_tok = nbt_iter_next(&it, &res);
+    if (list_tok < 0 || tok[list_tok].type != nbt_list) return NBT_WARN;
+
+    if (missing) memset(missing, 0, (out_len + 7) / 8);
+
+    char* column = out;
+    const size_t entry_size = (size_t)size * width;
+
+    int element = 0;
+    for (int i = list_tok + 1; i < tok[list_tok].next; i = tok[i].next)
+    {
+        if (tok[i].next <= i) return NBT_WARN;
+        if (tok[i].type == nbt_identifier) continue;
+
+        /* The elements of a collapsed list are the values */
+        if (tok[i].type == nbt_primitive) {
+            int entries = char_to_int(content + tok[i].start - 4);
+            if (field || width != 1 || content[tok[i].start - 5] != type) {
+                for (int k = 0; k < entries && k < out_len; k++)
+                {
+                    memset(column + k * entry_size, 0, entry_size);
+                    if (missing) missing[k / 8] |= 1 << (k % 8);
+                }
+            }
+            else {
+                nbt_store_values(content + tok[i].start, type, entries < out_len ? entries : out_len, column);
+            }
+            return entries;
+        }
+
+        if (element < out_len) {
+            char* entry = column + element * entry_size;
+
+            bool stored;
+            if (field) {
+                int t = nbt_find_range(&view, parser, field->steps, field->size, i + 1, tok[i].next, &res);
+                stored = t >= 0 && nbt_store_column_value(&view, parser, t, &res, type, width, entry);
+            }
+            else {
+                int value = tok[i].type == nbt_compound || tok[i].type == nbt_list ? i : nbt_get_pr_index(i, &view);
+                stored = value >= 0;
+                if (stored) {
+                    res = (struct nbt_index_t){.start = tok[value].start, .end = tok[value].end, .len = tok[value].len};
+                    stored = nbt_store_column_value(&view, parser, i, &res, type, width, entry);
+                }
+            }
+
+            if (!stored) {
+                memset(entry, 0, entry_size);
+                if (missing) missing[element / 8] |= 1 << (element % 8);
+            }
+        }
+
+        element++;
+    }
+
+    return element;
+}
@@ -0,0 +1,680 @@
+#include "libnbt.h"
+#include "nbt_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#define MAX_PREDICATES 64
+
+/* A step as it is written in the expression, names are still escaped */
+struct nbt_expr_step {
+    nbt_type_t type;
+    bool typed; // The type was written out
+
+    const char* name;
+    int name_len;
+    bool quoted;
+
+    long index;
+
+    bool any_name;
+    bool any_index;
+
+    int predicate_start; // Index in the predicates of the expression
+    int predicate_count;
+};
+
+/* A predicate as it is written in the expression */
+struct nbt_expr_predicate {
+    const char* name;
+    int name_len;
+    bool quoted;
+
+    enum nbt_predicate_op op;
+
+    const char* string; // NULL for a number
+    int string_len;
+
+    double number;
+    int64_t integer;
+    bool integral;
+};
+
+/* Expressions up to this size are parsed without allocating */
+#define NBT_EXPR_STEPS 16
+#define NBT_EXPR_PREDICATES 8
+
+struct nbt_expr {
+    struct nbt_expr_step* steps;
+    int max_steps;
+    int size;
+
+    struct nbt_expr_predicate* predicates;
+    int max_predicates;
+    int predicate_count;
+};
+
+static const char* nbt_type_names[] = {
+    [nbt_end] = "end",
+    [nbt_byte] = "byte",
+    [nbt_short] = "short",
+    [nbt_int] = "int",
+    [nbt_long] = "long",
+    [nbt_float] = "float",
+    [nbt_double] = "double",
+    [nbt_byte_array] = "byte_array",
+    [nbt_string] = "string",
+    [nbt_list] = "list",
+    [nbt_compound] = "compound",
+    [nbt_int_array] = "int_array",
+    [nbt_long_array] = "long_array"
+};
+
+static bool nbt_is_name_char(const char c)
+{
+    return c != '\0' && c != '.' && c != '[' && c != ']' && c != ':' && c != '"';
+}
+
+/* Reads `:type` if there is one */
+static int nbt_parse_type_annotation(const char** expr, struct nbt_expr_step* step)
+{
+    if (**expr != ':') return 0;
+    (*expr)++;
+
+    int len = 0;
+    while (nbt_is_name_char((*expr)[len])) len++;
+
+    for (int type = nbt_byte; type <= nbt_long_array; type++)
+    {
+        if ((int)strlen(nbt_type_names[type]) == len && memcmp(nbt_type_names[type], *expr, len) == 0) {
+            step->type = type;
+            step->typed = true;
+            *expr += len;
+            return 0;
+        }
+    }
+
+    return NBT_WARN;
+}
+
+/* Reads a string in double quotes, `str` is set to its escaped content */
+static int nbt_parse_quoted(const char** expr, const char** str, int* str_len)
+{
+    const char* p = *expr + 1;
+    *str = p;
+
+    while (*p != '"')
+    {
+        if (*p == '\0') return NBT_WARN;
+        if (*p == '\\') {
+            p++;
+            if (*p != '"' && *p != '\\') return NBT_WARN;
+        }
+        p++;
+    }
+
+    *str_len = p - *str;
+    *expr = p + 1;
+    return 0;
+}
+
+static int nbt_parse_name(const char** expr, struct nbt_expr_step* step)
+{
+    const char* p = *expr;
+
+    if (*p == '"') {
+        step->quoted = true;
+        return nbt_parse_quoted(expr, &step->name, &step->name_len);
+    }
+
+    step->name = p;
+    while (nbt_is_name_char(*p)) p++;
+
+    step->name_len = p - step->name;
+    if (step->name_len == 0) return NBT_WARN;
+
+    /* Only an unquoted * is a wildcard, "*" is a name */
+    if (step->name_len == 1 && *step->name == '*') {
+        step->any_name = true;
+        step->name_len = 0;
+    }
+
+    *expr = p;
+    return 0;
+}
+
+static int nbt_parse_op(const char** expr, enum nbt_predicate_op* op)
+{
+    const char* p = *expr;
+
+    if (p[0] == '=' && p[1] == '=') *op = NBT_OP_EQ;
+    else if (p[0] == '!' && p[1] == '=') *op = NBT_OP_NE;
+    else if (p[0] == '<' && p[1] == '=') *op = NBT_OP_LE;
+    else if (p[0] == '>' && p[1] == '=') *op = NBT_OP_GE;
+    else if (p[0] == '<') *op = NBT_OP_LT;
+    else if (p[0] == '>') *op = NBT_OP_GT;
+    else return NBT_WARN;
+
+    *expr = p + ((p[1] == '=') ? 2 : 1);
+    return 0;
+}
+
+static int nbt_parse_number(const char** expr, struct nbt_expr_predicate* pred)
+{
+    const char* p = *expr;
+    char* end;
+
+    errno = 0;
+    pred->number = strtod(p, &end);
+    if (end == p || errno) return NBT_WARN;
+
+    /* Only decimal numbers, strtod would also read hexadecimal, `inf` and `nan` */
+    for (const char* c = p; c < end; c++)
+    {
+        if (!isdigit((unsigned char)*c) && !strchr("+-.eE", *c)) return NBT_WARN;
+    }
+
+    /* Whole numbers are compared exactly, as a double cannot hold every long */
+    char* int_end;
+    pred->integer = strtoll(p, &int_end, 10);
+    pred->integral = int_end == end && !errno;
+
+    *expr = end;
+    return 0;
+}
+
+/* Reads `?name op value && ...]`, the `[` has already been read */
+static int nbt_parse_predicates(const char** expr, struct nbt_expr* e, struct nbt_expr_step* step)
+{
+    const char* p = *expr + 1;
+
+    step->predicate_start = e->predicate_count;
+
+    for (;;)
+    {
+        if (e->predicate_count >= e->max_predicates) return NBT_WARN;
+
+        struct nbt_expr_predicate* pred = &e->predicates[e->predicate_count++];
+        *pred = (struct nbt_expr_predicate){0};
+
+        if (*p == '"') {
+            pred->quoted = true;
+            if (nbt_parse_quoted(&p, &pred->name, &pred->name_len)) return NBT_WARN;
+        }
+        else {
+            pred->name = p;
+            while (nbt_is_name_char(*p) && *p != '=' && *p != '!' && *p != '<' && *p != '>') p++;
+
+            pred->name_len = p - pred->name;
+            if (pred->name_len == 0) return NBT_WARN;
+        }
+
+        if (nbt_parse_op(&p, &pred->op)) return NBT_WARN;
+
+        if (*p == '"') {
+            if (nbt_parse_quoted(&p, &pred->string, &pred->string_len)) return NBT_WARN;
+        }
+        else if (nbt_parse_number(&p, pred)) {
+            return NBT_WARN;
+        }
+
+        step->predicate_count++;
+
+        if (*p == ']') break;
+        if (p[0] != '&' || p[1] != '&') return NBT_WARN;
+        p += 2;
+    }
+
+    *expr = p + 1;
+    return 0;
+}
+
+/* Every step is the child of the step before it, so its type follows from what comes after it */
+static int nbt_set_container(struct nbt_expr_step* step, const nbt_type_t type)
+{
+    if (step->typed && step->type != type) return NBT_WARN;
+
+    step->type = type;
+    return 0;
+}
+
+static int nbt_parse_index(const char** expr, struct nbt_expr_step* step)
+{
+    const char* p = *expr;
+
+    if (p[0] == '*' && p[1] == ']') {
+        step->any_index = true;
+        *expr = p + 2;
+        return 0;
+    }
+
+    if (*p < '0' || *p > '9') return NBT_WARN;
+
+    long value = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        if (value > (INT32_MAX - (*p - '0')) / 10) return NBT_WARN;
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+
+    if (*p != ']') return NBT_WARN;
+
+    step->index = value;
+    *expr = p + 1;
+    return 0;
+}
+
+/* Returns the number of steps, or NBT_WARN if the expression is invalid */
+static int nbt_parse_expr(const char* expr, struct nbt_expr* e)
+{
+    struct nbt_expr_step* steps = e->steps;
+    int size = 0;
+
+    e->predicate_count = 0;
+
+    for (;;)
+    {
+        if (size >= e->max_steps) return NBT_WARN;
+
+        struct nbt_expr_step* step = &steps[size++];
+        *step = (struct nbt_expr_step){.type = NBT_ANY_TYPE};
+
+        if (nbt_parse_name(&expr, step)) return NBT_WARN;
+        if (nbt_parse_type_annotation(&expr, step)) return NBT_WARN;
+
+        /* Elements of a list, which have no name */
+        while (*expr == '[')
+        {
+            expr++;
+            if (nbt_set_container(step, nbt_list)) return NBT_WARN;
+
+            if (*expr == '?') {
+                if (nbt_parse_predicates(&expr, e, step)) return NBT_WARN;
+            }
+            else if (nbt_parse_index(&expr, step)) {
+                return NBT_WARN;
+            }
+
+            if (size >= e->max_steps) return NBT_WARN;
+            step = &steps[size++];
+            *step = (struct nbt_expr_step){.type = NBT_ANY_TYPE};
+
+            if (nbt_parse_type_annotation(&expr, step)) return NBT_WARN;
+        }
+
+        if (*expr == '\0') break;
+        if (*expr != '.') return NBT_WARN;
+
+        expr++;
+        if (nbt_set_container(step, nbt_compound)) return NBT_WARN;
+    }
+
+    e->size = size;
+    return size;
+}
+
+/* Copies a string without its escapes, returns its length */
+static int nbt_unescape(char* dst, const char* src, const int src_len, const bool quoted)
+{
+    int len = 0;
+
+    for (int i = 0; i < src_len; i++)
+    {
+        if (quoted && src[i] == '\\') i++;
+        dst[len++] = src[i];
+    }
+    dst[len] = '\0';
+
+    return len;
+}
+
+/* Flipping the sign bit makes two's complement big-endian bytes compare like the values */
+static void nbt_int_key(unsigned char* key, const int64_t value, const int width)
+{
+    for (int i = 0; i < width; i++)
+    {
+        key[i] = (uint64_t)value >> (8 * (width - 1 - i));
+    }
+    key[0] ^= 0x80;
+}
+
+/* IEEE 754 bits compare like the values once negative numbers have every bit flipped, and positive ones their sign bit */
+static uint64_t nbt_float_order(uint64_t bits, const int width)
+{
+    uint64_t sign = 1ull << (width * 8 - 1);
+    uint64_t mask = width == 8 ? UINT64_MAX : (1ull << (width * 8)) - 1;
+
+    if ((bits & mask & ~sign) == 0) bits = 0; // -0.0 is equal to 0.0
+
+    return (bits & sign) ? ~bits & mask : bits | sign;
+}
+
+static void nbt_fill_predicate(struct nbt_predicate* pred, const struct nbt_expr_predicate* src, char** names)
+{
+    pred->name = *names;
+    pred->name_len = nbt_unescape(*names, src->name, src->name_len, src->quoted);
+    pred->key = nbt_make_name_key(*names, pred->name_len);
+    *names += pred->name_len + 1;
+
+    pred->op = src->op;
+
+    if (src->string) {
+        /* Store it with the length prefix, like in NBT */
+        int len = nbt_unescape(*names + 2, src->string, src->string_len, true);
+        (*names)[0] = (unsigned)len >> 8;
+        (*names)[1] = len;
+
+        pred->string = *names;
+        pred->string_len = len + 2;
+        *names += len + 3;
+        return;
+    }
+
+    pred->string = NULL;
+    pred->string_len = -1;
+    pred->number = src->number;
+    pred->integral = src->integral;
+
+    static const int widths[4] = {1, 2, 4, 8};
+    for (int i = 0; i < 4; i++)
+    {
+        int64_t max = i == 3 ? INT64_MAX : (1ll << (widths[i] * 8 - 1)) - 1;
+        pred->int_fits[i] = src->integral && src->integer >= -max - 1 && src->integer <= max;
+        if (pred->int_fits[i]) nbt_int_key(pred->int_keys[i], src->integer, widths[i]);
+    }
+
+    float f = src->number;
+    uint32_t f_bits;
+    memcpy(&f_bits, &f, sizeof(f_bits));
+    pred->float_key = nbt_float_order(f_bits, 4);
+
+    uint64_t d_bits;
+    memcpy(&d_bits, &src->number, sizeof(d_bits));
+    pred->double_key = nbt_float_order(d_bits, 8);
+}
+
+/* Copies the parsed expression into a query, with its names unescaped */
+static nbt_query* nbt_expr_to_query(const struct nbt_parser_setting_t* setting, const struct nbt_expr* e)
+{
+    const int size = e->size;
+
+    size_t names_len = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (e->steps[i].name_len > MAX_NAME_LEN) return NULL;
+        names_len += e->steps[i].name_len + 1;
+    }
+    for (int i = 0; i < e->predicate_count; i++)
+    {
+        if (e->predicates[i].name_len > MAX_NAME_LEN || e->predicates[i].string_len > UINT16_MAX) return NULL;
+        names_len += e->predicates[i].name_len + 1 + (e->predicates[i].string ? e->predicates[i].string_len + 3 : 0);
+    }
+
+    char* names;
+    nbt_query* query = nbt_alloc_query(setting, size, e->predicate_count, names_len, &names);
+    if (!query) return NULL;
+
+    struct nbt_predicate* predicates = (struct nbt_predicate*)(query->steps + size);
+    for (int i = 0; i < e->predicate_count; i++)
+    {
+        nbt_fill_predicate(&predicates[i], &e->predicates[i], &names);
+    }
+
+    for (int i = 0; i < size; i++)
+    {
+        const struct nbt_expr_step* step = &e->steps[i];
+        int name_len = nbt_unescape(names, step->name, step->name_len, step->quoted);
+
+        query->steps[i] = (struct nbt_query_step){
+            .type = step->type,
+            .name = names,
+            .name_len = name_len,
+            .key = nbt_make_name_key(names, name_len),
+            .hash = nbt_hash_name(names, name_len),
+            .index = step->index,
+            .any_name = step->any_name,
+            .any_index = step->any_index,
+            .predicates = step->predicate_count ? &predicates[step->predicate_start] : NULL,
+            .predicate_count = step->predicate_count
+        };
+
+        if (step->any_name || step->any_index || step->predicate_count) query->wildcards = true;
+
+        names += name_len + 1;
+    }
+
+    return query;
+}
+
+nbt_query* nbt_compile_expr(const struct nbt_parser_setting_t* setting, const char* expr)
+{
+    /* Every step after the first follows a `.` or a `[`, and every predicate a `?` or a `&&`, which bounds what the expression needs */
+    int max_steps = 1;
+    int max_predicates = 0;
+    for (const char* p = expr; *p; p++)
+    {
+        if (*p == '.' || *p == '[') max_steps++;
+        else if (*p == '?' || *p == '&') max_predicates++;
+    }
+    if (max_steps > MAX_NEST_DEPTH) max_steps = MAX_NEST_DEPTH;
+    if (max_predicates > MAX_PREDICATES) max_predicates = MAX_PREDICATES;
+
+    struct nbt_expr_step local_steps[NBT_EXPR_STEPS];
+    struct nbt_expr_predicate local_predicates[NBT_EXPR_PREDICATES];
+    struct nbt_expr e = {.steps = local_steps, .max_steps = max_steps, .predicates = local_predicates, .max_predicates = max_predicates};
+
+    if (max_steps > NBT_EXPR_STEPS || max_predicates > NBT_EXPR_PREDICATES) {
+        e.steps = nbt_setting_alloc(setting, sizeof(struct nbt_expr_step) * max_steps + sizeof(struct nbt_expr_predicate) * max_predicates);
+        if (!e.steps) return NULL;
+        e.predicates = (struct nbt_expr_predicate*)(e.steps + max_steps);
+    }
+
+    nbt_query* query = NULL;
+    if (nbt_parse_expr(expr, &e) >= 0) query = nbt_expr_to_query(setting, &e);
+
+    if (e.steps != local_steps) nbt_setting_free(setting, e.steps);
+    return query;
+}
+
+static bool nbt_apply_op(const enum nbt_predicate_op op, const int cmp)
+{
+    switch (op) {
+        case NBT_OP_EQ: return cmp == 0;
+        case NBT_OP_NE: return cmp != 0;
+        case NBT_OP_LT: return cmp < 0;
+        case NBT_OP_LE: return cmp <= 0;
+        case NBT_OP_GT: return cmp > 0;
+        case NBT_OP_GE: return cmp >= 0;
+    }
+    return false;
+}
+
+static int nbt_cmp_key(const uint64_t a, const uint64_t b)
+{
+    return (a > b) - (a < b);
+}
+
+static int nbt_sign(const int cmp)
+{
+    return (cmp > 0) - (cmp < 0);
+}
+
+/* Compares the payload of a value with the value of a predicate, returns NBT_NOT_AVAIL if they cannot be compared */
+static int nbt_cmp_payload(const unsigned char* data, const nbt_type_t type, const struct nbt_predicate* pred)
+{
+    if (type == nbt_string) {
+        if (!pred->string) return NBT_NOT_AVAIL;
+
+        int len = (data[0] << 8) | data[1];
+        int pred_len = pred->string_len - 2;
+
+        int cmp = memcmp(data + 2, pred->string + 2, len < pred_len ? len : pred_len);
+        if (cmp) return nbt_sign(cmp);
+        return (len > pred_len) - (len < pred_len);
+    }
+
+    if (pred->string) return NBT_NOT_AVAIL;
+
+    int width;
+    switch (type) {
+        case nbt_byte: width = 0; break;
+        case nbt_short: width = 1; break;
+        case nbt_int: width = 2; break;
+        case nbt_long: width = 3; break;
+
+        case nbt_float: {
+            uint32_t bits = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+            return nbt_cmp_key(nbt_float_order(bits, 4), pred->float_key);
+        }
+        case nbt_double: {
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) bits = (bits << 8) | data[i];
+            return nbt_cmp_key(nbt_float_order(bits, 8), pred->double_key);
+        }
+        default:
+            return NBT_NOT_AVAIL;
+    }
+
+    int bytes = 1 << width;
+    if (pred->int_fits[width]) {
+        int cmp = (data[0] ^ 0x80) - pred->int_keys[width][0];
+        if (cmp) return nbt_sign(cmp);
+        return nbt_sign(memcmp(data + 1, pred->int_keys[width] + 1, bytes - 1));
+    }
+
+    /* The value of the predicate is out of range or not whole, so the payload has to be decoded */
+    uint64_t bits = 0;
+    for (int i = 0; i < bytes; i++) bits = (bits << 8) | data[i];
+
+    /* Sign-extended without shifting a negative value */
+    uint64_t sign = 1ull << (bytes * 8 - 1);
+    int64_t value = (bits & sign) ? -(int64_t)(~bits & (sign - 1)) - 1 : (int64_t)bits;
+
+    return (value > pred->number) - (value < pred->number);
+}
+
+bool nbt_match_predicates(const struct nbt_tok_view* tok, nbt_parser* parser, int compound, const struct nbt_query_step* step)
+{
+    const unsigned char* content = (const unsigned char*)parser->nbt_data->content;
+    const int end = nbt_view_return_next(tok, compound);
+
+    for (int k = 0; k < step->predicate_count; k++)
+    {
+        const struct nbt_predicate* pred = &step->predicates[k];
+
+        int cmp = NBT_NOT_AVAIL;
+        for (int child = compound + 1; child < end; child = nbt_view_return_next(tok, child))
+        {
+            if (nbt_view_return_next(tok, child) <= child) return false;
+
+            nbt_type_t type = nbt_view_return_type(tok, child);
+            if (type == nbt_identifier) continue;
+
+            int id = child + 1;
+            if (nbt_view_return_len(tok, id) != pred->name_len + 2) continue;
+            if (!nbt_name_equals((const char*)content + nbt_view_return_start(tok, id) + 2, pred->name, pred->name_len, &pred->key)) continue;
+
+            if (type != nbt_compound && type != nbt_list) cmp = nbt_cmp_payload(content + nbt_view_return_start(tok, child + 2), type, pred);
+            break;
+        }
+
+        if (cmp == NBT_NOT_AVAIL || !nbt_apply_op(pred->op, cmp)) return false;
+    }
+
+    return true;
+}
+
+nbt_query_cache* nbt_create_query_cache(const struct nbt_parser_setting_t* setting)
+{
+    nbt_query_cache* cache = nbt_setting_alloc(setting, sizeof(nbt_query_cache));
+    if (!cache) return NULL;
+
+    cache->setting = setting;
+    cache->entries = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+
+    return cache;
+}
+
+static struct nbt_query_cache_entry* nbt_cache_slot(struct nbt_query_cache_entry* entries, const int capacity, const char* expr, const uint32_t hash)
+{
+    for (uint32_t slot = hash & (capacity - 1);; slot = (slot + 1) & (capacity - 1))
+    {
+        struct nbt_query_cache_entry* entry = &entries[slot];
+        if (!entry->expr) return entry;
+        if (entry->hash == hash && strcmp(entry->expr, expr) == 0) return entry;
+    }
+}
+
+static int nbt_grow_cache(nbt_query_cache* cache)
+{
+    int capacity = cache->capacity ? cache->capacity * 2 : 16;
+
+    struct nbt_query_cache_entry* entries = nbt_setting_alloc(cache->setting, sizeof(struct nbt_query_cache_entry) * capacity);
+    if (!entries) return NBT_NOMEM;
+    memset(entries, 0, sizeof(struct nbt_query_cache_entry) * capacity);
+
+    for (int i = 0; i < cache->capacity; i++)
+    {
+        struct nbt_query_cache_entry* entry = &cache->entries[i];
+        if (entry->expr) *nbt_cache_slot(entries, capacity, entry->expr, entry->hash) = *entry;
+    }
+
+    nbt_setting_free(cache->setting, cache->entries);
+    cache->entries = entries;
+    cache->capacity = capacity;
+
+    return 0;
+}
+
+const nbt_query* nbt_cache_query(nbt_query_cache* cache, const char* expr)
+{
+    size_t expr_len = strlen(expr);
+    uint32_t hash = nbt_hash_name(expr, expr_len);
+
+    if (cache->capacity) {
+        struct nbt_query_cache_entry* entry = nbt_cache_slot(cache->entries, cache->capacity, expr, hash);
+        if (entry->expr) return entry->query;
+    }
+
+    /* Keep the table at most half full */
+    if ((cache->count + 1) * 2 > cache->capacity && nbt_grow_cache(cache)) return NULL;
+
+    nbt_query* query = nbt_compile_expr(cache->setting, expr);
+    if (!query) return NULL;
+
+    char* key = nbt_setting_alloc(cache->setting, expr_len + 1);
+    if (!key) {
+        nbt_destroy_query(query);
+        return NULL;
+    }
+    memcpy(key, expr, expr_len + 1);
+
+    struct nbt_query_cache_entry* entry = nbt_cache_slot(cache->entries, cache->capacity, expr, hash);
+    *entry = (struct nbt_query_cache_entry){.hash = hash, .expr = key, .query = query};
+    cache->count++;
+
+    return query;
+}
+
+void nbt_destroy_query_cache(nbt_query_cache* cache)
+{
+    if (!cache) return;
+
+    for (int i = 0; i < cache->capacity; i++)
+    {
+        if (!cache->entries[i].expr) continue;
+
+        nbt_setting_free(cache->setting, cache->entries[i].expr);
+        nbt_destroy_query(cache->entries[i].query);
+    }
+
+    nbt_setting_free(cache->setting, cache->entries);
+    nbt_setting_free(cache->setting, cache);
+}
@@ -6,26 +6,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <byteswap.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 
-static struct nbt_metadata get_nbt_metadata(struct nbt_parser* parser)
-{
-    struct nbt_metadata result;
-
-    result.type = parser->nbt_data->content[parser->current_byte];
-    parser->current_byte++;
-
-    char entries[4];
-    for (int i = 0; i < 4; i++)
-    {
-        entries[3 - i] = parser->nbt_data->content[parser->current_byte + i];
-    }
-    result.num_of_entries = (int32_t)*entries;
-    parser->current_byte += 4;
-
-    return result;
-}
-
 static int nbt_get_identifier_len(const struct nbt_parser* parser)
 {
     char id_len[2];
@@ -39,350 +24,1162 @@ static int nbt_get_identifier_len(const struct nbt_parser* parser)
 
 }
 
-static int nbt_get_primitive_len(const struct nbt_parser *parser, const nbt_type_t type)
+/* Returns the size of a fixed width primitive, 0 for other types */
+static int nbt_fixed_width(const nbt_type_t type)
 {
-    int len;
+    switch (type) {
+        case nbt_byte:
+            return 1;
+        case nbt_short:
+            return 2;
+        case nbt_int:
+        case nbt_float:
+            return 4;
+        case nbt_long:
+        case nbt_double:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/* Whether a list is stored as a single token covering all of its elements */
+static bool nbt_is_collapsed(const struct nbt_parser_setting_t* setting, const nbt_type_t elem_type, const int32_t entries)
+{
+    if (!setting->collapse_lists) return false;
+
+    return entries > 0 && nbt_fixed_width(elem_type) != 0;
+}
+
+/* Returns the length of the payload of a value of `type` starting at `offset`, including any length prefix */
+static int nbt_payload_len(char* data, const int data_len, const int offset, const nbt_type_t type)
+{
+    int width;
 
     switch (type) {
         case nbt_byte:
-            len = 1;
-            break;
+            return 1;
         case nbt_short:
-            len = 2;
-            break;
+            return 2;
         case nbt_int:
-            len = 4;
-            break;
+        case nbt_float:
+            return 4;
         case nbt_long:
-            len = 8;
+        case nbt_double:
+            return 8;
+
+        case nbt_string:
+            if (offset + 2 > data_len) return NBT_PARTIAL;
+            return char_to_ushort(data + offset) + 2;
+
+        case nbt_byte_array:
+            width = 1;
             break;
-        case nbt_float:
-            len = 4;
+        case nbt_int_array:
+            width = 4;
             break;
-        case nbt_double:
-            len = 8;
+        case nbt_long_array:
+            width = 8;
             break;
 
-        case nbt_byte_array: {
-            char pr_len_ba[4];
-            for (int i = 0; i < 4; i++)
-            {
-                pr_len_ba[i] = parser->nbt_data->content[parser->current_byte + i];
-            }
-            len = char_to_int(pr_len_ba) + 4;
+        default:
+            return NBT_WARN;
+    }
 
-            break;
-        }
+    if (offset + 4 > data_len) return NBT_PARTIAL;
 
-        case nbt_string: {
-            char pr_len_str[2];
-            pr_len_str[0] = parser->nbt_data->content[parser->current_byte];
-            pr_len_str[1] = parser->nbt_data->content[parser->current_byte + 1];
+    int32_t count = char_to_int(data + offset);
+    if (count < 0 || count > (INT32_MAX - 4) / width) return NBT_WARN;
 
-            len = char_to_ushort(pr_len_str) + 2;
+    return count * width + 4;
+}
 
-            break;
-        }
+static int nbt_parse_compound_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    
+    nbt_tok _payload = {.type = nbt_compound, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token, .next = NBT_UNCHANGED};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+
+    parser->current_byte++; // Increment because we expect current byte to be on the byte of the ID
+
+    parser->parent_token = parser->current_token;
+    parser->current_token++;
+    
+    int total_len = 0;
+    /* Get the identifier from data */
+    int id_len = nbt_get_identifier_len(parser);
+
+    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return 1;
+
+    parser->current_token++;
+    parser->current_byte += id_len;
+    total_len += id_len;
+
+    return 0;
+}
+
+static int nbt_parse_compound_end(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    int len = parser->current_byte - nbt_tok_return_start(tok, parser->parent_token, tok_len) + 1;
+
+    nbt_tok _payload = {.type = NBT_UNCHANGED, .start = NBT_UNCHANGED, .end = parser->current_byte, .len = len, .parent = NBT_UNCHANGED, .next = parser->current_token};
+    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return 1;
+
+    parser->parent_token = nbt_tok_return_parent(tok, parser->parent_token, tok_len);
+    parser->current_byte++;
+
+    return 0;
+}
+
+struct nbt_skip_frame {
+    int32_t entries; // Entries left in a list, -1 for a compound
+    nbt_type_t type; // Type of the entries in a list
+};
+
+int nbt_skip(struct nbt_sized_buffer* buf, int offset, nbt_type_t type)
+{
+    char* data = buf->content;
+    const int data_len = buf->len;
+
+    struct nbt_skip_frame stack[MAX_NEST_DEPTH];
+    int depth = 0;
+
+    for (;;)
+    {
+        /* Skip over the payload, or open it if it has children */
+        switch (type) {
+            case nbt_compound:
+                if (depth >= MAX_NEST_DEPTH) return NBT_WARN;
+                stack[depth++] = (struct nbt_skip_frame){.entries = -1, .type = nbt_end};
+                break;
+
+            case nbt_list: {
+                if (offset + 5 > data_len) return NBT_PARTIAL;
+
+                nbt_type_t elem_type = data[offset];
+                int32_t entries = char_to_int(data + offset + 1);
+                offset += 5;
 
-        case nbt_int_array: {
-            char pr_len_int_arr[4];
-            for (int i = 0; i < 4; i++) {
-                pr_len_int_arr[i] = parser->nbt_data->content[parser->current_byte + i];
+                if (entries < 0 || (elem_type == nbt_end && entries > 0)) return NBT_WARN;
+
+                int width = nbt_fixed_width(elem_type);
+                if (width) {
+                    if (entries > (INT32_MAX - offset) / width) return NBT_WARN;
+                    offset += entries * width;
+                }
+                else if (entries > 0) {
+                    if (depth >= MAX_NEST_DEPTH) return NBT_WARN;
+                    stack[depth++] = (struct nbt_skip_frame){.entries = entries, .type = elem_type};
+                }
+                break;
             }
-            len = char_to_int(pr_len_int_arr) * 4 + 4;
 
-            break;
+            default: {
+                int pr_len = nbt_payload_len(data, data_len, offset, type);
+                if (pr_len < 0) return pr_len;
+
+                offset += pr_len;
+                break;
+            }
         }
 
-        case nbt_long_array: {
-            char pr_len_long_arr[4];
-            for (int i = 0; i < 4; i++) {
-                pr_len_long_arr[i] = parser->nbt_data->content[parser->current_byte + i];
+        /* Find the next payload to skip */
+        for (;;)
+        {
+            if (offset > data_len) return NBT_PARTIAL;
+            if (depth == 0) return offset;
+
+            struct nbt_skip_frame* top = &stack[depth - 1];
+
+            if (top->entries < 0) {
+                if (offset >= data_len) return NBT_PARTIAL;
+
+                type = data[offset];
+                if (type == nbt_end) {
+                    offset++;
+                    depth--;
+                    continue;
+                }
+
+                if (offset + 3 > data_len) return NBT_PARTIAL;
+                offset += 3 + char_to_ushort(data + offset + 1);
+                break;
+            }
+
+            if (top->entries == 0) {
+                depth--;
+                continue;
             }
-            len = char_to_int(pr_len_long_arr) * 8 + 4;
 
+            top->entries--;
+            type = top->type;
             break;
         }
-        default:
-            return 0;
     }
-    return len;
 }
 
-static int nbt_parse_simple_data(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+struct nbt_count_state {
+    char* data;
+    int data_len;
+
+    const struct nbt_parser_setting_t* setting;
+
+    int tokens;
+
+    int max_meta; // Highest list metadata index the tokeniser will use
+    bool meta_zero_used;
+};
+
+/* Walks the payload of a value without writing tokens, returns the offset after the value */
+static int nbt_count_payload(struct nbt_count_state* st, int offset, const nbt_type_t type, const int list_index, const int depth)
 {
-    nbt_type_t current_type;
-    int total_len = 0;
-    int sup_token = parser->parent_token; //We need to save the parent token because the ID token is filled once only
+    if (depth > MAX_NEST_DEPTH) return NBT_WARN;
 
+    switch (type) {
+        case nbt_compound: {
+            for (;;)
+            {
+                if (offset >= st->data_len) return NBT_PARTIAL;
 
-    parser->parent_token = parser->current_token;
+                nbt_type_t child_type = st->data[offset];
+                if (child_type == nbt_end) return offset + 1;
 
-    parser->current_token++; //Allocates space for the ID token
+                if (offset + 3 > st->data_len) return NBT_PARTIAL;
+                offset += 3 + char_to_ushort(st->data + offset + 1);
 
-    /* Getting the type ID of the sata */
-    current_type = (nbt_type_t) (parser->nbt_data->content[parser->current_byte]);
-    parser->current_byte++;
-    total_len++;
+                st->tokens += 2; // The ID token and the identifier
 
-    /* Get the identifier of the data */
-    int id_len = nbt_get_identifier_len(parser);
+                offset = nbt_count_payload(st, offset, child_type, list_index, depth + 1);
+                if (offset < 0) return offset;
+            }
+        }
 
-    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return NBT_NOMEM;
+        case nbt_list: {
+            if (offset + 5 > st->data_len) return NBT_PARTIAL;
 
-    parser->current_token++;
-    parser->current_byte += id_len;
-    total_len += id_len;
+            nbt_type_t elem_type = st->data[offset];
+            int32_t entries = char_to_int(st->data + offset + 1);
+            offset += 5;
 
-    /* Get primitve in the data */
-    int pr_len = nbt_get_primitive_len(parser, current_type);
-    if (0 == pr_len) return NBT_WARN;
+            if (entries < 0 || (elem_type == nbt_end && entries > 0)) return NBT_WARN;
 
-    nbt_tok pr_payload = {.type = nbt_primitive, .start = parser->current_byte, .end = parser->current_byte + pr_len - 1, .len = pr_len, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &pr_payload)) return NBT_NOMEM;
+            /* Mirror the way nbt_open_list picks the metadata slot */
+            int index;
+            if (list_index >= 0) {
+                index = list_index + 1;
+            }
+            else {
+                index = st->meta_zero_used ? 1 : 0;
+            }
+            if (index == 0 && elem_type != nbt_end) st->meta_zero_used = true;
+            if (index > st->max_meta) st->max_meta = index;
 
-    parser->current_token++;
-    parser->current_byte += pr_len;
-    total_len += pr_len;
+            if (nbt_is_collapsed(st->setting, elem_type, entries)) {
+                int width = nbt_fixed_width(elem_type);
+                if (entries > (INT32_MAX - offset) / width) return NBT_WARN;
 
-    /* Fill the ID token */
-    nbt_tok _payload = {.type = current_type, .start = parser->current_byte - total_len, .end = parser->current_byte - 1, .len = total_len, .parent = sup_token};
-    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return NBT_NOMEM;
+                st->tokens++; // The primitive token covering all the elements
+                offset += entries * width;
 
-    parser->parent_token = sup_token; // Set parent token back to the original
+                if (offset > st->data_len) return NBT_PARTIAL;
+                return offset;
+            }
 
-    return 0;
+            for (int32_t i = 0; i < entries; i++)
+            {
+                st->tokens++; // The element token
+
+                offset = nbt_count_payload(st, offset, elem_type, index, depth + 1);
+                if (offset < 0) return offset;
+            }
+            return offset;
+        }
+
+        default: {
+            int pr_len = nbt_payload_len(st->data, st->data_len, offset, type);
+            if (pr_len < 0) return pr_len;
+            if (offset + pr_len > st->data_len) return NBT_PARTIAL;
+
+            st->tokens++; // The primitive token
+            return offset + pr_len;
+        }
+    }
 }
 
-static int nbt_parse_element(struct nbt_parser* parser, nbt_type_t current_type, nbt_tok* tok, const int tok_len)
+/* Dry run: counts the tokens needed without writing any */
+static int nbt_count_tokens(struct nbt_parser* parser)
 {
-    int total_len = 0;
-    int sup_token = parser->parent_token; //We need to save the parent token because the ID token is filled once only
+    struct nbt_count_state st = {.data = parser->nbt_data->content, .data_len = parser->nbt_data->len, .setting = parser->setting, .tokens = 0, .max_meta = -1, .meta_zero_used = false};
 
-    parser->parent_token = parser->current_token;
+    if (st.data_len < 3) return NBT_PARTIAL;
+    if (st.data[0] != nbt_compound) return NBT_WARN;
 
-    parser->current_token++; //Allocates space for the ID token
+    st.tokens += 2;
+    int offset = 3 + char_to_ushort(st.data + 1);
 
-    /* Get primitve in the data */
-    int pr_len = nbt_get_primitive_len(parser, current_type);
-    if (0 == pr_len) return NBT_WARN;
+    offset = nbt_count_payload(&st, offset, nbt_compound, -1, 0);
+    if (offset < 0) return offset;
 
-    nbt_tok pr_payload = {.type = nbt_primitive, .start = parser->current_byte, .end = parser->current_byte + pr_len - 1, .len = pr_len, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &pr_payload)) return NBT_NOMEM;
+    parser->list_meta_needed = st.max_meta + 1;
 
-    parser->current_token++;
-    parser->current_byte += pr_len;
-    total_len += pr_len;
-    
+    return st.tokens;
+}
+
+/* State of the tokeniser, kept out of the parser while the loop runs */
+struct nbt_tok_ctx {
+    struct nbt_parser* parser;
+    nbt_tok* tok;
+    int tok_len;
+
+    char* data;
+    int data_len;
+
+    int byte;
+    int token;
+    int parent;
+
+    bool in_list; // The parent token is a list
+    struct nbt_metadata* meta; // Metadata of the innermost list
+};
 
-    /* Fill the ID token */
-    nbt_tok _payload = {.type = current_type, .start = parser->current_byte - total_len, .end = parser->current_byte - 1, .len = total_len, .parent = sup_token};
-    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return NBT_NOMEM;
+typedef int (*nbt_tok_handler)(struct nbt_tok_ctx* ctx, const nbt_type_t type);
 
-    parser->parent_token = sup_token; // Set parent token back to the original
+/* Every handler checks that it can finish before writing anything, so that a failed step can be resumed */
+
+static int nbt_handle_tag(struct nbt_tok_ctx* ctx, const nbt_type_t type)
+{
+    const int start = ctx->byte;
+    if (start + 3 > ctx->data_len) return NBT_PARTIAL;
+
+    const int id_len = char_to_ushort(ctx->data + start + 1) + 2;
+    const int pr_start = start + 1 + id_len;
+
+    const int pr_len = nbt_payload_len(ctx->data, ctx->data_len, pr_start, type);
+    if (pr_len < 0) return pr_len;
+    if (pr_start + pr_len > ctx->data_len) return NBT_PARTIAL;
+    if (ctx->token + 3 > ctx->tok_len) return NBT_NOMEM;
+
+    const int t = ctx->token;
+    const int end = pr_start + pr_len - 1;
+
+    ctx->tok[t] = (nbt_tok){.type = type, .start = start, .end = end, .len = end - start + 1, .parent = ctx->parent, .next = t + 3};
+    ctx->tok[t + 1] = (nbt_tok){.type = nbt_identifier, .start = start + 1, .end = start + id_len, .len = id_len, .parent = t, .next = t + 2};
+    ctx->tok[t + 2] = (nbt_tok){.type = nbt_primitive, .start = pr_start, .end = end, .len = pr_len, .parent = t, .next = t + 3};
+
+    ctx->token += 3;
+    ctx->byte = end + 1;
 
     return 0;
 }
 
-static int nbt_parse_compound_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+static int nbt_handle_element(struct nbt_tok_ctx* ctx, const nbt_type_t type)
 {
-    
-    nbt_tok _payload = {.type = nbt_compound, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+    const int start = ctx->byte;
 
-    parser->current_byte++; // Increment because we expect current byte to be on the byte of the ID
+    const int pr_len = nbt_payload_len(ctx->data, ctx->data_len, start, type);
+    if (pr_len < 0) return pr_len;
+    if (start + pr_len > ctx->data_len) return NBT_PARTIAL;
+    if (ctx->token + 2 > ctx->tok_len) return NBT_NOMEM;
 
-    parser->parent_token = parser->current_token;
-    parser->current_token++;
-    
-    int total_len = 0;
-    /* Get the identifier from data */
-    int id_len = nbt_get_identifier_len(parser);
+    const int t = ctx->token;
+    const int end = start + pr_len - 1;
 
-    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return 1;
+    ctx->tok[t] = (nbt_tok){.type = type, .start = start, .end = end, .len = pr_len, .parent = ctx->parent, .next = t + 2};
+    ctx->tok[t + 1] = (nbt_tok){.type = nbt_primitive, .start = start, .end = end, .len = pr_len, .parent = t, .next = t + 2};
 
-    parser->current_token++;
-    parser->current_byte += id_len;
-    total_len += id_len;
+    ctx->token += 2;
+    ctx->byte = end + 1;
+    ctx->meta->num_of_entries--;
 
     return 0;
 }
 
-static int nbt_parse_element_compound_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+static int nbt_handle_compound(struct nbt_tok_ctx* ctx, const nbt_type_t type)
 {
-    nbt_tok _payload = {.type = nbt_compound, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+    const int start = ctx->byte;
+    if (start + 3 > ctx->data_len) return NBT_PARTIAL;
 
-    parser->parent_token = parser->current_token;
-    parser->current_token++;
+    const int id_len = char_to_ushort(ctx->data + start + 1) + 2;
+    if (start + 1 + id_len > ctx->data_len) return NBT_PARTIAL;
+    if (ctx->token + 2 > ctx->tok_len) return NBT_NOMEM;
+
+    const int t = ctx->token;
+
+    /* The end, length and next token are filled in when the compound is closed */
+    ctx->tok[t] = (nbt_tok){.type = nbt_compound, .start = start, .parent = ctx->parent};
+    ctx->tok[t + 1] = (nbt_tok){.type = nbt_identifier, .start = start + 1, .end = start + id_len, .len = id_len, .parent = t, .next = t + 2};
+
+    ctx->token += 2;
+    ctx->byte = start + 1 + id_len;
+    ctx->parent = t;
+    ctx->in_list = false;
 
     return 0;
 }
 
-static int nbt_parse_compound_end(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+static int nbt_handle_element_compound(struct nbt_tok_ctx* ctx, const nbt_type_t type)
 {
-    int len = parser->current_byte - nbt_tok_return_start(tok, parser->parent_token, tok_len) + 1;
+    if (ctx->token + 1 > ctx->tok_len) return NBT_NOMEM;
 
-    nbt_tok _payload = {.type = NBT_UNCHANGED, .start = NBT_UNCHANGED, .end = parser->current_byte, .len = len, .parent = NBT_UNCHANGED};
-    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return 1;
+    const int t = ctx->token;
+    ctx->tok[t] = (nbt_tok){.type = nbt_compound, .start = ctx->byte, .parent = ctx->parent};
 
-    parser->parent_token = nbt_tok_return_parent(tok, parser->parent_token, tok_len);
-    parser->current_byte++;
+    ctx->token++;
+    ctx->parent = t;
+    ctx->in_list = false;
 
     return 0;
 }
 
-static int nbt_parse_list_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+/* Opens a list starting at `start`, whose element type and number of entries are at `header` */
+static int nbt_open_list(struct nbt_tok_ctx* ctx, const int start, const int header, const int id_len)
 {
-    nbt_tok _payload = {.type = nbt_list, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+    struct nbt_parser* parser = ctx->parser;
 
-    parser->parent_token = parser->current_token;
-    parser->current_token++;
-    parser->current_byte++;
+    if (header + 5 > ctx->data_len) return NBT_PARTIAL;
 
-    /* Get the identifier from data */
-    int id_len = nbt_get_identifier_len(parser);
+    const nbt_type_t elem_type = ctx->data[header];
+    const int32_t entries = char_to_int(ctx->data + header + 1);
+    if (entries < 0 || (elem_type == nbt_end && entries > 0)) return NBT_WARN;
 
-    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return 1;
-    
-    parser->current_token++;
-    parser->current_byte += id_len;
+    int index = parser->cur_index;
+    if (ctx->in_list || ctx->meta->type != nbt_end) index++;
+    if (index >= parser->max_list) return NBT_LNOMEM;
+
+    int tokens = id_len ? 2 : 1;
+    const int pr_start = header + 5;
+    int pr_len = 0;
 
-    /* Get Metadata for the list */
-    struct nbt_metadata meta = get_nbt_metadata(parser);
-    if (parser->list_meta[parser->cur_index].type != nbt_end) parser->cur_index++;
-    if (nbt_add_meta(parser->cur_index, parser, &meta)) return NBT_LNOMEM;
+    const bool collapsed = nbt_is_collapsed(parser->setting, elem_type, entries);
+    if (collapsed) {
+        const int width = nbt_fixed_width(elem_type);
+        if (entries > (INT32_MAX - pr_start) / width) return NBT_WARN;
+
+        pr_len = entries * width;
+        tokens++;
+    }
+
+    if (pr_start + pr_len > ctx->data_len) return NBT_PARTIAL;
+    if (ctx->token + tokens > ctx->tok_len) return NBT_NOMEM;
+
+    const int t = ctx->token;
+    ctx->tok[t] = (nbt_tok){.type = nbt_list, .start = start, .parent = ctx->parent};
+    ctx->token++;
+
+    if (id_len) {
+        ctx->tok[t + 1] = (nbt_tok){.type = nbt_identifier, .start = start + 1, .end = start + id_len, .len = id_len, .parent = t, .next = t + 2};
+        ctx->token++;
+    }
+
+    parser->cur_index = index;
+    ctx->meta = &parser->list_meta[index];
+    ctx->meta->type = elem_type;
+    ctx->meta->num_of_entries = entries;
+
+    ctx->byte = pr_start;
+    ctx->parent = t;
+    ctx->in_list = true;
+
+    if (collapsed) {
+        ctx->tok[ctx->token] = (nbt_tok){.type = nbt_primitive, .start = pr_start, .end = pr_start + pr_len - 1, .len = pr_len, .parent = t, .next = ctx->token + 1};
+        ctx->token++;
+        ctx->byte += pr_len;
+
+        ctx->meta->num_of_entries = 0; // Close the list straight away
+    }
 
     return 0;
 }
 
-static int nbt_parse_element_list_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+static int nbt_handle_list(struct nbt_tok_ctx* ctx, const nbt_type_t type)
 {
-    nbt_tok _payload = {.type = nbt_list, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token};
-    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+    const int start = ctx->byte;
+    if (start + 3 > ctx->data_len) return NBT_PARTIAL;
 
-    parser->parent_token = parser->current_token;
-    parser->current_token++;
+    const int id_len = char_to_ushort(ctx->data + start + 1) + 2;
+
+    return nbt_open_list(ctx, start, start + 1 + id_len, id_len);
+}
+
+static int nbt_handle_element_list(struct nbt_tok_ctx* ctx, const nbt_type_t type)
+{
+    return nbt_open_list(ctx, ctx->byte, ctx->byte, 0);
+}
 
-    struct nbt_metadata meta = get_nbt_metadata(parser);
-    if (nbt_add_meta(parser->cur_index, parser, &meta)) return NBT_LNOMEM;
+static int nbt_handle_end(struct nbt_tok_ctx* ctx, const nbt_type_t type)
+{
+    nbt_tok* compound = &ctx->tok[ctx->parent];
+    compound->end = ctx->byte;
+    compound->len = ctx->byte - compound->start + 1;
+    compound->next = ctx->token;
+
+    ctx->parent = compound->parent;
+    ctx->byte++;
+
+    ctx->in_list = ctx->parent >= 0 && ctx->tok[ctx->parent].type == nbt_list;
+    if (ctx->in_list && ctx->meta->num_of_entries != NBT_NOT_AVAIL) ctx->meta->num_of_entries--;
 
     return 0;
 }
 
-static int nbt_parse_list_end(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+/* Handlers for tags in a compound, indexed by type ID */
+static const nbt_tok_handler nbt_tag_handlers[nbt_long_array + 1] = {
+    [nbt_end] = nbt_handle_end,
+    [nbt_byte] = nbt_handle_tag,
+    [nbt_short] = nbt_handle_tag,
+    [nbt_int] = nbt_handle_tag,
+    [nbt_long] = nbt_handle_tag,
+    [nbt_float] = nbt_handle_tag,
+    [nbt_double] = nbt_handle_tag,
+    [nbt_byte_array] = nbt_handle_tag,
+    [nbt_string] = nbt_handle_tag,
+    [nbt_list] = nbt_handle_list,
+    [nbt_compound] = nbt_handle_compound,
+    [nbt_int_array] = nbt_handle_tag,
+    [nbt_long_array] = nbt_handle_tag
+};
+
+/* Handlers for elements of a list, indexed by type ID */
+static const nbt_tok_handler nbt_element_handlers[nbt_long_array + 1] = {
+    [nbt_end] = NULL,
+    [nbt_byte] = nbt_handle_element,
+    [nbt_short] = nbt_handle_element,
+    [nbt_int] = nbt_handle_element,
+    [nbt_long] = nbt_handle_element,
+    [nbt_float] = nbt_handle_element,
+    [nbt_double] = nbt_handle_element,
+    [nbt_byte_array] = nbt_handle_element,
+    [nbt_string] = nbt_handle_element,
+    [nbt_list] = nbt_handle_element_list,
+    [nbt_compound] = nbt_handle_element_compound,
+    [nbt_int_array] = nbt_handle_element,
+    [nbt_long_array] = nbt_handle_element
+};
+
+/* Tokenises until the parent token is `stop_parent` again, NBT_NOT_AVAIL tokenises the whole data */
+static int nbt_tokenise_loop(nbt_parser *parser, nbt_tok* tok, const int tok_len, const int stop_parent)
 {
-    int len = parser->current_byte - nbt_tok_return_start(tok, parser->parent_token, tok_len);
+    /* The root compound has already been closed */
+    if (parser->parent_token == NBT_NOT_AVAIL && parser->current_token > 0) return 0;
+
+    struct nbt_tok_ctx ctx = {
+        .parser = parser,
+        .tok = tok,
+        .tok_len = tok_len,
+        .data = parser->nbt_data->content,
+        .data_len = parser->nbt_data->len,
+        .byte = parser->current_byte,
+        .token = parser->current_token,
+        .parent = parser->parent_token,
+        .meta = &parser->list_meta[parser->cur_index]
+    };
+    ctx.in_list = ctx.parent >= 0 && tok[ctx.parent].type == nbt_list;
+
+    int res = 0;
+    for (;;)
+    {
+        nbt_type_t type;
+        const nbt_tok_handler* handlers;
 
-    nbt_tok _payload = {.type = NBT_UNCHANGED, .start = NBT_UNCHANGED, .end = parser->current_byte - 1, .len = len, .parent = NBT_UNCHANGED};
-    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return 1;
+        if (ctx.in_list) {
+            type = ctx.meta->type;
+            handlers = nbt_element_handlers;
+        }
+        else {
+            if (ctx.byte >= ctx.data_len) {
+                res = NBT_PARTIAL;
+                break;
+            }
+            type = ctx.data[ctx.byte];
+            handlers = nbt_tag_handlers;
+        }
 
-    parser->parent_token = nbt_tok_return_parent(tok, parser->parent_token, tok_len);
+        if (type < 0 || type > nbt_long_array || !handlers[type] || (ctx.parent == NBT_NOT_AVAIL && type != nbt_compound)) {
+            res = NBT_WARN;
+            break;
+        }
+
+        res = handlers[type](&ctx, type);
+        if (res) break;
+
+        /* Close every list that has run out of entries */
+        while (ctx.in_list && ctx.meta->num_of_entries == 0)
+        {
+            nbt_tok* list = &ctx.tok[ctx.parent];
+            list->end = ctx.byte - 1;
+            list->len = ctx.byte - list->start;
+            list->next = ctx.token;
+
+            ctx.parent = list->parent;
 
-    parser->list_meta[parser->cur_index].num_of_entries = NBT_NOT_AVAIL;
+            ctx.meta->num_of_entries = NBT_NOT_AVAIL;
+            if (parser->cur_index > 0) parser->cur_index--;
+            ctx.meta = &parser->list_meta[parser->cur_index];
+
+            ctx.in_list = ctx.parent >= 0 && ctx.tok[ctx.parent].type == nbt_list;
+            if (ctx.in_list) ctx.meta->num_of_entries--;
+        }
+
+        if (ctx.parent == stop_parent || ctx.parent == NBT_NOT_AVAIL) break;
+    }
+
+    parser->current_byte = ctx.byte;
+    parser->current_token = ctx.token;
+    parser->parent_token = ctx.parent;
+
+    return res;
+}
+
+/* Tokenises into the tokens owned by the parser, growing the storage that runs out and resuming */
+static int nbt_tokenise_grow(nbt_parser *parser, const int stop_parent)
+{
+    for (;;)
+    {
+        int res = nbt_tokenise_loop(parser, parser->tok, parser->tok_len, stop_parent);
+
+        if (res == NBT_NOMEM) {
+            if (nbt_grow_tokens(parser)) return NBT_NOMEM;
+        }
+        else if (res == NBT_LNOMEM) {
+            if (nbt_grow_meta(parser)) return NBT_LNOMEM;
+        }
+        else {
+            return res;
+        }
+    }
+}
+
+static int nbt_tokenise_until(nbt_parser *parser, nbt_tok* tok, const int tok_len, const int stop_parent)
+{
+    if (!parser->setting->auto_grow) return nbt_tokenise_loop(parser, tok, tok_len, stop_parent);
+
+    return nbt_tokenise_grow(parser, stop_parent);
+}
+
+/* Returns the first element of a list, NBT_WARN if it is empty */
+static int nbt_first_element(const nbt_tok* tok, const int list)
+{
+    int first = list + 1;
+    if (first < tok[list].next && tok[first].type == nbt_identifier) first++;
+
+    return first < tok[list].next ? first : NBT_WARN;
+}
+
+/* Lists of other tags need no table, their elements all take the same number of tokens */
+static int nbt_count_indexed_elements(const nbt_tok* tok, const int list)
+{
+    if (tok[list].type != nbt_list) return 0;
+
+    int first = nbt_first_element(tok, list);
+    if (first == NBT_WARN || (tok[first].type != nbt_compound && tok[first].type != nbt_list)) return 0;
+
+    int elements = 0;
+    for (int i = first; i < tok[list].next; i = tok[i].next)
+    {
+        if (tok[i].next <= i) return 0;
+        elements++;
+    }
+
+    return elements;
+}
+
+int nbt_index_lists(nbt_parser* parser, const nbt_tok* tok, const int tok_len)
+{
+    nbt_destroy_list_index(parser);
+
+    size_t slots = 0;
+    for (int i = 0; i < tok_len; i++)
+    {
+        int elements = nbt_count_indexed_elements(tok, i);
+        if (elements) slots += elements + 1;
+    }
+
+    struct nbt_list_index_t* index = nbt_alloc(parser, sizeof(struct nbt_list_index_t) + sizeof(int32_t) * (tok_len + slots));
+    if (!index) return NBT_NOMEM;
+
+    index->tok = tok;
+    index->tok_len = tok_len;
+    index->tables = (int32_t*)(index + 1);
+    index->elements = index->tables + tok_len;
+
+    size_t offset = 0;
+    for (int i = 0; i < tok_len; i++)
+    {
+        index->tables[i] = -1;
+
+        int elements = nbt_count_indexed_elements(tok, i);
+        if (!elements) continue;
+
+        int32_t* table = index->elements + offset;
+        table[0] = elements;
+
+        int k = 1;
+        for (int element = nbt_first_element(tok, i); element < tok[i].next; element = tok[element].next)
+        {
+            table[k++] = element;
+        }
+
+        index->tables[i] = offset;
+        offset += elements + 1;
+    }
+
+    parser->list_index = index;
 
     return 0;
 }
 
+void nbt_destroy_list_index(nbt_parser* parser)
+{
+    nbt_free(parser, parser->list_index);
+    parser->list_index = NULL;
+}
+
 int nbt_tokenise(nbt_parser *parser, nbt_tok* tok, const int tok_len)
 {
+    if (!tok && !parser->setting->auto_grow) return nbt_count_tokens(parser);
+
+    int res = nbt_tokenise_until(parser, tok, tok_len, NBT_NOT_AVAIL);
+    if (res || !parser->setting->index_lists) return res;
+
+    /* The tokens are complete, so the elements of every list are known. Without the index, lists are scanned */
+    nbt_index_lists(parser, tok ? tok : parser->tok, parser->current_token);
+    return 0;
+}
+
+struct nbt_project_state {
+    nbt_tok* tok;
+    int tok_len;
+
+    const struct nbt_path_t* paths;
+    int path_count;
+
+    /* Number of steps of each path matched by the compounds currently open */
+    int* matched;
+};
+
+static bool nbt_step_matches(const struct nbt_lookup_t* step, const nbt_type_t type, const char* name, const int name_len)
+{
+    if (step->type != type) return false;
+    if (strlen(step->name) != name_len) return false;
+
+    return memcmp(step->name, name, name_len) == 0;
+}
+
+static void nbt_project_refresh(struct nbt_parser* parser, struct nbt_project_state* st)
+{
+    if (!parser->setting->auto_grow) return;
+
+    st->tok = parser->tok;
+    st->tok_len = parser->tok_len;
+}
+
+/* Tokenises the children of the current compound that are on a path, and skips the others */
+static int nbt_project_compound(struct nbt_parser* parser, struct nbt_project_state* st, const int depth)
+{
+    char* data = parser->nbt_data->content;
+    const int data_len = parser->nbt_data->len;
+    const int container = parser->parent_token;
+
     for (;;)
     {
-        char current_char;
-        if (nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list) {
-            current_char = parser->list_meta[parser->cur_index].type;
+        if (parser->current_byte >= data_len) return NBT_PARTIAL;
+
+        nbt_type_t type = data[parser->current_byte];
+
+        if (type == nbt_end) {
+            if (nbt_parse_compound_end(parser, st->tok, st->tok_len)) return NBT_NOMEM;
+            return 0;
         }
-        else {
-            current_char = parser->nbt_data->content[parser->current_byte];
+
+        if (parser->current_byte + 3 > data_len) return NBT_PARTIAL;
+
+        int name_len = char_to_ushort(data + parser->current_byte + 1);
+        char* name = data + parser->current_byte + 3;
+        if (parser->current_byte + 3 + name_len > data_len) return NBT_PARTIAL;
+
+        bool whole = false;
+        bool descend = false;
+        for (int p = 0; p < st->path_count; p++)
+        {
+            if (st->matched[p] != depth) continue;
+            if (!nbt_step_matches(&st->paths[p].path[depth], type, name, name_len)) continue;
+
+            if (depth + 1 == st->paths[p].path_size || type != nbt_compound) {
+                whole = true;
+            }
+            else {
+                descend = true;
+            }
         }
-        // debug("current char is %d, index is %d", current_char, parser->current_byte);
-        switch (current_char) {
-            case nbt_byte:
-            case nbt_short:    
-            case nbt_int:
-            case nbt_long:
-            case nbt_float:
-            case nbt_double:
-            case nbt_byte_array:
-            case nbt_string:
-            case nbt_int_array:
-            case nbt_long_array: {
-                // debug("In %s: type id is %d", __FUNCTION__ , current_char);
-                
-                if (nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list) {
-                    int res = nbt_parse_element(parser, current_char, tok, tok_len);
-                    if (res) return res;
-                    parser->list_meta[parser->cur_index].num_of_entries--;
-                }
-                else {
-                    int res = nbt_parse_simple_data(parser, tok, tok_len);
-                    if (res) return res;
-                }
-                break;
+
+        if (whole) {
+            int res = nbt_tokenise_until(parser, st->tok, st->tok_len, container);
+            nbt_project_refresh(parser, st);
+            if (res) return res;
+        }
+        else if (descend) {
+            while (parser->current_token + 2 > st->tok_len)
+            {
+                if (!parser->setting->auto_grow || nbt_grow_tokens(parser)) return NBT_NOMEM;
+                nbt_project_refresh(parser, st);
             }
+            if (nbt_parse_compound_start(parser, st->tok, st->tok_len)) return NBT_NOMEM;
 
-            case nbt_list: {
-                // debug("in nbt_list");
-                if (parser->list_meta[parser->cur_index].num_of_entries > 0 && nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list) {
-                    parser->cur_index++;
-                    if (nbt_parse_element_list_start(parser, tok, tok_len)) return NBT_NOMEM;
-                }
-                else {
-                    if (nbt_parse_list_start(parser, tok, tok_len)) return NBT_NOMEM;
-                }    
-                break;
+            for (int p = 0; p < st->path_count; p++)
+            {
+                if (st->matched[p] == depth && nbt_step_matches(&st->paths[p].path[depth], type, name, name_len)) st->matched[p]++;
             }
 
-            case nbt_compound: {
-                // debug("In %s:nbt_compound", __FUNCTION__ );
-                if (nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list) {
-                    if (nbt_parse_element_compound_start(parser, tok, tok_len)) return NBT_NOMEM;
-                }
-                else {
-                    if (nbt_parse_compound_start(parser, tok, tok_len)) return NBT_NOMEM;
-                }    
-                break;
+            int res = nbt_project_compound(parser, st, depth + 1);
+            if (res) return res;
+
+            for (int p = 0; p < st->path_count; p++)
+            {
+                if (st->matched[p] == depth + 1) st->matched[p]--;
             }
-            /* Exit point */
-            case nbt_end: {
-                // debug("In %s:nbt_end",__FUNCTION__ );
+        }
+        else {
+            /* Not on any path, only its length is needed */
+            int end = nbt_skip(parser->nbt_data, parser->current_byte + 3 + name_len, type);
+            if (end < 0) return end;
+
+            parser->current_byte = end;
+        }
+    }
+}
+
+int nbt_tokenise_paths(nbt_parser* parser, nbt_tok* tok, const int tok_len, const struct nbt_path_t* paths, int path_count)
+{
+    struct nbt_project_state st = {.tok = tok, .tok_len = tok_len, .paths = paths, .path_count = path_count};
+    nbt_project_refresh(parser, &st);
+
+    char* data = parser->nbt_data->content;
+    const int data_len = parser->nbt_data->len;
+
+    if (parser->current_token > 0) return NBT_WARN; // Only a fresh parser can be used
+    if (data_len < 3) return NBT_PARTIAL;
+    if (data[0] != nbt_compound) return NBT_WARN;
+
+    int name_len = char_to_ushort(data + 1);
+    if (3 + name_len > data_len) return NBT_PARTIAL;
 
-                if (nbt_parse_compound_end(parser, tok, tok_len)) return NBT_NOMEM;
+    st.matched = nbt_alloc(parser, sizeof(int) * (path_count + 1));
+    if (!st.matched) return NBT_NOMEM;
+
+    bool whole = false;
+    for (int p = 0; p < path_count; p++)
+    {
+        st.matched[p] = -1;
+        if (paths[p].path_size <= 0) continue;
+        if (!nbt_step_matches(&paths[p].path[0], nbt_compound, data + 3, name_len)) continue;
+
+        st.matched[p] = 1;
+        if (paths[p].path_size == 1) whole = true;
+    }
+
+    int res;
+    if (whole) {
+        res = nbt_tokenise_until(parser, st.tok, st.tok_len, NBT_NOT_AVAIL);
+    }
+    else {
+        res = 0;
+        while (parser->current_token + 2 > st.tok_len && res == 0)
+        {
+            if (!parser->setting->auto_grow || nbt_grow_tokens(parser)) res = NBT_NOMEM;
+            nbt_project_refresh(parser, &st);
+        }
+
+        if (res == 0 && nbt_parse_compound_start(parser, st.tok, st.tok_len)) res = NBT_NOMEM;
+        if (res == 0) res = nbt_project_compound(parser, &st, 1);
+    }
+
+    nbt_free(parser, st.matched);
+
+    if (res == 0 && parser->setting->index_lists) nbt_index_lists(parser, st.tok, parser->current_token);
+
+    return res;
+}
 
-                if (parser->parent_token == NBT_NOT_AVAIL) return 0;
+struct nbt_parallel_child {
+    int offset; // Index of the type ID of the child
+    int end; // Index of the first byte after the child
 
-                if (nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list && parser->list_meta[parser->cur_index].num_of_entries != NBT_NOT_AVAIL) parser->list_meta[parser->cur_index].num_of_entries--;
+    /* Tokens of the child, index 0 stands for the root compound */
+    nbt_tok* tok;
+    int tokens;
+
+    int base; // Index of the first token of the child in the result
+};
+
+struct nbt_parallel_job {
+    struct nbt_parser* parser;
+    nbt_tok* tok;
+
+    struct nbt_parallel_child** order; // Largest children first
+    int child_count;
+
+    bool copy; // Copy the tokens of the children into place instead of tokenising them
+
+    atomic_int next;
+    atomic_int res;
+};
+
+/* Tokenises a child on its own, growing its private tokens and list metadata as needed */
+static int nbt_parallel_tokenise(struct nbt_parser* parser, struct nbt_parallel_child* child)
+{
+    struct nbt_parser sub = {.nbt_data = parser->nbt_data, .setting = parser->setting};
+
+    /* About one token for every 4 bytes, grown if the child has more */
+    sub.tok_len = (child->end - child->offset) / 4 + 4;
+    sub.tok = nbt_alloc(parser, sizeof(nbt_tok) * sub.tok_len);
+    if (!sub.tok) return NBT_NOMEM;
+
+    /* The list metadata is as deep as that of the parser, and only grows with auto_grow like nbt_tokenise */
+    sub.max_list = parser->max_list;
+    if (parser->setting->auto_grow && sub.max_list < 1) sub.max_list = 1;
+    sub.list_meta = nbt_alloc(parser, sizeof(struct nbt_metadata) * (sub.max_list + 1));
+    if (!sub.list_meta) {
+        nbt_free(parser, sub.tok);
+        return NBT_LNOMEM;
+    }
+
+    memset(sub.list_meta, 0, sizeof(struct nbt_metadata) * (sub.max_list + 1));
+    sub.list_meta->num_of_entries = NBT_NOT_AVAIL;
+
+    sub.tok[0] = (nbt_tok){.type = nbt_compound, .parent = NBT_NOT_AVAIL};
+    sub.current_byte = child->offset;
+    sub.current_token = 1;
+    sub.parent_token = 0;
+
+    /* The tokens are private, so they are grown whatever the setting */
+    int res;
+    for (;;)
+    {
+        res = nbt_tokenise_loop(&sub, sub.tok, sub.tok_len, 0);
+
+        if (res == NBT_NOMEM) {
+            if (nbt_grow_tokens(&sub)) break;
+        }
+        else if (res == NBT_LNOMEM && parser->setting->auto_grow) {
+            if (nbt_grow_meta(&sub)) break;
+        }
+        else {
+            break;
+        }
+    }
+
+    nbt_free(parser, sub.list_meta);
+
+    child->tok = sub.tok;
+    child->tokens = sub.current_token - 1;
+
+    return res;
+}
+
+/* Moves the tokens of a child to its place in the result, token 0 of the child is the root compound */
+static void nbt_parallel_copy(nbt_tok* tok, const struct nbt_parallel_child* child)
+{
+    const int shift = child->base - 1;
+
+    for (int i = 1; i <= child->tokens; i++)
+    {
+        nbt_tok t = child->tok[i];
+        if (t.parent > 0) t.parent += shift;
+        t.next += shift;
+
+        tok[i + shift] = t;
+    }
+}
+
+static void* nbt_parallel_worker(void* arg)
+{
+    struct nbt_parallel_job* job = arg;
+
+    for (;;)
+    {
+        int i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->child_count) break;
+
+        int res = 0;
+        if (job->copy) {
+            nbt_parallel_copy(job->tok, job->order[i]);
+        }
+        else {
+            res = nbt_parallel_tokenise(job->parser, job->order[i]);
+        }
+
+        if (res) atomic_store(&job->res, res);
+    }
+
+    return NULL;
+}
+
+static int nbt_parallel_run(struct nbt_parallel_job* job, int threads)
+{
+    pthread_t workers[MAX_THREADS];
+    int started = 0;
+
+    atomic_store(&job->next, 0);
+
+    for (; started < threads - 1; started++)
+    {
+        if (pthread_create(&workers[started], NULL, nbt_parallel_worker, job)) break;
+    }
+
+    nbt_parallel_worker(job); // The calling thread works too
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    return atomic_load(&job->res);
+}
+
+static int nbt_cmp_child_size(const void* a, const void* b)
+{
+    const struct nbt_parallel_child* child_a = *(struct nbt_parallel_child* const*)a;
+    const struct nbt_parallel_child* child_b = *(struct nbt_parallel_child* const*)b;
+
+    return (child_b->end - child_b->offset) - (child_a->end - child_a->offset);
+}
+
+static void nbt_free_children(nbt_parser* parser, struct nbt_parallel_child* children, const int child_count, struct nbt_parallel_child** order)
+{
+    for (int i = 0; i < child_count; i++)
+    {
+        nbt_free(parser, children[i].tok);
+    }
+    nbt_free(parser, order);
+    nbt_free(parser, children);
+}
+
+int nbt_tokenise_threads(nbt_parser* parser, nbt_tok* tok, const int tok_len, int threads)
+{
+    /* A dry run, a parser that has already started and data that is not a whole compound are left to nbt_tokenise */
+    if (threads <= 1 || (!tok && !parser->setting->auto_grow) || parser->current_token > 0) return nbt_tokenise(parser, tok, tok_len);
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    char* data = parser->nbt_data->content;
+    const int data_len = parser->nbt_data->len;
+
+    if (data_len < 3 || data[0] != nbt_compound) return nbt_tokenise(parser, tok, tok_len);
+
+    int offset = 3 + char_to_ushort(data + 1);
+
+    /* Find where the children of the root compound are */
+    struct nbt_parallel_child* children = NULL;
+    int child_count = 0;
+    int child_cap = 0;
+
+    int res = 0;
+    for (;;)
+    {
+        if (offset >= data_len) {
+            res = NBT_PARTIAL;
+            break;
+        }
+        if (data[offset] == nbt_end) break;
+        if (offset + 3 > data_len) {
+            res = NBT_PARTIAL;
+            break;
+        }
+
+        int end = nbt_skip(parser->nbt_data, offset + 3 + char_to_ushort(data + offset + 1), data[offset]);
+        if (end < 0) {
+            res = end;
+            break;
+        }
+
+        if (child_count == child_cap) {
+            int new_cap = child_cap ? child_cap * 2 : 16;
+
+            struct nbt_parallel_child* new_children = nbt_realloc(parser, children, sizeof(struct nbt_parallel_child) * new_cap, sizeof(struct nbt_parallel_child) * child_cap);
+            if (!new_children) {
+                res = NBT_NOMEM;
                 break;
             }
-            default:
-                return NBT_WARN;
-                break;
+            children = new_children;
+            child_cap = new_cap;
         }
 
-        bool has_list_end = false;
-        int entries = nbt_meta_return_entries(parser, parser->cur_index);
-        if (entries == 0 && parser->parent_token != NBT_NOT_AVAIL) has_list_end = true;
+        children[child_count++] = (struct nbt_parallel_child){.offset = offset, .end = end};
+        offset = end;
+    }
+
+    struct nbt_parallel_child** order = NULL;
+    if (res == 0 && child_count > 0) {
+        order = nbt_alloc(parser, sizeof(struct nbt_parallel_child*) * child_count);
+        if (!order) res = NBT_NOMEM;
+    }
 
-        while (has_list_end)
+    struct nbt_parallel_job job = {.parser = parser, .tok = tok, .order = order, .child_count = child_count, .copy = false};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.res, 0);
+
+    if (res == 0 && child_count > 0) {
+        for (int i = 0; i < child_count; i++)
         {
-            if (nbt_parse_list_end(parser, tok, tok_len)) return NBT_NOMEM;
-            
-            if (parser->cur_index > 0) parser->cur_index--;
+            order[i] = &children[i];
+        }
+        qsort(order, child_count, sizeof(struct nbt_parallel_child*), nbt_cmp_child_size);
 
-            if (parser->parent_token != NBT_NOT_AVAIL && nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list) {
-                parser->list_meta[parser->cur_index].num_of_entries--;
-                if (parser->list_meta[parser->cur_index].num_of_entries > 0) {
-                    has_list_end = false;
-                }
-            }
-            else
-            {
-                has_list_end = false;
-            }
+        res = nbt_parallel_run(&job, threads);
+    }
+
+    /* Give every child its own range of tokens, in the same order as nbt_tokenise */
+    int total = 2;
+    for (int i = 0; res == 0 && i < child_count; i++)
+    {
+        children[i].base = total;
+        total += children[i].tokens;
+    }
+
+    nbt_tok* out_tok = tok;
+    int out_len = tok_len;
+    if (res == 0 && parser->setting->auto_grow) {
+        while (parser->tok_len < total && res == 0)
+        {
+            res = nbt_grow_tokens(parser);
         }
+        out_tok = parser->tok;
+        out_len = parser->tok_len;
+    }
+
+    /* The parser is untouched until here, so on any error nbt_tokenise gives the tokens and code it would have given */
+    if (res || total > out_len) {
+        nbt_free_children(parser, children, child_count, order);
+        return nbt_tokenise(parser, tok, tok_len);
+    }
+
+    if (nbt_parse_compound_start(parser, out_tok, out_len)) res = NBT_NOMEM;
+
+    if (res == 0 && child_count > 0) {
+        job.tok = out_tok;
+        job.copy = true;
+        res = nbt_parallel_run(&job, threads);
     }
-}  
+
+    if (res == 0) {
+        /* Close the root compound */
+        parser->current_byte = offset;
+        parser->current_token = total;
+        res = nbt_tokenise_loop(parser, out_tok, out_len, NBT_NOT_AVAIL);
+    }
+
+    nbt_free_children(parser, children, child_count, order);
+
+    if (res == 0 && parser->setting->index_lists) nbt_index_lists(parser, out_tok, parser->current_token);
+
+    return res;
+}
+
+int nbt_tokenise_parallel(nbt_parser* parser, nbt_tok* tok, const int tok_len, int threads)
+{
+    /* Threads beyond the number of processors only add copying to the work of nbt_tokenise */
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors > 0 && threads > processors) threads = processors;
+
+    return nbt_tokenise_threads(parser, tok, tok_len, threads);
+}
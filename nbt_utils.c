@@ -6,6 +6,10 @@
 #include <string.h>
 #include <byteswap.h>
 
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
 void swap_char_2(char* input, char* output)
 {
     output[0] = input[1];
@@ -46,98 +50,149 @@ void safe_swap_8(char* input, char* output)
     memcpy(output, buf, 8);
 }
 
-uint16_t char_to_ushort(char* input)
+void nbt_fill_token(nbt_tok *token, nbt_type_t type, int start, int end, int len, int parent, int next)
 {
-    int16_t result;
-    memcpy(&result, input, sizeof(int16_t));
-    return bswap_16(result);
+    if (type != NBT_UNCHANGED) token->type = type;
+    if (start != NBT_UNCHANGED) token->start = start;
+    if (end != NBT_UNCHANGED ) token->end = end;
+    if (len != NBT_UNCHANGED) token->len = len;
+    if (parent != NBT_UNCHANGED) token->parent = parent;
+    if (next != NBT_UNCHANGED) token->next = next;
+
 }
 
-int16_t char_to_short(char* input)
+void fill_meta(struct nbt_metadata* metadata, nbt_type_t type, int32_t num)
 {
-    uint16_t result;
-    memcpy(&result, input, sizeof(uint16_t));
-    return bswap_16(result);
+    metadata->num_of_entries = num;
+    metadata->type = type;
 }
 
-int32_t char_to_int(char* input)
+nbt_type_t nbt_tok_return_type(nbt_tok* token, int index, int max)
 {
-    int32_t result;
-    memcpy(&result, input, sizeof(int32_t));
-    return bswap_32(result);
+    if (index < 0 || index >= max || !token) return NBT_WARN;
+    return token[index].type;
 }
 
-int64_t char_to_long(char* input)
+int nbt_tok_return_start(nbt_tok* token, int index, int max)
 {
-    int64_t result;
-    memcpy(&result, input, sizeof(int64_t));
-    return bswap_64(result);
+    if (index < 0 || index >= max || !token) return NBT_WARN;
+    return token[index].start;
 }
 
-float char_to_float(char* input)
+int nbt_tok_return_end(nbt_tok* token, int index, int max)
 {
-    float result;
-    char input_s[4];
-    swap_char_4(input, input_s);
-    memcpy(&result, input_s, sizeof(float));
+    if (index < 0 || index >= max || !token) return NBT_WARN;
+    return token[index].end;
+}
 
-    return result;
+int nbt_tok_return_len(nbt_tok* token, int index, int max)
+{
+    if (index < 0 || index >= max || !token) return NBT_WARN;
+    return token[index].len;
 }
 
-double char_to_double(char* input)
+int nbt_tok_return_parent(nbt_tok* token, int index, int max)
 {
-    double result;
-    char input_s[8];
-    swap_char_8(input, input_s);
-    memcpy(&result, input_s, sizeof(double));
+    if (index < 0 || index >= max || !token) return NBT_WARN;
+    return token[index].parent;
+}
 
-    return result;
+int nbt_tok_return_next(nbt_tok* token, int index, int max)
+{
+    if (index < 0 || index >= max || !token) return NBT_WARN;
+    return token[index].next;
 }
 
-void nbt_fill_token(nbt_tok *token, nbt_type_t type, int start, int end, int len, int parent)
+/* Wide records are sorted by index, every token with a NBT_CTOK_WIDE column has one */
+static const struct nbt_ctok_wide* nbt_ctok_return_wide(nbt_ctok* token, int index)
 {
-    if (type != NBT_UNCHANGED) token->type = type;
-    if (start != NBT_UNCHANGED) token->start = start;
-    if (end != NBT_UNCHANGED ) token->end = end;
-    if (len != NBT_UNCHANGED) token->len = len;
-    if (parent != NBT_UNCHANGED) token->parent = parent;
+    int low = 0;
+    int high = token->wide_len - 1;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (token->wide[mid].index < index) low = mid + 1;
+        else high = mid;
+    }
+    return &token->wide[low];
+}
 
+nbt_type_t nbt_ctok_return_type(nbt_ctok* token, int index)
+{
+    if (!token || index < 0 || index >= token->tok_len) return NBT_WARN;
+    return token->type[index];
 }
 
-void fill_meta(struct nbt_metadata* metadata, nbt_type_t type, int32_t num)
+int nbt_ctok_return_start(nbt_ctok* token, int index)
 {
-    metadata->num_of_entries = num;
-    metadata->type = type;
+    if (!token || index < 0 || index >= token->tok_len) return NBT_WARN;
+    return token->start[index];
 }
 
-nbt_type_t nbt_tok_return_type(nbt_tok* token, int index, int max)
+int nbt_ctok_return_end(nbt_ctok* token, int index)
 {
-    if (index < 0 || index > max || !token) return NBT_WARN;
-    return token[index].type;
+    if (!token || index < 0 || index >= token->tok_len) return NBT_WARN;
+    return token->start[index] + nbt_ctok_return_len(token, index) - 1;
 }
 
-int nbt_tok_return_start(nbt_tok* token, int index, int max)
+int nbt_ctok_return_len(nbt_ctok* token, int index)
 {
-    if (index < 0 || index > max || !token) return NBT_WARN;
-    return token[index].start;
+    if (!token || index < 0 || index >= token->tok_len) return NBT_WARN;
+    if (token->len[index] != NBT_CTOK_WIDE) return token->len[index];
+
+    return nbt_ctok_return_wide(token, index)->len;
 }
 
-int nbt_tok_return_end(nbt_tok* token, int index, int max)
+int nbt_ctok_return_parent(nbt_ctok* token, int index)
 {
-    if (index < 0 || index > max || !token) return NBT_WARN;
-    return token[index].end;
+    if (!token || index < 0 || index >= token->tok_len) return NBT_WARN;
+    if (token->parent[index] != NBT_CTOK_WIDE) return index - token->parent[index];
+
+    return nbt_ctok_return_wide(token, index)->parent;
 }
 
-int nbt_tok_return_len(nbt_tok* token, int index, int max)
+int nbt_ctok_return_next(nbt_ctok* token, int index)
 {
-    if (index < 0 || index > max || !token) return NBT_WARN;
-    return token[index].len;
+    if (!token || index < 0 || index >= token->tok_len) return NBT_WARN;
+    if (token->next[index] != NBT_CTOK_WIDE) return index + token->next[index];
+
+    return nbt_ctok_return_wide(token, index)->next;
 }
 
-int nbt_tok_return_parent(nbt_tok* token, int index, int max)
+nbt_type_t nbt_view_return_type(const struct nbt_tok_view* view, int index)
 {
-    if (index < 0 || index > max || !token) return NBT_WARN;
-    return token[index].parent;
+    if (view->tok) return nbt_tok_return_type(view->tok, index, view->len);
+    return nbt_ctok_return_type(view->ctok, index);
+}
+
+int nbt_view_return_start(const struct nbt_tok_view* view, int index)
+{
+    if (view->tok) return nbt_tok_return_start(view->tok, index, view->len);
+    return nbt_ctok_return_start(view->ctok, index);
+}
+
+int nbt_view_return_end(const struct nbt_tok_view* view, int index)
+{
+    if (view->tok) return nbt_tok_return_end(view->tok, index, view->len);
+    return nbt_ctok_return_end(view->ctok, index);
+}
+
+int nbt_view_return_len(const struct nbt_tok_view* view, int index)
+{
+    if (view->tok) return nbt_tok_return_len(view->tok, index, view->len);
+    return nbt_ctok_return_len(view->ctok, index);
+}
+
+int nbt_view_return_parent(const struct nbt_tok_view* view, int index)
+{
+    if (view->tok) return nbt_tok_return_parent(view->tok, index, view->len);
+    return nbt_ctok_return_parent(view->ctok, index);
+}
+
+int nbt_view_return_next(const struct nbt_tok_view* view, int index)
+{
+    if (view->tok) return nbt_tok_return_next(view->tok, index, view->len);
+    return nbt_ctok_return_next(view->ctok, index);
 }
 
 static struct nbt_metadata* nbt_init_meta(struct nbt_parser* parser)
@@ -172,6 +227,87 @@ static struct nbt_metadata* nbt_destroy_meta(struct nbt_metadata* meta, struct n
     return NULL;
 }
 
+void* nbt_alloc(struct nbt_parser* parser, size_t size)
+{
+    if (parser->setting->alloc) return parser->setting->alloc(size);
+
+    return malloc(size);
+}
+
+void nbt_free(struct nbt_parser* parser, void* mem)
+{
+    if (!mem) return;
+
+    if (parser->setting->free) {
+        parser->setting->free(mem);
+    }
+    else {
+        free(mem);
+    }
+}
+
+/* For memory that is not tied to a parser */
+void* nbt_setting_alloc(const struct nbt_parser_setting_t* setting, size_t size)
+{
+    if (setting->alloc) return setting->alloc(size);
+
+    return malloc(size);
+}
+
+void nbt_setting_free(const struct nbt_parser_setting_t* setting, void* mem)
+{
+    if (!mem) return;
+
+    if (setting->free) {
+        setting->free(mem);
+    }
+    else {
+        free(mem);
+    }
+}
+
+void* nbt_realloc(struct nbt_parser* parser, void* ptr, size_t new_len, size_t original_len)
+{
+    void* new_ptr = nbt_alloc(parser, new_len);
+    if (!new_ptr) return NULL;
+
+    if (ptr) {
+        memcpy(new_ptr, ptr, original_len < new_len ? original_len : new_len);
+        nbt_free(parser, ptr);
+    }
+
+    return new_ptr;
+}
+
+int nbt_grow_tokens(struct nbt_parser* parser)
+{
+    int new_len = parser->tok_len ? parser->tok_len * 2 : 64;
+
+    nbt_tok* tok = nbt_realloc(parser, parser->tok, sizeof(nbt_tok) * new_len, sizeof(nbt_tok) * parser->tok_len);
+    if (!tok) return NBT_NOMEM;
+
+    parser->tok = tok;
+    parser->tok_len = new_len;
+
+    return 0;
+}
+
+int nbt_grow_meta(struct nbt_parser* parser)
+{
+    int new_len = parser->max_list ? parser->max_list * 2 : 8;
+
+    /* Metadata is allocated with one extra entry */
+    struct nbt_metadata* meta = nbt_realloc(parser, parser->list_meta, sizeof(struct nbt_metadata) * (new_len + 1), sizeof(struct nbt_metadata) * (parser->max_list + 1));
+    if (!meta) return NBT_LNOMEM;
+
+    memset(meta + parser->max_list + 1, 0, sizeof(struct nbt_metadata) * (new_len - parser->max_list));
+
+    parser->list_meta = meta;
+    parser->max_list = new_len;
+
+    return 0;
+}
+
 int nbt_add_meta(int index, struct nbt_parser* parser, struct nbt_metadata* payload)
 {
     if (index >= parser->max_list) return NBT_LNOMEM;
@@ -182,9 +318,9 @@ int nbt_add_meta(int index, struct nbt_parser* parser, struct nbt_metadata* payl
 
 int nbt_add_token(nbt_tok* tok, const int tok_len, int index, const nbt_tok* payload)
 {
-    if (index > tok_len) return 1;
+    if (index < 0 || index >= tok_len) return 1;
 
-    nbt_fill_token(&tok[index], payload->type, payload->start, payload->end, payload->len, payload->parent);
+    nbt_fill_token(&tok[index], payload->type, payload->start, payload->end, payload->len, payload->parent, payload->next);
     return 0;
 }
 
@@ -200,6 +336,13 @@ void nbt_init_parser(struct nbt_parser* parser, struct nbt_sized_buffer* content
     
     parser->cur_index = 0;
     parser->max_list = 0;
+    parser->list_meta_needed = 0;
+
+    parser->tok = NULL;
+    parser->tok_len = 0;
+
+    parser->child_index = NULL;
+    parser->list_index = NULL;
 
     parser->list_meta = nbt_init_meta(parser);
 
@@ -214,6 +357,7 @@ void nbt_clear_parser(struct nbt_parser* parser, struct nbt_sized_buffer* conten
     parser->parent_token = NBT_NOT_AVAIL;
 
     parser->cur_index = 0;
+    parser->list_meta_needed = 0;
 
     memset(parser->list_meta, 0, sizeof(struct nbt_metadata) * parser->max_list);
 
@@ -222,12 +366,28 @@ void nbt_clear_parser(struct nbt_parser* parser, struct nbt_sized_buffer* conten
 
     parser->nbt_data = content;
 
+    /* The indexes belong to the tokens of the old data */
+    nbt_destroy_index(parser);
+    nbt_destroy_list_index(parser);
 }
 
 void nbt_destroy_parser(struct nbt_parser* parser)
 {
     nbt_destroy_meta(parser->list_meta, parser);
     parser->list_meta = NULL;
+
+    nbt_free(parser, parser->tok);
+    parser->tok = NULL;
+    parser->tok_len = 0;
+
+    nbt_destroy_index(parser);
+    nbt_destroy_list_index(parser);
+}
+
+nbt_tok* nbt_get_tokens(struct nbt_parser* parser, int* tok_len)
+{
+    *tok_len = parser->current_token;
+    return parser->tok;
 }
 
 int nbt_meta_return_entries(struct nbt_parser* parser, int index)
@@ -238,3 +398,210 @@ int nbt_meta_return_entries(struct nbt_parser* parser, int index)
 
     return parser->list_meta[index].num_of_entries;
 }
+
+/* Distance that fits in a 16 bit column, or NBT_CTOK_WIDE */
+static uint16_t nbt_ctok_distance(long distance)
+{
+    return distance >= 0 && distance < NBT_CTOK_WIDE ? distance : NBT_CTOK_WIDE;
+}
+
+int nbt_compact_tokens(struct nbt_parser* parser, nbt_tok* tok, const int tok_len, nbt_ctok* ctok)
+{
+    void* (*alloc) (size_t size);
+    if (parser->setting->alloc) {
+        alloc = parser->setting->alloc;
+    }
+    else {
+        alloc = malloc;
+    }
+
+    int wide_len = 0;
+    for (int i = 0; i < tok_len; i++)
+    {
+        if (nbt_ctok_distance(tok[i].len) == NBT_CTOK_WIDE || nbt_ctok_distance((long)i - tok[i].parent) == NBT_CTOK_WIDE
+            || nbt_ctok_distance((long)tok[i].next - i) == NBT_CTOK_WIDE) wide_len++;
+    }
+
+    /* One block for all columns, ordered by alignment */
+    char* mem = alloc(sizeof(struct nbt_ctok_wide) * wide_len + (sizeof(uint32_t) + sizeof(uint16_t) * 3 + sizeof(int8_t)) * tok_len + 1);
+    if (!mem) return NBT_NOMEM;
+
+    ctok->wide = (struct nbt_ctok_wide*)mem;
+    ctok->start = (uint32_t*)(ctok->wide + wide_len);
+    ctok->len = (uint16_t*)(ctok->start + tok_len);
+    ctok->parent = ctok->len + tok_len;
+    ctok->next = ctok->parent + tok_len;
+    ctok->type = (int8_t*)(ctok->next + tok_len);
+    ctok->wide_len = wide_len;
+    ctok->tok_len = tok_len;
+
+    struct nbt_ctok_wide* wide = ctok->wide;
+    for (int i = 0; i < tok_len; i++)
+    {
+        ctok->type[i] = tok[i].type;
+        ctok->start[i] = tok[i].start;
+        ctok->len[i] = nbt_ctok_distance(tok[i].len);
+        ctok->parent[i] = nbt_ctok_distance((long)i - tok[i].parent);
+        ctok->next[i] = nbt_ctok_distance((long)tok[i].next - i);
+
+        if (ctok->len[i] == NBT_CTOK_WIDE || ctok->parent[i] == NBT_CTOK_WIDE || ctok->next[i] == NBT_CTOK_WIDE) {
+            *wide++ = (struct nbt_ctok_wide){.index = i, .len = tok[i].len, .parent = tok[i].parent, .next = tok[i].next};
+        }
+    }
+
+    /* The packed tokens have the same indices, so the child index of the tokens works on them too */
+    struct nbt_child_index_t* index = parser->child_index;
+    if (index && index->tok == tok && index->tok_len == tok_len) index->ctok = ctok;
+
+    return 0;
+}
+
+void nbt_destroy_compact_tokens(struct nbt_parser* parser, nbt_ctok* ctok)
+{
+    void (*free_) (void* mem);
+    if (parser->setting->free) {
+        free_ = parser->setting->free;
+    }
+    else {
+        free_ = free;
+    }
+
+    if (ctok->wide) free_(ctok->wide);
+    if (parser->child_index && parser->child_index->ctok == ctok) parser->child_index->ctok = NULL;
+
+    ctok->wide = NULL;
+    ctok->start = NULL;
+    ctok->len = NULL;
+    ctok->parent = NULL;
+    ctok->next = NULL;
+    ctok->type = NULL;
+    ctok->wide_len = 0;
+    ctok->tok_len = 0;
+}
+
+struct nbt_name_key nbt_make_name_key(const char* name, const int len)
+{
+    struct nbt_name_key key = {0};
+
+    if (len < 8) {
+        memcpy(&key.head, name, len);
+        key.tail = key.head;
+    }
+    else {
+        memcpy(&key.head, name, 8);
+        memcpy(&key.tail, name + len - 8, 8);
+    }
+
+    return key;
+}
+
+void nbt_encode_ints_scalar(char* out, const void* in, const int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t value;
+        memcpy(&value, (const char*)in + (size_t)i * 4, 4);
+        value = bswap_32(value);
+        memcpy(out + (size_t)i * 4, &value, 4);
+    }
+}
+
+void nbt_encode_longs_scalar(char* out, const void* in, const int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t value;
+        memcpy(&value, (const char*)in + (size_t)i * 8, 8);
+        value = bswap_64(value);
+        memcpy(out + (size_t)i * 8, &value, 8);
+    }
+}
+
+#if defined(__SSSE3__)
+static inline __m128i nbt_swap_32(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+}
+
+static inline __m128i nbt_swap_64(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7));
+}
+#endif
+
+/* Names the widest path nbt_encode_ints and nbt_encode_longs were built with */
+const char* nbt_encode_path(void)
+{
+#if defined(__AVX2__)
+    return "AVX2";
+#elif defined(__SSSE3__)
+    return "SSSE3";
+#else
+    return "scalar";
+#endif
+}
+
+/* Copies `count` native ints to big-endian, a vector at a time, without changing `in` */
+void nbt_encode_ints(char* out, const void* in, const int count)
+{
+    const char* src = in;
+    int i = 0;
+
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + (size_t)i * 4));
+        _mm256_storeu_si256((__m256i*)(out + (size_t)i * 4), _mm256_shuffle_epi8(x, mask));
+    }
+#endif
+
+#if defined(__SSSE3__)
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + (size_t)i * 4));
+        _mm_storeu_si128((__m128i*)(out + (size_t)i * 4), nbt_swap_32(x));
+    }
+#endif
+
+    nbt_encode_ints_scalar(out + (size_t)i * 4, src + (size_t)i * 4, count - i);
+}
+
+void nbt_encode_longs(char* out, const void* in, const int count)
+{
+    const char* src = in;
+    int i = 0;
+
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + (size_t)i * 8));
+        _mm256_storeu_si256((__m256i*)(out + (size_t)i * 8), _mm256_shuffle_epi8(x, mask));
+    }
+#endif
+
+#if defined(__SSSE3__)
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + (size_t)i * 8));
+        _mm_storeu_si128((__m128i*)(out + (size_t)i * 8), nbt_swap_64(x));
+    }
+#endif
+
+    nbt_encode_longs_scalar(out + (size_t)i * 8, src + (size_t)i * 8, count - i);
+}
+
+/* 32 bit FNV-1a */
+uint32_t nbt_hash_name(const char* name, const int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
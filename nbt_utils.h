@@ -22,11 +22,18 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <byteswap.h>
 
 #define NBT_NOT_AVAIL -3
 #define NBT_UNCHANGED -4
 
+/* Type of a query step that matches any tag */
+#define NBT_ANY_TYPE ((nbt_type_t)-3)
+
 #define MAX_DEPTH 30
+#define MAX_NEST_DEPTH 512
+#define MAX_THREADS 64
 
 enum nbtb_state_type {
     S_INIT = 0,
@@ -43,6 +50,176 @@ struct nbt_token_t {
     int end;
     int len;
     int parent;
+
+    /* Index of the first token after this token and its children */
+    int next;
+};
+
+/* Value of a 16 bit column of a token whose real value is in its wide record */
+#define NBT_CTOK_WIDE 0xFFFF
+
+/* Full length, parent and next of a compact token that does not fit in the 16 bit columns */
+struct nbt_ctok_wide {
+    int32_t index;
+    int32_t len;
+    int32_t parent;
+    int32_t next;
+};
+
+/*
+ * Structure of arrays layout of the tokens, end is not stored as it is always start + len - 1.
+ * Parent and next are stored as distances from the token. Tokens with a length or distance that does not fit
+ * in 16 bits, such as big containers and the elements of big lists, also have a wide record, sorted by index.
+ */
+struct nbt_compact_token_t {
+    int8_t* type;
+    uint32_t* start;
+    uint16_t* len;
+    uint16_t* parent;
+    uint16_t* next;
+
+    struct nbt_ctok_wide* wide;
+    int wide_len;
+
+    int tok_len;
+};
+
+/* Either token layout, so that lookups can run on both */
+struct nbt_tok_view {
+    nbt_tok* tok;
+    nbt_ctok* ctok;
+
+    int len;
+};
+
+enum nbt_predicate_op {
+    NBT_OP_EQ,
+    NBT_OP_NE,
+    NBT_OP_LT,
+    NBT_OP_LE,
+    NBT_OP_GT,
+    NBT_OP_GE
+};
+
+/* The first and the last 8 bytes of a name, which tell most names of the same length apart with two loads */
+struct nbt_name_key {
+    uint64_t head;
+    uint64_t tail;
+};
+
+/* A condition on a child of the elements of a list, `[?name op value]` */
+struct nbt_predicate {
+    const char* name;
+    unsigned short name_len;
+    struct nbt_name_key key;
+
+    enum nbt_predicate_op op;
+
+    /* A string is kept the way it is stored in NBT, with its length prefix */
+    const char* string;
+    int string_len; // -1 if the value is a number
+
+    /* Numbers are kept as big-endian keys that compare like the values, so the bytes of the NBT data can be compared without decoding them */
+    double number;
+    bool integral;
+    unsigned char int_keys[4][8]; // Keys for byte, short, int and long, with the sign bit flipped
+    bool int_fits[4];
+    uint32_t float_key;
+    uint64_t double_key;
+};
+
+/* A step of a path, with everything needed to match it measured in advance */
+struct nbt_query_step {
+    nbt_type_t type;
+
+    const char* name;
+    unsigned short name_len;
+    struct nbt_name_key key;
+    uint32_t hash;
+
+    long index;
+
+    bool any_name; // `*`, matches every child of a compound
+    bool any_index; // `[*]` on a list, matches every element
+
+    /* `[?...]` on a list, matches every element meeting all of them */
+    const struct nbt_predicate* predicates;
+    int predicate_count;
+};
+
+struct nbt_query_t {
+    struct nbt_query_step* steps;
+    int size;
+
+    bool wildcards; // Some step has any_name, any_index or predicates
+
+    /* Used to free the query */
+    const struct nbt_parser_setting_t* setting;
+};
+
+/* Hash tables of the children of large compounds, built by nbt_build_index */
+struct nbt_child_index_t {
+    const nbt_tok* tok; // The tokens the index belongs to
+    const nbt_ctok* ctok; // Set while the same tokens are also packed by nbt_compact_tokens
+    int tok_len;
+
+    /* For every token, the offset of its table in `slots`, -1 if it has none */
+    int32_t* tables;
+
+    /* Every table starts with its size, a power of two, followed by the child tokens. Empty slots are -1 */
+    int32_t* slots;
+
+    size_t size; // Bytes used by the index
+};
+
+/* Elements of lists of compounds and lists, built by nbt_tokenise when index_lists is set */
+struct nbt_list_index_t {
+    const nbt_tok* tok; // The tokens the index belongs to
+    int tok_len;
+
+    /* For every token, the offset of its table in `elements`, -1 if it has none */
+    int32_t* tables;
+
+    /* Every table starts with the number of elements, followed by their tokens */
+    int32_t* elements;
+};
+
+struct nbt_iter_frame {
+    int pos; // Next child to look at
+    int end;
+
+    bool in_list;
+    long element; // Number of elements already passed in a list
+
+    /* Elements left of a collapsed list, only set while they are being walked */
+    int collapsed;
+    long collapsed_end;
+};
+
+/* Walks every match of a query, frame `i` holds the position among the candidates for step `i` */
+struct nbt_iter_t {
+    const nbt_query* query;
+
+    struct nbt_tok_view tok;
+    nbt_parser* parser;
+
+    int depth;
+    struct nbt_iter_frame frames[MAX_DEPTH];
+};
+
+struct nbt_query_cache_entry {
+    uint32_t hash;
+    char* expr; // NULL for an empty slot
+    nbt_query* query;
+};
+
+/* Compiled expressions keyed by the expression string, in an open addressing table */
+struct nbt_query_cache_t {
+    const struct nbt_parser_setting_t* setting;
+
+    struct nbt_query_cache_entry* entries;
+    int capacity;
+    int count;
 };
 
 struct nbt_metadata {
@@ -61,6 +238,19 @@ typedef struct nbt_parser {
     int cur_index;
     int max_list;
 
+    /* Set by a dry run of nbt_tokenise */
+    int list_meta_needed;
+
+    /* Tokens owned by the parser, only used with auto_grow */
+    nbt_tok* tok;
+    int tok_len;
+
+    /* Only set by nbt_build_index */
+    struct nbt_child_index_t* child_index;
+
+    /* Only set by nbt_tokenise with index_lists */
+    struct nbt_list_index_t* list_index;
+
     const struct nbt_parser_setting_t* setting;
 } nbt_parser;
 
@@ -69,7 +259,11 @@ struct nbtb_state {
 
     /* Stores the address of the ID byte */
     /* Only used for lists */
-    int payload;
+    size_t payload;
+
+    /* Only used for lists, the header is rebuilt from them once it has left the buffer */
+    nbt_type_t type;
+    int32_t count;
 };
 
 typedef struct nbt_build {
@@ -81,10 +275,25 @@ typedef struct nbt_build {
 
     size_t offset;
 
+    /* Only used by a growable builder, which ignores the buffer given to every call */
+    char* buf;
+    size_t buf_len;
+    const struct nbt_build_setting_t* setting;
+
+    /* Only used by a streaming builder, `flushed` bytes were written to the sink and left the buffer */
+    const struct nbt_build_sink_t* sink;
+    size_t flushed;
+
 } nbt_build;
 
 /* nbt_utils.c */
-void* nbt_realloc(void* ptr, size_t new_len, size_t original_len);
+void* nbt_alloc(nbt_parser* parser, size_t size);
+void nbt_free(nbt_parser* parser, void* mem);
+void* nbt_setting_alloc(const struct nbt_parser_setting_t* setting, size_t size);
+void nbt_setting_free(const struct nbt_parser_setting_t* setting, void* mem);
+void* nbt_realloc(nbt_parser* parser, void* ptr, size_t new_len, size_t original_len);
+int nbt_grow_tokens(nbt_parser* parser);
+int nbt_grow_meta(nbt_parser* parser);
 
 void swap_char_2(char* input, char* output);
 void swap_char_4(char* input, char* output);
@@ -93,13 +302,54 @@ void swap_char_8(char* input, char* output);
 void safe_swap_4(char* input, char* output);
 void safe_swap_8(char* input, char* output);
 
-uint16_t char_to_ushort(char* input);
-int16_t char_to_short(char* input);
-int32_t char_to_int(char* input);
-int64_t char_to_long(char* input);
 int64_t char_to_long_s(char* input);
-float char_to_float(char* input);
-double char_to_double(char* input);
+
+/* Big-endian decoding, inlined as it is on every hot path */
+static inline uint16_t char_to_ushort(const char* input)
+{
+    uint16_t result;
+    memcpy(&result, input, sizeof(uint16_t));
+    return bswap_16(result);
+}
+
+static inline int16_t char_to_short(const char* input)
+{
+    uint16_t result;
+    memcpy(&result, input, sizeof(uint16_t));
+    return bswap_16(result);
+}
+
+static inline int32_t char_to_int(const char* input)
+{
+    uint32_t result;
+    memcpy(&result, input, sizeof(uint32_t));
+    return bswap_32(result);
+}
+
+static inline int64_t char_to_long(const char* input)
+{
+    uint64_t result;
+    memcpy(&result, input, sizeof(uint64_t));
+    return bswap_64(result);
+}
+
+static inline float char_to_float(const char* input)
+{
+    uint32_t bits = char_to_int(input);
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+static inline double char_to_double(const char* input)
+{
+    uint64_t bits = char_to_long(input);
+
+    double result;
+    memcpy(&result, &bits, sizeof(double));
+    return result;
+}
 
 
 int nbt_add_token(nbt_tok* tok, const int tok_len, int index, const nbt_tok* payload);
@@ -109,7 +359,62 @@ int nbt_tok_return_start(nbt_tok* token, int index, int max);
 int nbt_tok_return_end(nbt_tok* token, int index, int max);
 int nbt_tok_return_len(nbt_tok* token, int index, int max);
 int nbt_tok_return_parent(nbt_tok* token, int index, int max);
+int nbt_tok_return_next(nbt_tok* token, int index, int max);
+
+nbt_type_t nbt_ctok_return_type(nbt_ctok* token, int index);
+int nbt_ctok_return_start(nbt_ctok* token, int index);
+int nbt_ctok_return_end(nbt_ctok* token, int index);
+int nbt_ctok_return_len(nbt_ctok* token, int index);
+int nbt_ctok_return_parent(nbt_ctok* token, int index);
+int nbt_ctok_return_next(nbt_ctok* token, int index);
+
+nbt_type_t nbt_view_return_type(const struct nbt_tok_view* view, int index);
+int nbt_view_return_start(const struct nbt_tok_view* view, int index);
+int nbt_view_return_end(const struct nbt_tok_view* view, int index);
+int nbt_view_return_len(const struct nbt_tok_view* view, int index);
+int nbt_view_return_parent(const struct nbt_tok_view* view, int index);
+int nbt_view_return_next(const struct nbt_tok_view* view, int index);
 
 int nbt_add_meta(int index, nbt_parser* parser, struct nbt_metadata* payload);
 
 int nbt_meta_return_entries(nbt_parser* parser, int index);
+
+uint32_t nbt_hash_name(const char* name, const int len);
+struct nbt_name_key nbt_make_name_key(const char* name, const int len);
+
+/* Big-endian encoding of arrays, the scalar versions are kept for the platforms without vectors */
+void nbt_encode_ints(char* out, const void* in, const int count);
+void nbt_encode_longs(char* out, const void* in, const int count);
+void nbt_encode_ints_scalar(char* out, const void* in, const int count);
+void nbt_encode_longs_scalar(char* out, const void* in, const int count);
+const char* nbt_encode_path(void);
+
+/* Compares the `len` bytes of a name in the NBT data with a name of the same length */
+static inline bool nbt_name_equals(const char* data, const char* name, const int len, const struct nbt_name_key* key)
+{
+    uint64_t word = 0;
+    if (len < 8) {
+        memcpy(&word, data, len);
+        return word == key->head;
+    }
+
+    memcpy(&word, data, 8);
+    if (word != key->head) return false;
+
+    memcpy(&word, data + len - 8, 8);
+    if (word != key->tail) return false;
+
+    /* The two words overlap the whole name up to 16 bytes */
+    return len <= 16 || memcmp(data + 8, name + 8, len - 16) == 0;
+}
+
+/* nbt_tok.c */
+int nbt_index_lists(nbt_parser* parser, const nbt_tok* tok, const int tok_len);
+int nbt_tokenise_threads(nbt_parser* parser, nbt_tok* tok, const int tok_len, int threads);
+void nbt_destroy_list_index(nbt_parser* parser);
+
+/* nbt_find.c */
+nbt_query* nbt_alloc_query(const struct nbt_parser_setting_t* setting, int size, int predicate_count, size_t names_len, char** names);
+
+/* nbt_query.c */
+bool nbt_match_predicates(const struct nbt_tok_view* tok, nbt_parser* parser, int compound, const struct nbt_query_step* step);
@@ -11,6 +11,7 @@
 #include "../nbt_utils.h"
 #include "cog-utils.h"
 #include "clock.h"
+#include "legacy-tok.h"
 
 /* Code used to benchmark this library */
 
@@ -58,6 +59,15 @@ void libnbt_parse()
 
     double cpu_time_used_find = ((double) (end_find - start_find)) / CLOCKS_PER_SEC;
 
+    int children = 0;
+    int tok_len = parser.current_token;
+    for (int child = nbt_first_child(tok, tok_len, 0); child >= 0; child = nbt_next_sibling(tok, tok_len, child))
+    {
+        assert(nbt_tok_return_parent(tok, child, tok_len) == 0);
+        children++;
+    }
+    assert(children == 11);
+
     nbt_destroy_parser(&parser);
     free(file_contents);
     free(tok);
@@ -65,9 +75,2623 @@ void libnbt_parse()
     printf("%lf\n", cpu_time_used_parse + cpu_time_used_find);
 }
 
+/* The dry run must count exactly the tokens and list metadata a real pass uses */
+void libnbt_dry_run()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    assert(tok_len > 0);
+    assert(parser.list_meta_needed > 0 && parser.list_meta_needed <= setting.list_meta_init_len);
+    assert(parser.current_token == 0);
+
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len - 1) == NBT_NOMEM);
+
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+    assert(parser.current_token == tok_len);
+
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(tok);
+}
+
+static double wall_clock()
+{
+    struct PsnipClockTimespec now;
+    psnip_clock_get_time(PSNIP_CLOCK_TYPE_MONOTONIC, &now);
+
+    return (double)now.seconds + (double)now.nanoseconds / 1e9;
+}
+
+static int tokenise_timed(struct nbt_sized_buffer* buf, const struct nbt_parser_setting_t* setting, nbt_tok** tok, double* time_used)
+{
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, buf, setting);
+
+    clock_t start_parse = clock();
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    *tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, *tok, tok_len) == 0);
+    *time_used = ((double) (clock() - start_parse)) / CLOCKS_PER_SEC;
+
+    nbt_destroy_parser(&parser);
+    return tok_len;
+}
+
+/* Feeds the data a few bytes at a time, the tokens must match a single pass over the whole buffer */
+void libnbt_parse_stream()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+
+    struct nbt_sized_buffer full_buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser full_parser;
+    nbt_init_parser(&full_parser, &full_buf, &setting);
+
+    int tok_len = nbt_tokenise(&full_parser, NULL, 0);
+    nbt_tok* full_tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&full_parser, full_tok, tok_len) == 0);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = 0};
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, &buf, &setting);
+
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+
+    clock_t start_parse, end_parse;
+    start_parse = clock();
+
+    int res = NBT_PARTIAL;
+    while (res == NBT_PARTIAL)
+    {
+        assert(buf.len < file_len);
+        buf.len = buf.len + 7 > file_len ? file_len : buf.len + 7;
+
+        res = nbt_tokenise(&parser, tok, tok_len);
+    }
+    end_parse = clock();
+
+    assert(res == 0);
+    assert(parser.current_token == tok_len);
+    assert(memcmp(tok, full_tok, sizeof(nbt_tok) * tok_len) == 0);
+
+    double cpu_time_used_parse = ((double) (end_parse - start_parse)) / CLOCKS_PER_SEC;
+
+    nbt_destroy_parser(&full_parser);
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(full_tok);
+    free(tok);
+
+    printf("Streamed tokenise: %lf\n", cpu_time_used_parse);
+}
+
+/* The parser grows its own tokens and list metadata, the tokens must match the ones from a sized array */
+void libnbt_auto_grow()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_tok* full_tok;
+    double time_used;
+    int full_tok_len = tokenise_timed(&buf, &setting, &full_tok, &time_used);
+
+    struct nbt_parser_setting_t grow_setting = {.list_meta_init_len = 0, .alloc = malloc, .free = free, .auto_grow = true};
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, &buf, &grow_setting);
+
+    clock_t start_parse = clock();
+    assert(nbt_tokenise(&parser, NULL, 0) == 0);
+    time_used = ((double) (clock() - start_parse)) / CLOCKS_PER_SEC;
+
+    int tok_len;
+    nbt_tok* tok = nbt_get_tokens(&parser, &tok_len);
+
+    assert(tok_len == full_tok_len);
+    assert(memcmp(tok, full_tok, sizeof(nbt_tok) * tok_len) == 0);
+
+    printf("Auto grown tokenise: %lf\n", time_used);
+
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(full_tok);
+}
+
+/* Only the subtrees on the paths are tokenised, finds must return the same as on the full tokens */
+void libnbt_projection()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+
+    struct nbt_lookup_t byte_path[2];
+    byte_path[0] = (struct nbt_lookup_t){.type = nbt_compound, .name = "Level"};
+    byte_path[1] = (struct nbt_lookup_t){.type = nbt_byte, .name = "byteTest"};
+
+    struct nbt_lookup_t egg_path[3];
+    egg_path[0] = (struct nbt_lookup_t){.type = nbt_compound, .name = "Level"};
+    egg_path[1] = (struct nbt_lookup_t){.type = nbt_compound, .name = "nested compound test"};
+    egg_path[2] = (struct nbt_lookup_t){.type = nbt_compound, .name = "egg"};
+
+    struct nbt_path_t paths[2] = {{.path = byte_path, .path_size = 2}, {.path = egg_path, .path_size = 3}};
+
+    nbt_tok* full_tok;
+    double time_used;
+    int full_tok_len = tokenise_timed(&buf, &setting, &full_tok, &time_used);
+
+    const int rounds = 2000;
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * full_tok_len);
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, &buf, &setting);
+
+    clock_t start_parse = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        nbt_clear_parser(&parser, &buf);
+        assert(nbt_tokenise(&parser, tok, full_tok_len) == 0);
+    }
+    double full_time = ((double) (clock() - start_parse)) / CLOCKS_PER_SEC;
+
+    start_parse = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        nbt_clear_parser(&parser, &buf);
+        assert(nbt_tokenise_paths(&parser, tok, full_tok_len, paths, 2) == 0);
+    }
+    double projected_time = ((double) (clock() - start_parse)) / CLOCKS_PER_SEC;
+    int tok_len = parser.current_token;
+
+    struct nbt_index_t full_res = {0};
+    struct nbt_index_t res = {0};
+    for (int p = 0; p < 2; p++)
+    {
+        assert(nbt_find(full_tok, full_tok_len, &parser, paths[p].path, paths[p].path_size, &full_res) == 0);
+        assert(nbt_find(tok, tok_len, &parser, paths[p].path, paths[p].path_size, &res) == 0);
+        assert(memcmp(&full_res, &res, sizeof(struct nbt_index_t)) == 0);
+    }
+
+    printf("Full tokenise: %d tokens, %lf. Projected tokenise: %d tokens, %lf\n", full_tok_len, full_time, tok_len, projected_time);
+
+    nbt_destroy_parser(&parser);
+
+    /* The lists of the projected tokens are indexed like those of nbt_tokenise */
+    struct nbt_lookup_t list_path[4];
+    list_path[0] = (struct nbt_lookup_t){.type = nbt_compound, .name = "Level"};
+    list_path[1] = (struct nbt_lookup_t){.type = nbt_list, .name = "listTest (compound)", .index = 1};
+    list_path[2] = (struct nbt_lookup_t){.type = nbt_compound};
+    list_path[3] = (struct nbt_lookup_t){.type = nbt_string, .name = "name"};
+
+    struct nbt_path_t list_paths[1] = {{.path = list_path, .path_size = 2}};
+    struct nbt_parser_setting_t index_setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free, .index_lists = true};
+    nbt_init_parser(&parser, &buf, &index_setting);
+    assert(nbt_tokenise_paths(&parser, tok, full_tok_len, list_paths, 1) == 0);
+    tok_len = parser.current_token;
+    assert(parser.list_index && parser.list_index->tok == tok && parser.list_index->tok_len == tok_len);
+
+    assert(nbt_find(full_tok, full_tok_len, &parser, list_path, 4, &full_res) == 0);
+    assert(nbt_find(tok, tok_len, &parser, list_path, 4, &res) == 0);
+    assert(memcmp(&full_res, &res, sizeof(struct nbt_index_t)) == 0);
+
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(full_tok);
+    free(tok);
+}
+
+/* Adds a list of entity-like compounds */
+static void build_entity_list(nbt_build* b, char* nbt_data, const int buf_len, char* name, const short name_len, const int entities)
+{
+    assert(nbt_start_list(b, nbt_data, buf_len, name, name_len) == 0);
+    for (int i = 0; i < entities; i++)
+    {
+        assert(nbt_start_compound(b, nbt_data, buf_len, NULL, 0) == 0);
+        assert(nbt_add_string(b, nbt_data, buf_len, "id", 2, i % 3 ? "minecraft:zombie" : "minecraft:villager", i % 3 ? 16 : 18) == 0);
+
+        assert(nbt_start_list(b, nbt_data, buf_len, "Pos", 3) == 0);
+        assert(nbt_add_double(b, nbt_data, buf_len, NULL, 0, i) == 0);
+        assert(nbt_add_double(b, nbt_data, buf_len, NULL, 0, 64.0) == 0);
+        assert(nbt_add_double(b, nbt_data, buf_len, NULL, 0, -i) == 0);
+        assert(nbt_end_list(b, nbt_data, buf_len) == 0);
+
+        assert(nbt_add_float(b, nbt_data, buf_len, "Health", 6, 20.0f - i % 20) == 0);
+
+        int uuid[4] = {i, i + 1, i + 2, i + 3};
+        assert(nbt_add_int_array(b, nbt_data, buf_len, "UUID", 4, uuid, 4) == 0);
+
+        assert(nbt_start_compound(b, nbt_data, buf_len, "Brain", 5) == 0);
+        assert(nbt_add_char(b, nbt_data, buf_len, "awake", 5, i % 2) == 0);
+        assert(nbt_add_short(b, nbt_data, buf_len, "mood", 4, i % 100) == 0);
+        assert(nbt_end_compound(b, nbt_data, buf_len) == 0);
+
+        assert(nbt_end_compound(b, nbt_data, buf_len) == 0);
+    }
+    assert(nbt_end_list(b, nbt_data, buf_len) == 0);
+}
+
+/* Builds a compound holding lists of entity-like compounds, the first list is called Entities */
+static char* build_entity_lists(const int lists, const int entities, int* nbt_len)
+{
+    const int buf_len = lists * (entities * 160 + 64) + 64;
+    char* nbt_data = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, nbt_data, buf_len, "", 0) == 0);
+    for (int list = 0; list < lists; list++)
+    {
+        char name[16];
+        int name_len = list ? snprintf(name, sizeof(name), "Entities%d", list) : snprintf(name, sizeof(name), "Entities");
+
+        build_entity_list(&b, nbt_data, buf_len, name, name_len, entities);
+    }
+    assert(nbt_end_compound(&b, nbt_data, buf_len) == 0);
+
+    *nbt_len = b.offset;
+    return nbt_data;
+}
+
+static char* build_entities(const int entities, int* nbt_len)
+{
+    return build_entity_lists(1, entities, nbt_len);
+}
+
+static void skip_against_tokenise(const char* name, struct nbt_sized_buffer* buf, const int rounds)
+{
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    assert(tok_len > 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+
+    /* The root compound, its payload starts after its name */
+    int payload = 3 + char_to_ushort(buf->content + 1);
+
+    clock_t start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        assert(nbt_skip(buf, payload, nbt_compound) == buf->len);
+    }
+    double skip_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        nbt_clear_parser(&parser, buf);
+        assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+    }
+    double tok_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    double mb = (double)buf->len * rounds / (1024 * 1024);
+    printf("%s (%d bytes): nbt_skip %lf MB/s, nbt_tokenise %lf MB/s\n", name, buf->len, mb / skip_time, mb / tok_time);
+
+    nbt_destroy_parser(&parser);
+    free(tok);
+}
+
+void libnbt_skip()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    skip_against_tokenise("bigtest", &buf, 2000);
+
+    /* Truncated data must not be read past */
+    buf.len = file_len - 1;
+    assert(nbt_skip(&buf, 3 + char_to_ushort(file_contents + 1), nbt_compound) == NBT_PARTIAL);
+
+    int nbt_len;
+    char* entities = build_entities(5000, &nbt_len);
+    struct nbt_sized_buffer entities_buf = {.content = entities, .len = nbt_len};
+    skip_against_tokenise("5000 entities", &entities_buf, 5);
+
+    free(file_contents);
+    free(entities);
+}
+
+/* Tokenises the children of the root compound on several threads, the tokens must match a single thread */
+void libnbt_parallel()
+{
+    int nbt_len;
+    char* nbt_data = build_entity_lists(8, 1000, &nbt_len);
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = nbt_len};
+
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* serial_tok = malloc(sizeof(nbt_tok) * tok_len);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+
+    /* Both token arrays are written once before timing, so neither pays for first touching its pages */
+    assert(nbt_tokenise(&parser, serial_tok, tok_len) == 0);
+    nbt_clear_parser(&parser, &buf);
+
+    double start = wall_clock();
+    clock_t start_cpu = clock();
+    assert(nbt_tokenise(&parser, serial_tok, tok_len) == 0);
+    double serial_time = wall_clock() - start;
+    double serial_cpu = ((double) (clock() - start_cpu)) / CLOCKS_PER_SEC;
+
+    /* The threads are not limited to the number of processors here, so that they are always exercised */
+    const int threads = 8;
+    for (int round = 0; round < 2; round++)
+    {
+        nbt_clear_parser(&parser, &buf);
+        memset(tok, 0, sizeof(nbt_tok) * tok_len);
+
+        start = wall_clock();
+        start_cpu = clock();
+        assert(nbt_tokenise_threads(&parser, tok, tok_len, threads) == 0);
+    }
+    double parallel_time = wall_clock() - start;
+    double parallel_cpu = ((double) (clock() - start_cpu)) / CLOCKS_PER_SEC;
+
+    assert(parser.current_token == tok_len);
+    assert(memcmp(tok, serial_tok, sizeof(nbt_tok) * tok_len) == 0);
+
+    /* Short tokens, a dry run and short list metadata end as they do on one thread */
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise(&parser, serial_tok, tok_len - 1) == NBT_NOMEM);
+    int serial_tokens = parser.current_token;
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise_threads(&parser, tok, tok_len - 1, threads) == NBT_NOMEM);
+    assert(parser.current_token == serial_tokens);
+    assert(memcmp(tok, serial_tok, sizeof(nbt_tok) * serial_tokens) == 0);
+
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise_threads(&parser, NULL, 0, threads) == tok_len);
+
+    struct nbt_parser_setting_t shallow_setting = {.list_meta_init_len = 1, .alloc = malloc, .free = free};
+    struct nbt_parser shallow_parser;
+    nbt_init_parser(&shallow_parser, &buf, &shallow_setting);
+    assert(nbt_tokenise(&shallow_parser, serial_tok, tok_len) == NBT_LNOMEM);
+    serial_tokens = shallow_parser.current_token;
+    nbt_destroy_parser(&shallow_parser);
+
+    nbt_init_parser(&shallow_parser, &buf, &shallow_setting);
+    assert(nbt_tokenise_threads(&shallow_parser, tok, tok_len, threads) == NBT_LNOMEM);
+    assert(shallow_parser.current_token == serial_tokens);
+    assert(memcmp(tok, serial_tok, sizeof(nbt_tok) * serial_tokens) == 0);
+    nbt_destroy_parser(&shallow_parser);
+
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise(&parser, serial_tok, tok_len) == 0);
+
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise_parallel(&parser, tok, tok_len, threads) == 0);
+    assert(memcmp(tok, serial_tok, sizeof(nbt_tok) * tok_len) == 0);
+
+    printf("8 lists of 1000 entities: serial %lf (cpu %lf), %d threads %lf (cpu %lf) wall clock\n", serial_time, serial_cpu, threads, parallel_time, parallel_cpu);
+
+    nbt_destroy_parser(&parser);
+
+    /* The parser grows its own tokens, and indexes the lists once they are complete */
+    struct nbt_parser_setting_t grow_setting = {.list_meta_init_len = 1, .alloc = malloc, .free = free, .auto_grow = true, .index_lists = true};
+    nbt_init_parser(&parser, &buf, &grow_setting);
+    assert(nbt_tokenise_threads(&parser, NULL, 0, threads) == 0);
+    assert(parser.current_token == tok_len);
+    assert(memcmp(parser.tok, serial_tok, sizeof(nbt_tok) * tok_len) == 0);
+    assert(parser.list_index && parser.list_index->tok == parser.tok);
+    nbt_destroy_parser(&parser);
+
+    free(nbt_data);
+    free(serial_tok);
+    free(tok);
+}
+
+/* Compares memory use and find throughput of the two token layouts */
+static double compact_size(const nbt_ctok* ctok)
+{
+    size_t columns = sizeof(uint32_t) + sizeof(uint16_t) * 3 + sizeof(int8_t);
+    return (double)(columns * ctok->tok_len + sizeof(struct nbt_ctok_wide) * ctok->wide_len) / ctok->tok_len;
+}
+
+/* A big list has elements far from their parent and containers too long for the 16 bit columns */
+static void compact_against_tokens(const int entities)
+{
+    int nbt_len;
+    char* nbt_data = build_entities(entities, &nbt_len);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = nbt_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    nbt_ctok ctok;
+    assert(nbt_compact_tokens(&parser, tok, tok_len, &ctok) == 0);
+    assert(ctok.wide_len > 0);
+
+    for (int i = 0; i < tok_len; i++)
+    {
+        assert(nbt_ctok_return_type(&ctok, i) == tok[i].type);
+        assert(nbt_ctok_return_start(&ctok, i) == tok[i].start);
+        assert(nbt_ctok_return_end(&ctok, i) == tok[i].end);
+        assert(nbt_ctok_return_len(&ctok, i) == tok[i].len);
+        assert(nbt_ctok_return_parent(&ctok, i) == tok[i].parent);
+        assert(nbt_ctok_return_next(&ctok, i) == tok[i].next);
+    }
+
+    struct nbt_lookup_t path[4] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list, .name = "Entities"}, {.type = nbt_compound}, {.type = nbt_float, .name = "Health"}};
+    struct nbt_index_t res_tok;
+    struct nbt_index_t res_ctok;
+
+    double tok_time = 0;
+    double ctok_time = 0;
+    for (int i = 0; i < entities; i += entities / 100)
+    {
+        path[1].index = i;
+
+        clock_t start = clock();
+        assert(nbt_find(tok, tok_len, &parser, path, 4, &res_tok) == 0);
+        tok_time += ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+        start = clock();
+        assert(nbt_find_compact(&ctok, &parser, path, 4, &res_ctok) == 0);
+        ctok_time += ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+        assert(memcmp(&res_tok, &res_ctok, sizeof(struct nbt_index_t)) == 0);
+        assert(char_to_float(nbt_data + res_ctok.start) == 20.0f - i % 20);
+    }
+
+    printf("%d entities: tokens %zu bytes/token %lf, compact %.2lf bytes/token %lf\n", entities, sizeof(nbt_tok), tok_time, compact_size(&ctok), ctok_time);
+
+    nbt_destroy_compact_tokens(&parser, &ctok);
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+}
+
+void libnbt_compact()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    nbt_ctok ctok;
+    assert(nbt_compact_tokens(&parser, tok, tok_len, &ctok) == 0);
+
+    struct nbt_lookup_t path[4];
+    path[0] = (struct nbt_lookup_t){.type = nbt_compound, .name = "Level"};
+    path[1] = (struct nbt_lookup_t){.type = nbt_compound, .name = "nested compound test"};
+    path[2] = (struct nbt_lookup_t){.type = nbt_compound, .name = "egg"};
+    path[3] = (struct nbt_lookup_t){.type = nbt_float, .name = "value"};
+
+    const int rounds = 20000;
+    struct nbt_index_t res_tok = {0};
+    struct nbt_index_t res_ctok = {0};
+
+    clock_t start_find = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        assert(nbt_find(tok, tok_len, &parser, path, 4, &res_tok) == 0);
+    }
+    double tok_time = ((double) (clock() - start_find)) / CLOCKS_PER_SEC;
+
+    start_find = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        assert(nbt_find_compact(&ctok, &parser, path, 4, &res_ctok) == 0);
+    }
+    double ctok_time = ((double) (clock() - start_find)) / CLOCKS_PER_SEC;
+
+    assert(memcmp(&res_tok, &res_ctok, sizeof(struct nbt_index_t)) == 0);
+    assert(char_to_float(file_contents + res_ctok.start) == 0.5f);
+
+    assert(ctok.wide_len == 0);
+
+    printf("Token layout: %zu bytes/token, %lf finds/s\n", sizeof(nbt_tok), rounds / tok_time);
+    printf("Compact layout: %.2lf bytes/token, %lf finds/s\n", compact_size(&ctok), rounds / ctok_time);
+
+    nbt_destroy_compact_tokens(&parser, &ctok);
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(tok);
+
+    compact_against_tokens(20000);
+}
+
+/* Paths into bigtest used by the lookup benchmarks */
+static struct nbt_lookup_t paths[6][4] = {
+    {{.type = nbt_compound, .name = "Level"}, {.type = nbt_byte, .name = "byteTest"}},
+    {{.type = nbt_compound, .name = "Level"}, {.type = nbt_double, .name = "doubleTest"}},
+    {{.type = nbt_compound, .name = "Level"}, {.type = nbt_compound, .name = "nested compound test"}, {.type = nbt_compound, .name = "egg"}, {.type = nbt_float, .name = "value"}},
+    {{.type = nbt_compound, .name = "Level"}, {.type = nbt_list, .name = "listTest (long)", .index = 3}, {.type = nbt_long}},
+    {{.type = nbt_compound, .name = "Level"}, {.type = nbt_list, .name = "listTest (compound)", .index = 1}, {.type = nbt_compound}, {.type = nbt_string, .name = "name"}},
+    {{.type = nbt_compound, .name = "Level"}, {.type = nbt_compound, .name = "nested compound test"}, {.type = nbt_compound, .name = "bacon"}}
+};
+static int path_sizes[6] = {2, 2, 4, 3, 4, 3};
+
+/* Compiled queries must give the same results as nbt_find, and must not be changed by running them */
+void libnbt_query()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    nbt_query* queries[5];
+    for (int i = 0; i < 5; i++)
+    {
+        queries[i] = nbt_compile_query(&setting, paths[i], path_sizes[i]);
+        assert(queries[i]);
+    }
+
+    const int rounds = 20000;
+    struct nbt_index_t res_find[5];
+    struct nbt_index_t res_query[5];
+
+    clock_t start = clock();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            assert(nbt_find(tok, tok_len, &parser, paths[i], path_sizes[i], &res_find[i]) == 0);
+        }
+    }
+    double find_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            assert(nbt_find_query(tok, tok_len, &parser, queries[i], &res_query[i]) == 0);
+        }
+    }
+    double query_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(memcmp(res_find, res_query, sizeof(res_find)) == 0);
+    assert(file_contents[res_query[0].start] == 65);
+    assert(char_to_long(file_contents + res_query[3].start) == 14);
+    assert(char_to_ushort(file_contents + res_query[4].start) == 15);
+    assert(memcmp(file_contents + res_query[4].start + 2, "Compound tag #1", 15) == 0);
+
+    /* A name must match exactly, not only its start */
+    struct nbt_lookup_t longer[2] = {{.type = nbt_compound, .name = "Levelx"}, {.type = nbt_byte, .name = "byteTest"}};
+    struct nbt_index_t res_longer;
+    assert(nbt_find(tok, tok_len, &parser, longer, 2, &res_longer) == NBT_WARN);
+
+    /* Paths longer than the steps kept on the stack */
+    enum { depth = 20 };
+    char deep[512];
+    nbt_build b;
+    nbt_init_build(&b);
+    for (int i = 0; i < depth; i++)
+    {
+        assert(nbt_start_compound(&b, deep, sizeof(deep), "c", 1) == 0);
+    }
+    assert(nbt_add_integer(&b, deep, sizeof(deep), "leaf", 4, 1234) == 0);
+    for (int i = 0; i < depth; i++)
+    {
+        assert(nbt_end_compound(&b, deep, sizeof(deep)) == 0);
+    }
+
+    struct nbt_sized_buffer deep_buf = {.content = deep, .len = b.offset};
+    struct nbt_parser deep_parser;
+    nbt_init_parser(&deep_parser, &deep_buf, &setting);
+
+    nbt_tok deep_tok[128];
+    assert(nbt_tokenise(&deep_parser, deep_tok, 128) == 0);
+
+    struct nbt_lookup_t deep_path[depth + 1];
+    for (int i = 0; i < depth; i++)
+    {
+        deep_path[i] = (struct nbt_lookup_t){.type = nbt_compound, .name = "c"};
+    }
+    deep_path[depth] = (struct nbt_lookup_t){.type = nbt_int, .name = "leaf"};
+
+    struct nbt_index_t res_deep;
+    assert(nbt_find(deep_tok, deep_parser.current_token, &deep_parser, deep_path, depth + 1, &res_deep) == 0);
+    assert(char_to_int(deep + res_deep.start) == 1234);
+    assert(nbt_find(deep_tok, deep_parser.current_token, &deep_parser, deep_path, depth, &res_deep) == 0);
+    nbt_destroy_parser(&deep_parser);
+
+
+    printf("%d paths: nbt_find %lf finds/s, nbt_find_query %lf finds/s\n", 5, rounds * 5 / find_time, rounds * 5 / query_time);
+
+    for (int i = 0; i < 5; i++)
+    {
+        nbt_destroy_query(queries[i]);
+    }
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(tok);
+}
+
+/* A batch must find the same as running every query on its own, in one walk over the tokens */
+void libnbt_batch()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    nbt_query* queries[6];
+    for (int i = 0; i < 6; i++)
+    {
+        queries[i] = nbt_compile_query(&setting, paths[i], path_sizes[i]);
+        assert(queries[i]);
+    }
+
+    const int rounds = 20000;
+    struct nbt_index_t res_query[6] = {0};
+    struct nbt_index_t res_batch[6] = {0};
+    int status_query[6];
+    int status_batch[6];
+
+    clock_t start = clock();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            status_query[i] = nbt_find_query(tok, tok_len, &parser, queries[i], &res_query[i]);
+        }
+    }
+    double query_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int r = 0; r < rounds; r++)
+    {
+        assert(nbt_find_batch(tok, tok_len, &parser, (const nbt_query* const*)queries, 6, res_batch, status_batch) == 5);
+    }
+    double batch_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    /* The last path does not exist */
+    assert(memcmp(status_query, status_batch, sizeof(status_query)) == 0);
+    assert(status_batch[5] == NBT_WARN);
+    assert(memcmp(res_query, res_batch, sizeof(struct nbt_index_t) * 5) == 0);
+
+    printf("%d paths: one by one %lf batches/s, nbt_find_batch %lf batches/s\n", 6, rounds / query_time, rounds / batch_time);
+
+    for (int i = 0; i < 6; i++)
+    {
+        nbt_destroy_query(queries[i]);
+    }
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(tok);
+}
+
+static void index_against_scan(const int keys)
+{
+    const int buf_len = keys * 16 + 64;
+    char* nbt_data = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, nbt_data, buf_len, "", 0) == 0);
+    for (int i = 0; i < keys; i++)
+    {
+        char name[16];
+        int name_len = sprintf(name, "key%d", i);
+        assert(nbt_add_integer(&b, nbt_data, buf_len, name, name_len, i) == 0);
+    }
+    assert(nbt_end_compound(&b, nbt_data, buf_len) == 0);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = b.offset};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    nbt_query** queries = malloc(sizeof(nbt_query*) * keys);
+    for (int i = 0; i < keys; i++)
+    {
+        struct nbt_lookup_t path[2] = {{.type = nbt_compound, .name = ""}, {.type = nbt_int}};
+        sprintf(path[1].name, "key%d", i);
+        queries[i] = nbt_compile_query(&setting, path, 2);
+        assert(queries[i]);
+    }
+
+    /* Every key is looked up the same number of times */
+    const int lookups = 20000;
+    struct nbt_index_t res;
+
+    clock_t start = clock();
+    for (int i = 0; i < lookups; i++)
+    {
+        assert(nbt_find_query(tok, tok_len, &parser, queries[i % keys], &res) == 0);
+    }
+    double scan_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    const int builds = 1000;
+    start = clock();
+    for (int i = 0; i < builds; i++)
+    {
+        assert(nbt_build_index(&parser, tok, tok_len, 1) == 0);
+    }
+    double build_time = ((double) (clock() - start)) / CLOCKS_PER_SEC / builds;
+
+    start = clock();
+    for (int i = 0; i < lookups; i++)
+    {
+        assert(nbt_find_query(tok, tok_len, &parser, queries[i % keys], &res) == 0);
+    }
+    double index_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(char_to_int(nbt_data + res.start) == (lookups - 1) % keys);
+
+    double saved = (scan_time - index_time) / lookups;
+    printf("%d keys: scan %lf lookups/s, indexed %lf lookups/s, index %zu bytes built in %lf, pays off after %.0lf lookups\n",
+           keys, lookups / scan_time, lookups / index_time, parser.child_index->size, build_time, saved > 0 ? build_time / saved : -1.0);
+
+    for (int i = 0; i < keys; i++)
+    {
+        nbt_destroy_query(queries[i]);
+    }
+    free(queries);
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+}
+
+/* Lookups through the child index must find the same as a scan */
+void libnbt_index()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    struct nbt_index_t res_scan[6];
+    struct nbt_index_t res_index[6];
+    int status_scan[6];
+
+    for (int i = 0; i < 6; i++)
+    {
+        status_scan[i] = nbt_find(tok, tok_len, &parser, paths[i], path_sizes[i], &res_scan[i]);
+    }
+
+    assert(nbt_build_index(&parser, tok, tok_len, 1) == 0);
+    for (int i = 0; i < 6; i++)
+    {
+        assert(nbt_find(tok, tok_len, &parser, paths[i], path_sizes[i], &res_index[i]) == status_scan[i]);
+        if (status_scan[i] == 0) assert(memcmp(&res_scan[i], &res_index[i], sizeof(struct nbt_index_t)) == 0);
+    }
+
+    /* The compact tokens packed from the indexed tokens use the index too */
+    nbt_ctok ctok;
+    assert(nbt_compact_tokens(&parser, tok, tok_len, &ctok) == 0);
+    assert(parser.child_index->ctok == &ctok);
+    for (int i = 0; i < 6; i++)
+    {
+        assert(nbt_find_compact(&ctok, &parser, paths[i], path_sizes[i], &res_index[i]) == status_scan[i]);
+        if (status_scan[i] == 0) assert(memcmp(&res_scan[i], &res_index[i], sizeof(struct nbt_index_t)) == 0);
+    }
+    nbt_destroy_compact_tokens(&parser, &ctok);
+    assert(parser.child_index->ctok == NULL);
+
+    /* An index of other tokens of the same length must not be used, here the tokens of a projection */
+    nbt_tok* projected = calloc(tok_len, sizeof(nbt_tok));
+    struct nbt_lookup_t byte_path[2] = {{.type = nbt_compound, .name = "Level"}, {.type = nbt_byte, .name = "byteTest"}};
+    struct nbt_path_t projection = {.path = byte_path, .path_size = 2};
+
+    nbt_clear_parser(&parser, &buf);
+    assert(nbt_tokenise_paths(&parser, projected, tok_len, &projection, 1) == 0);
+    assert(nbt_build_index(&parser, projected, tok_len, 1) == 0);
+
+    struct nbt_lookup_t float_path[2] = {{.type = nbt_compound, .name = "Level"}, {.type = nbt_float, .name = "floatTest"}};
+    struct nbt_index_t res;
+    assert(nbt_find(projected, tok_len, &parser, float_path, 2, &res) == NBT_WARN);
+    assert(nbt_find(tok, tok_len, &parser, float_path, 2, &res) == 0);
+    assert(res.start == 109);
+
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(projected);
+    free(tok);
+
+    index_against_scan(10);
+    index_against_scan(100);
+    index_against_scan(1000);
+}
+
+static int build_allocs;
+static int build_reallocs;
+static int build_frees;
+
+static void* counting_alloc(size_t size)
+{
+    build_allocs++;
+    return malloc(size);
+}
+
+static void* counting_realloc(void* mem, size_t size)
+{
+    build_reallocs++;
+    return realloc(mem, size);
+}
+
+static void counting_free(void* mem)
+{
+    build_frees++;
+    free(mem);
+}
+
+/* Expressions must find the same as the lookups they are written for */
+void libnbt_expr()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    /* The same paths as `paths` */
+    const char* exprs[6] = {
+        "Level.byteTest",
+        "Level.doubleTest:double",
+        "Level.\"nested compound test\".egg.value:float",
+        "Level.\"listTest (long)\"[3]",
+        "Level.\"listTest (compound)\":list[1].name:string",
+        "Level.\"nested compound test\".bacon"
+    };
+
+    nbt_query_cache* cache = nbt_create_query_cache(&setting);
+    assert(cache);
+
+    for (int i = 0; i < 6; i++)
+    {
+        const nbt_query* query = nbt_cache_query(cache, exprs[i]);
+        assert(query);
+        assert(nbt_cache_query(cache, exprs[i]) == query);
+
+        struct nbt_index_t res_find, res_expr;
+        int status = nbt_find(tok, tok_len, &parser, paths[i], path_sizes[i], &res_find);
+        assert(nbt_find_query(tok, tok_len, &parser, query, &res_expr) == status);
+        if (status == 0) assert(memcmp(&res_find, &res_expr, sizeof(struct nbt_index_t)) == 0);
+    }
+
+    const char* invalid[] = {"", "Level.", "Level[", "Level[x]", "Level[1", "Level:foo", "\"Level", "Level.byteTest:byte.x", "Level.Pos:int[1]", "Level[1]]"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        assert(nbt_compile_expr(&setting, invalid[i]) == NULL);
+    }
+
+    nbt_query* escaped = nbt_compile_expr(&setting, "\"a\\\"b.c\"[2]:int");
+    assert(escaped && escaped->size == 2);
+    assert(strcmp(escaped->steps[0].name, "a\"b.c") == 0);
+    assert(escaped->steps[0].type == nbt_list && escaped->steps[0].index == 2);
+    assert(escaped->steps[1].type == nbt_int);
+    nbt_destroy_query(escaped);
+
+    /* Short expressions are parsed without allocating, long ones allocate what they need */
+    struct nbt_parser_setting_t counting_setting = {.alloc = counting_alloc, .free = counting_free};
+    build_allocs = build_frees = 0;
+    nbt_query* query = nbt_compile_expr(&counting_setting, exprs[4]);
+    assert(query && build_allocs == 1);
+    nbt_destroy_query(query);
+
+    enum { long_steps = 40 };
+    char long_expr[long_steps * 2];
+    for (int i = 0; i < long_steps; i++)
+    {
+        long_expr[i * 2] = 'a';
+        long_expr[i * 2 + 1] = i + 1 < long_steps ? '.' : '\0';
+    }
+    query = nbt_compile_expr(&counting_setting, long_expr);
+    assert(query && query->size == long_steps && build_allocs == 3);
+    nbt_destroy_query(query);
+
+    char deep_expr[(MAX_NEST_DEPTH + 1) * 2];
+    for (int i = 0; i <= MAX_NEST_DEPTH; i++)
+    {
+        deep_expr[i * 2] = 'a';
+        deep_expr[i * 2 + 1] = i < MAX_NEST_DEPTH ? '.' : '\0';
+    }
+    assert(nbt_compile_expr(&counting_setting, deep_expr) == NULL);
+
+    query = nbt_compile_expr(&counting_setting, "a[?b==1&&c==2&&d==3&&e==4&&f==5&&g==6&&h==7&&i==8&&j==9].k");
+    assert(query && query->steps[0].predicate_count == 9);
+    nbt_destroy_query(query);
+    assert(build_allocs == build_frees);
+
+    /* A request handler either parses its expression every time or asks the cache */
+    const int requests = 100000;
+    struct nbt_index_t res;
+
+    clock_t start = clock();
+    for (int i = 0; i < requests; i++)
+    {
+        query = nbt_compile_expr(&setting, exprs[i % 5]);
+        assert(nbt_find_query(tok, tok_len, &parser, query, &res) == 0);
+        nbt_destroy_query(query);
+    }
+    double parse_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < requests; i++)
+    {
+        assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, exprs[i % 5]), &res) == 0);
+    }
+    double cache_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    printf("Expressions: parsed per request %lf requests/s, cached %lf requests/s\n", requests / parse_time, requests / cache_time);
+
+    nbt_destroy_query_cache(cache);
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(tok);
+}
+
+/* Returns the number of matches of an expression, checking they come in document order */
+static int count_matches(nbt_tok* tok, const int tok_len, nbt_parser* parser, const struct nbt_parser_setting_t* setting, const char* expr)
+{
+    nbt_query* query = nbt_compile_expr(setting, expr);
+    assert(query);
+
+    nbt_iter it;
+    assert(nbt_iter_init(&it, tok, tok_len, parser, query) == 0);
+
+    int matches = 0;
+    int last_start = -1;
+    struct nbt_index_t res;
+    while (nbt_iter_next(&it, &res) >= 0)
+    {
+        assert(res.start > last_start);
+        last_start = res.start;
+        matches++;
+    }
+
+    nbt_destroy_query(query);
+    return matches;
+}
+
+/* Wildcards must find every match, the same ones lookups by index find one at a time */
+void libnbt_iter()
+{
+    const int entities = 2000;
+    int nbt_len;
+    char* nbt_data = build_entity_lists(3, entities, &nbt_len);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = nbt_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser_setting_t collapse_setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free, .collapse_lists = true};
+
+    nbt_tok* tok;
+    nbt_tok* collapsed_tok;
+    double time_used;
+    int tok_len = tokenise_timed(&buf, &setting, &tok, &time_used);
+    int collapsed_tok_len = tokenise_timed(&buf, &collapse_setting, &collapsed_tok, &time_used);
+
+    nbt_init_parser(&parser, &buf, &setting);
+
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[*].id") == entities);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".*[*].id") == entities * 3);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[*].*") == entities * 5);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[*].Pos[*]") == entities * 3);
+    assert(count_matches(collapsed_tok, collapsed_tok_len, &parser, &setting, "\"\".Entities[*].Pos[*]") == entities * 3);
+    assert(count_matches(collapsed_tok, collapsed_tok_len, &parser, &setting, "\"\".Entities[*].Pos[2]") == entities);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[*].id:int") == 0);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[12].id") == 1);
+
+    /* The first match of a wildcard is what nbt_find_query finds */
+    nbt_query* first = nbt_compile_expr(&setting, "\"\".*[*].Brain.mood");
+    struct nbt_index_t res_first;
+    assert(nbt_find_query(tok, tok_len, &parser, first, &res_first) == 0);
+    assert(char_to_short(nbt_data + res_first.start) == 0);
+    nbt_destroy_query(first);
+
+    /* Count the villagers, once with a wildcard and once with a lookup per index */
+    nbt_query* ids = nbt_compile_expr(&setting, "\"\".Entities[*].id");
+
+    clock_t start = clock();
+    nbt_iter it;
+    assert(nbt_iter_init(&it, tok, tok_len, &parser, ids) == 0);
+
+    int villagers = 0;
+    struct nbt_index_t res;
+    while (nbt_iter_next(&it, &res) >= 0)
+    {
+        if (res.len == 20 && memcmp(nbt_data + res.start + 2, "minecraft:villager", 18) == 0) villagers++;
+    }
+    double iter_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    struct nbt_lookup_t id_path[4] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list, .name = "Entities"}, {.type = nbt_compound}, {.type = nbt_string, .name = "id"}};
+
+    start = clock();
+    int indexed_villagers = 0;
+    for (int i = 0; i < entities; i++)
+    {
+        id_path[1].index = i;
+        assert(nbt_find(tok, tok_len, &parser, id_path, 4, &res) == 0);
+        if (res.len == 20 && memcmp(nbt_data + res.start + 2, "minecraft:villager", 18) == 0) indexed_villagers++;
+    }
+    double index_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(villagers == indexed_villagers);
+    assert(villagers == (entities + 2) / 3);
+
+    printf("Counting %d entities: wildcard %lf, lookup per index %lf\n", entities, iter_time, index_time);
+
+    nbt_destroy_query(ids);
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+    free(collapsed_tok);
+}
+
+/* Predicates must select the same elements as checking every element by hand */
+void libnbt_predicate()
+{
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser parser;
+    nbt_tok* tok;
+    double time_used;
+
+    /* Block entities with coordinates of every integer type */
+    const int blocks = 100;
+    const int buf_len = blocks * 64 + 64;
+    char* block_data = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, block_data, buf_len, "", 0) == 0);
+    assert(nbt_start_list(&b, block_data, buf_len, "Blocks", 6) == 0);
+    for (int i = 0; i < blocks; i++)
+    {
+        assert(nbt_start_compound(&b, block_data, buf_len, NULL, 0) == 0);
+        assert(nbt_add_char(&b, block_data, buf_len, "b", 1, i % 2) == 0);
+        assert(nbt_add_integer(&b, block_data, buf_len, "x", 1, i - 50) == 0);
+        assert(nbt_add_short(&b, block_data, buf_len, "y", 1, i % 7) == 0);
+        assert(nbt_add_long(&b, block_data, buf_len, "z", 1, i * 1000000000L) == 0);
+        assert(nbt_add_float(&b, block_data, buf_len, "f", 1, i % 2 ? -0.0f : 0.0f) == 0);
+        assert(nbt_add_double(&b, block_data, buf_len, "d", 1, i % 2 ? -0.0 : 0.0) == 0);
+        assert(nbt_end_compound(&b, block_data, buf_len) == 0);
+    }
+    assert(nbt_end_list(&b, block_data, buf_len) == 0);
+    assert(nbt_end_compound(&b, block_data, buf_len) == 0);
+
+    struct nbt_sized_buffer block_buf = {.content = block_data, .len = b.offset};
+    int tok_len = tokenise_timed(&block_buf, &setting, &tok, &time_used);
+    nbt_init_parser(&parser, &block_buf, &setting);
+
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?x<0]") == 50);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?x>=-10&&x<10]") == 20);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?x==-3&&y==5&&z==47000000000].b") == 1);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?z>5000000000]") == 94);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?b==1]") == 50);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?b!=1]") == 50);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?b<300]") == 100);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?b==300]") == 0);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?y<=2.5]") == 44);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?x==\"a\"]") == 0);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?w==1]") == 0);
+
+    /* Values that are not whole are compared with the decoded payload, which can be negative */
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?x<-2.5]") == 48);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?z>-0.5]") == 100);
+
+    /* -0.0 is equal to 0.0 */
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?f==0]") == 100);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?f==-0.0&&d==0]") == 100);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Blocks[?d<0]") == 0);
+
+    const char* invalid[] = {"\"\".Blocks[?]", "\"\".Blocks[?x]", "\"\".Blocks[?x==]", "\"\".Blocks[?x==1&&]", "\"\".Blocks[?x=1]",
+                             "\"\".Blocks[?x==inf]", "\"\".Blocks[?x==-nan]", "\"\".Blocks[?x==0x10]", "\"\".Blocks[?x==1e400]"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        assert(nbt_compile_expr(&setting, invalid[i]) == NULL);
+    }
+
+    nbt_destroy_parser(&parser);
+    free(block_data);
+    free(tok);
+
+    /* Entities, filtered on strings and floats */
+    const int entities = 2000;
+    int nbt_len;
+    char* nbt_data = build_entities(entities, &nbt_len);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = nbt_len};
+    tok_len = tokenise_timed(&buf, &setting, &tok, &time_used);
+    nbt_init_parser(&parser, &buf, &setting);
+
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[?Health>=15.5]") == entities / 4);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[?Health<0]") == 0);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[?id!=\"minecraft:villager\"]") == entities - (entities + 2) / 3);
+    assert(count_matches(tok, tok_len, &parser, &setting, "\"\".Entities[?id<\"minecraft:w\"]") == (entities + 2) / 3);
+
+    /* The positions of the villagers, with a predicate and with lookups per index */
+    nbt_query* villagers = nbt_compile_expr(&setting, "\"\".Entities[?id==\"minecraft:villager\"].Pos[0]");
+    assert(villagers);
+
+    clock_t start = clock();
+    nbt_iter it;
+    assert(nbt_iter_init(&it, tok, tok_len, &parser, villagers) == 0);
+
+    double sum = 0;
+    struct nbt_index_t res;
+    while (nbt_iter_next(&it, &res) >= 0)
+    {
+        sum += char_to_double(nbt_data + res.start);
+    }
+    double predicate_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    struct nbt_lookup_t id_path[4] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list, .name = "Entities"}, {.type = nbt_compound}, {.type = nbt_string, .name = "id"}};
+    struct nbt_lookup_t pos_path[5] = {id_path[0], id_path[1], id_path[2], {.type = nbt_list, .name = "Pos"}, {.type = nbt_double}};
+
+    start = clock();
+    double indexed_sum = 0;
+    for (int i = 0; i < entities; i++)
+    {
+        id_path[1].index = i;
+        assert(nbt_find(tok, tok_len, &parser, id_path, 4, &res) == 0);
+        if (res.len != 20 || memcmp(nbt_data + res.start + 2, "minecraft:villager", 18)) continue;
+
+        pos_path[1].index = i;
+        assert(nbt_find(tok, tok_len, &parser, pos_path, 5, &res) == 0);
+        indexed_sum += char_to_double(nbt_data + res.start);
+    }
+    double index_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(sum == indexed_sum);
+
+    printf("Filtering %d entities: predicate %lf, lookup per index %lf\n", entities, predicate_time, index_time);
+
+    nbt_destroy_query(villagers);
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+}
+
+/* Values read through the accessors, which must reject results of the wrong size */
+void libnbt_accessors()
+{
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_init_parser(&parser, &buf, &setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+
+    nbt_query_cache* cache = nbt_create_query_cache(&setting);
+    struct nbt_index_t res;
+
+    int8_t c;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.byteTest"), &res) == 0);
+    assert(nbt_get_byte(&parser, &res, &c) == 0 && c == 65);
+    assert(nbt_get_short(&parser, &res, &(int16_t){0}) == NBT_WARN);
+
+    int16_t s;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.shortTest"), &res) == 0);
+    assert(nbt_get_short(&parser, &res, &s) == 0 && s == 32767);
+
+    int32_t i;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.intTest"), &res) == 0);
+    assert(nbt_get_int(&parser, &res, &i) == 0 && i == 2147483647);
+    assert(nbt_get_long(&parser, &res, &(int64_t){0}) == NBT_WARN);
+
+    int64_t l;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.longTest"), &res) == 0);
+    assert(nbt_get_long(&parser, &res, &l) == 0 && l == 9223372036854775807L);
+
+    float f;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.\"nested compound test\".ham.value"), &res) == 0);
+    assert(nbt_get_float(&parser, &res, &f) == 0 && f == 0.75f);
+
+    double d;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.doubleTest"), &res) == 0);
+    assert(nbt_get_double(&parser, &res, &d) == 0 && d > 0.49 && d < 0.5);
+
+    struct nbt_string_view str;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.\"nested compound test\".egg.name"), &res) == 0);
+    assert(nbt_get_string(&parser, &res, &str) == 0);
+    assert(str.len == 7 && memcmp(str.str, "Eggbert", 7) == 0);
+    assert(str.str == file_contents + res.start + 2);
+
+    struct nbt_array_view array;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "Level.\"byteArrayTest (the first 1000 values of (n*n*255+n*7)%100, starting with n=0 (0, 62, 34, 16, 8, ...))\""), &res) == 0);
+    assert(nbt_get_array(&parser, &res, nbt_byte_array, &array) == 0);
+    assert(array.len == 1000);
+    for (int n = 0; n < array.len; n++)
+    {
+        assert(nbt_array_byte(&array, n) == (n * n * 255 + n * 7) % 100);
+    }
+    assert(nbt_get_array(&parser, &res, nbt_long_array, &array) == NBT_WARN);
+    assert(nbt_get_string(&parser, &res, &str) == NBT_WARN);
+
+    nbt_destroy_parser(&parser);
+    free(file_contents);
+    free(tok);
+
+    int nbt_len;
+    char* entities = build_entities(3, &nbt_len);
+    struct nbt_sized_buffer entities_buf = {.content = entities, .len = nbt_len};
+    double time_used;
+    tok_len = tokenise_timed(&entities_buf, &setting, &tok, &time_used);
+    nbt_init_parser(&parser, &entities_buf, &setting);
+
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".Entities[2].UUID"), &res) == 0);
+    assert(nbt_get_array(&parser, &res, nbt_int_array, &array) == 0);
+    assert(array.len == 4 && array.width == 4);
+    for (int n = 0; n < array.len; n++)
+    {
+        assert(nbt_array_int(&array, n) == 2 + n);
+    }
+
+    nbt_destroy_query_cache(cache);
+    nbt_destroy_parser(&parser);
+    free(entities);
+    free(tok);
+}
+
+/* Columns extracted in one pass must hold what a lookup per element finds */
+void libnbt_column()
+{
+    const int entities = 2000;
+    int nbt_len;
+    char* nbt_data = build_entities(entities, &nbt_len);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = nbt_len};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser_setting_t collapse_setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free, .collapse_lists = true};
+
+    nbt_tok* tok;
+    nbt_tok* collapsed_tok;
+    double time_used;
+    int tok_len = tokenise_timed(&buf, &setting, &tok, &time_used);
+    int collapsed_tok_len = tokenise_timed(&buf, &collapse_setting, &collapsed_tok, &time_used);
+    nbt_init_parser(&parser, &buf, &setting);
+
+    nbt_query_cache* cache = nbt_create_query_cache(&setting);
+    const nbt_query* list = nbt_cache_query(cache, "\"\".Entities");
+
+    float* health = malloc(sizeof(float) * entities);
+    double* pos = malloc(sizeof(double) * entities * 3);
+    int32_t* uuid = malloc(sizeof(int32_t) * entities * 4);
+    uint8_t* missing = malloc((entities + 7) / 8);
+
+    clock_t start = clock();
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "Health"), nbt_float, 1, health, entities, missing) == entities);
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "Pos"), nbt_double, 3, pos, entities, NULL) == entities);
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "UUID"), nbt_int, 4, uuid, entities, NULL) == entities);
+    double column_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    for (int i = 0; i < entities; i++)
+    {
+        assert(!(missing[i / 8] & (1 << (i % 8))));
+        assert(health[i] == 20.0f - i % 20);
+        assert(pos[i * 3] == i && pos[i * 3 + 1] == 64.0 && pos[i * 3 + 2] == -i);
+        for (int n = 0; n < 4; n++)
+        {
+            assert(uuid[i * 4 + n] == i + n);
+        }
+    }
+
+    /* The same values with a lookup per element */
+    struct nbt_lookup_t health_path[4] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list, .name = "Entities"}, {.type = nbt_compound}, {.type = nbt_float, .name = "Health"}};
+    struct nbt_lookup_t pos_path[5] = {health_path[0], health_path[1], health_path[2], {.type = nbt_list, .name = "Pos"}, {.type = nbt_double}};
+    struct nbt_lookup_t uuid_path[4] = {health_path[0], health_path[1], health_path[2], {.type = nbt_int_array, .name = "UUID"}};
+
+    start = clock();
+    struct nbt_index_t res;
+    for (int i = 0; i < entities; i++)
+    {
+        float f;
+        health_path[1].index = i;
+        assert(nbt_find(tok, tok_len, &parser, health_path, 4, &res) == 0);
+        assert(nbt_get_float(&parser, &res, &f) == 0 && f == health[i]);
+
+        pos_path[1].index = i;
+        for (int n = 0; n < 3; n++)
+        {
+            double d;
+            pos_path[3].index = n;
+            assert(nbt_find(tok, tok_len, &parser, pos_path, 5, &res) == 0);
+            assert(nbt_get_double(&parser, &res, &d) == 0 && d == pos[i * 3 + n]);
+        }
+
+        struct nbt_array_view array;
+        uuid_path[1].index = i;
+        assert(nbt_find(tok, tok_len, &parser, uuid_path, 4, &res) == 0);
+        assert(nbt_get_array(&parser, &res, nbt_int_array, &array) == 0 && nbt_array_int(&array, 3) == uuid[i * 4 + 3]);
+    }
+    double lookup_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    printf("Extracting 3 columns of %d entities: column %lf, lookup per element %lf\n", entities, column_time, lookup_time);
+
+    /* Collapsed lists give the same columns */
+    memset(pos, 0, sizeof(double) * entities * 3);
+    assert(nbt_extract_column(collapsed_tok, collapsed_tok_len, &parser, list, nbt_cache_query(cache, "Pos"), nbt_double, 3, pos, entities, missing) == entities);
+    assert(pos[(entities - 1) * 3] == entities - 1 && pos[(entities - 1) * 3 + 2] == -(entities - 1));
+    assert(!(missing[0] & 1));
+
+    double element_pos[3];
+    assert(nbt_extract_column(collapsed_tok, collapsed_tok_len, &parser, nbt_cache_query(cache, "\"\".Entities[7].Pos"), NULL, nbt_double, 1, element_pos, 3, NULL) == 3);
+    assert(element_pos[0] == 7 && element_pos[1] == 64.0 && element_pos[2] == -7);
+    assert(nbt_extract_column(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".Entities[7].Pos"), NULL, nbt_double, 1, element_pos, 2, NULL) == 3);
+
+    /* Values of the wrong type or width, or not there at all, are zeroed and marked */
+    int16_t* mood = malloc(sizeof(int16_t) * entities);
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "Brain.mood"), nbt_short, 1, mood, entities, missing) == entities);
+    assert(mood[entities - 1] == (entities - 1) % 100 && !(missing[0] & 1));
+
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "Health"), nbt_double, 1, pos, entities, missing) == entities);
+    assert(missing[0] == 0xff && pos[0] == 0);
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "UUID"), nbt_int, 3, uuid, entities, missing) == entities);
+    assert(missing[(entities - 1) / 8] & (1 << ((entities - 1) % 8)));
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "Armor"), nbt_int, 1, uuid, 10, missing) == entities);
+    assert(missing[0] == 0xff && missing[1] == 0x03);
+
+    assert(nbt_extract_column(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".Mobs"), NULL, nbt_int, 1, uuid, entities, NULL) == NBT_WARN);
+    assert(nbt_extract_column(tok, tok_len, &parser, list, nbt_cache_query(cache, "Health"), nbt_string, 1, uuid, entities, NULL) == NBT_WARN);
+
+    nbt_destroy_query_cache(cache);
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+    free(collapsed_tok);
+    free(health);
+    free(pos);
+    free(uuid);
+    free(mood);
+    free(missing);
+}
+
+/* Elements found from the list, checked against a wildcard walking them in order */
+static void list_element_against_iter(nbt_tok* tok, const int tok_len, nbt_parser* parser, const struct nbt_parser_setting_t* setting, const char* list, const nbt_type_t type, const int elements)
+{
+    char expr[64];
+    snprintf(expr, sizeof(expr), "\"\".%s[*]", list);
+    nbt_query* all = nbt_compile_expr(setting, expr);
+    assert(all);
+
+    struct nbt_lookup_t path[3] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list}, {.type = type}};
+    snprintf(path[1].name, sizeof(path[1].name), "%s", list);
+
+    nbt_iter it;
+    assert(nbt_iter_init(&it, tok, tok_len, parser, all) == 0);
+
+    struct nbt_index_t res, expected;
+    for (int k = 0; k < elements; k++)
+    {
+        assert(nbt_iter_next(&it, &expected) >= 0);
+
+        path[1].index = k;
+        assert(nbt_find(tok, tok_len, parser, path, 3, &res) == 0);
+        assert(memcmp(&res, &expected, sizeof(res)) == 0);
+    }
+    assert(nbt_iter_next(&it, &expected) == NBT_WARN);
+
+    path[1].index = elements;
+    assert(nbt_find(tok, tok_len, parser, path, 3, &res) == NBT_WARN);
+
+    snprintf(expr, sizeof(expr), "\"\".%s[%d]", list, elements - 1);
+    nbt_query* last = nbt_compile_expr(setting, expr);
+    assert(nbt_iter_init(&it, tok, tok_len, parser, last) == 0);
+    assert(nbt_iter_next(&it, &res) >= 0 && memcmp(&res, &expected, sizeof(res)) == 0);
+    assert(nbt_iter_next(&it, &res) == NBT_WARN);
+
+    nbt_destroy_query(all);
+    nbt_destroy_query(last);
+}
+
+/* Lookups of list elements by index, with and without the list index */
+void libnbt_list_access()
+{
+    const int elements = 10000;
+    const int buf_len = elements * 64 + 64;
+    char* nbt_data = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, nbt_data, buf_len, "", 0) == 0);
+
+    assert(nbt_start_list(&b, nbt_data, buf_len, "Items", 5) == 0);
+    for (int i = 0; i < elements; i++)
+    {
+        assert(nbt_start_compound(&b, nbt_data, buf_len, NULL, 0) == 0);
+        assert(nbt_add_integer(&b, nbt_data, buf_len, "Slot", 4, i) == 0);
+        if (i % 2) assert(nbt_add_string(&b, nbt_data, buf_len, "id", 2, "minecraft:stone", 15) == 0);
+        assert(nbt_end_compound(&b, nbt_data, buf_len) == 0);
+    }
+    assert(nbt_end_list(&b, nbt_data, buf_len) == 0);
+
+    assert(nbt_start_list(&b, nbt_data, buf_len, "Values", 6) == 0);
+    for (int i = 0; i < elements; i++)
+    {
+        assert(nbt_add_integer(&b, nbt_data, buf_len, NULL, 0, i) == 0);
+    }
+    assert(nbt_end_list(&b, nbt_data, buf_len) == 0);
+
+    assert(nbt_start_list(&b, nbt_data, buf_len, "Names", 5) == 0);
+    for (int i = 0; i < elements; i++)
+    {
+        assert(nbt_add_string(&b, nbt_data, buf_len, NULL, 0, "minecraft:stone", 1 + i % 15) == 0);
+    }
+    assert(nbt_end_list(&b, nbt_data, buf_len) == 0);
+
+    assert(nbt_end_compound(&b, nbt_data, buf_len) == 0);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = b.offset};
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser_setting_t index_setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free, .index_lists = true};
+
+    struct nbt_parser parser, index_parser;
+    nbt_init_parser(&parser, &buf, &setting);
+    nbt_init_parser(&index_parser, &buf, &index_setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_tok* tok = malloc(sizeof(nbt_tok) * tok_len);
+    nbt_tok* index_tok = malloc(sizeof(nbt_tok) * tok_len);
+    assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+    assert(nbt_tokenise(&index_parser, index_tok, tok_len) == 0);
+    assert(!parser.list_index && index_parser.list_index);
+
+    list_element_against_iter(tok, tok_len, &parser, &setting, "Items", nbt_compound, elements);
+    list_element_against_iter(index_tok, tok_len, &index_parser, &index_setting, "Items", nbt_compound, elements);
+    list_element_against_iter(tok, tok_len, &parser, &setting, "Values", nbt_int, elements);
+    list_element_against_iter(tok, tok_len, &parser, &setting, "Names", nbt_string, elements);
+
+    /* The last elements, reached by a scan and through the index */
+    const int rounds = 2000;
+    struct nbt_lookup_t path[4] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list, .name = "Items"}, {.type = nbt_compound}, {.type = nbt_int, .name = "Slot"}};
+    struct nbt_index_t res;
+    int32_t slot;
+
+    clock_t start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        path[1].index = elements - 1 - i % 100;
+        assert(nbt_find(tok, tok_len, &parser, path, 4, &res) == 0);
+        assert(nbt_get_int(&parser, &res, &slot) == 0 && slot == path[1].index);
+    }
+    double scan_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        path[1].index = elements - 1 - i % 100;
+        assert(nbt_find(index_tok, tok_len, &index_parser, path, 4, &res) == 0);
+        assert(nbt_get_int(&index_parser, &res, &slot) == 0 && slot == path[1].index);
+    }
+    double index_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    printf("Last of %d compounds, %d lookups: scan %lf, list index %lf\n", elements, rounds, scan_time, index_time);
+
+    /* Lists of ints need no index */
+    struct nbt_lookup_t value_path[3] = {{.type = nbt_compound, .name = ""}, {.type = nbt_list, .name = "Values"}, {.type = nbt_int}};
+
+    start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        value_path[1].index = i % 100;
+        assert(nbt_find(tok, tok_len, &parser, value_path, 3, &res) == 0);
+    }
+    double first_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        value_path[1].index = elements - 1 - i % 100;
+        assert(nbt_find(tok, tok_len, &parser, value_path, 3, &res) == 0);
+        assert(nbt_get_int(&parser, &res, &slot) == 0 && slot == value_path[1].index);
+    }
+    double last_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    printf("Elements of a list of %d ints, %d lookups: first %lf, last %lf\n", elements, rounds, first_time, last_time);
+
+    /* A new tokenisation replaces the index */
+    nbt_clear_parser(&index_parser, &buf);
+    assert(!index_parser.list_index);
+    assert(nbt_tokenise(&index_parser, index_tok, tok_len) == 0 && index_parser.list_index);
+
+    nbt_destroy_parser(&parser);
+    nbt_destroy_parser(&index_parser);
+    free(nbt_data);
+    free(tok);
+    free(index_tok);
+}
+
+/* The child of the root compound called `name`, with the names compared through their keys or with memcmp */
+static int find_child(nbt_tok* tok, const char* nbt_data, const struct nbt_query_step* step, const bool use_key)
+{
+    for (int i = 2; i < tok[0].next; i = tok[i].next)
+    {
+        nbt_tok* id = &tok[i + 1];
+        if (id->len != step->name_len + 2) continue;
+
+        if (use_key ? nbt_name_equals(nbt_data + id->start + 2, step->name, step->name_len, &step->key) : memcmp(nbt_data + id->start + 2, step->name, step->name_len) == 0) return i;
+    }
+
+    return NBT_WARN;
+}
+
+/* Lookups of long namespaced keys, which share their first bytes */
+static void keys_against_memcmp(const int keys, const int lookups)
+{
+    const int buf_len = keys * 64 + 64;
+    char* nbt_data = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, nbt_data, buf_len, "", 0) == 0);
+    for (int i = 0; i < keys; i++)
+    {
+        char name[MAX_NAME_LEN + 1];
+        int name_len = snprintf(name, sizeof(name), "minecraft:generic.attribute_modifier_%04d", i);
+        assert(nbt_add_integer(&b, nbt_data, buf_len, name, name_len, i) == 0);
+    }
+    assert(nbt_end_compound(&b, nbt_data, buf_len) == 0);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = b.offset};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    double time_used;
+    nbt_tok* tok;
+    int tok_len = tokenise_timed(&buf, &setting, &tok, &time_used);
+    nbt_init_parser(&parser, &buf, &setting);
+
+    nbt_query** queries = malloc(sizeof(nbt_query*) * keys);
+    for (int i = 0; i < keys; i++)
+    {
+        struct nbt_lookup_t path[2] = {{.type = nbt_compound, .name = ""}, {.type = nbt_int}};
+        snprintf(path[1].name, sizeof(path[1].name), "minecraft:generic.attribute_modifier_%04d", i);
+        queries[i] = nbt_compile_query(&setting, path, 2);
+        assert(queries[i]);
+    }
+
+    struct nbt_index_t res;
+    clock_t start = clock();
+    for (int i = 0; i < lookups; i++)
+    {
+        int key = (i * 7919) % keys;
+        assert(nbt_find_query(tok, tok_len, &parser, queries[key], &res) == 0);
+        assert(char_to_int(nbt_data + res.start) == key);
+    }
+    double query_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    double compare_time[2];
+    for (int use_key = 0; use_key < 2; use_key++)
+    {
+        start = clock();
+        for (int i = 0; i < lookups; i++)
+        {
+            int key = (i * 7919) % keys;
+            int found = find_child(tok, nbt_data, &queries[key]->steps[1], use_key);
+            assert(found >= 0 && char_to_int(nbt_data + tok[found + 2].start) == key);
+        }
+        compare_time[use_key] = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+    }
+
+    printf("%d keys: %lf ns per query, scan with name keys %lf ns, with memcmp %lf ns\n", keys, query_time * 1e9 / lookups, compare_time[1] * 1e9 / lookups, compare_time[0] * 1e9 / lookups);
+
+    for (int i = 0; i < keys; i++)
+    {
+        nbt_destroy_query(queries[i]);
+    }
+    free(queries);
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+}
+
+/* Names must match on every byte, whatever their length */
+void libnbt_keys()
+{
+    const char* names[] = {"a", "abcdefg", "abcdefgh", "abcdefghijklmnop", "abcdefghijklmnopq", "minecraft:generic.attribute_modifier_0001_with_a_long_tail_of_bytes"};
+    const int count = sizeof(names) / sizeof(names[0]);
+
+    for (int n = 0; n < count; n++)
+    {
+        int len = strlen(names[n]);
+        struct nbt_name_key key = nbt_make_name_key(names[n], len);
+        assert(nbt_name_equals(names[n], names[n], len, &key));
+
+        /* Change every byte in turn */
+        char other[128];
+        for (int i = 0; i < len; i++)
+        {
+            memcpy(other, names[n], len);
+            other[i] ^= 0x20;
+            assert(!nbt_name_equals(other, names[n], len, &key));
+        }
+    }
+
+    keys_against_memcmp(10, 200000);
+    keys_against_memcmp(100, 50000);
+    keys_against_memcmp(1000, 5000);
+}
+
+/* A player compound of 20 fields, with the types found in player data */
+static int build_player(nbt_build* b, char* buf, const int buf_len, const int seed)
+{
+    int uuid[4] = {seed, seed + 1, seed + 2, seed + 3};
+    char dimension[] = "minecraft:overworld";
+    int res = 0;
+
+    nbt_init_build(b);
+    res |= nbt_start_compound(b, buf, buf_len, "", 0);
+    res |= nbt_add_integer(b, buf, buf_len, "DataVersion", 11, 3465);
+    res |= nbt_add_float(b, buf, buf_len, "Health", 6, 20.0f);
+    res |= nbt_add_integer(b, buf, buf_len, "foodLevel", 9, 20);
+    res |= nbt_add_float(b, buf, buf_len, "foodSaturationLevel", 19, 5.0f);
+    res |= nbt_add_integer(b, buf, buf_len, "XpLevel", 7, seed % 30);
+    res |= nbt_add_float(b, buf, buf_len, "XpP", 3, 0.25f);
+    res |= nbt_add_integer(b, buf, buf_len, "Score", 5, seed);
+    res |= nbt_add_integer(b, buf, buf_len, "SelectedItemSlot", 16, seed % 9);
+    res |= nbt_add_integer(b, buf, buf_len, "playerGameType", 14, 0);
+    res |= nbt_add_char(b, buf, buf_len, "OnGround", 8, 1);
+    res |= nbt_add_short(b, buf, buf_len, "Air", 3, 300);
+    res |= nbt_add_short(b, buf, buf_len, "Fire", 4, -20);
+    res |= nbt_add_float(b, buf, buf_len, "FallDistance", 12, 0.0f);
+    res |= nbt_add_string(b, buf, buf_len, "Dimension", 9, dimension, 19);
+    res |= nbt_add_int_array(b, buf, buf_len, "UUID", 4, uuid, 4);
+    res |= nbt_start_list(b, buf, buf_len, "Pos", 3);
+    res |= nbt_add_double(b, buf, buf_len, NULL, 0, seed);
+    res |= nbt_add_double(b, buf, buf_len, NULL, 0, 64.0);
+    res |= nbt_add_double(b, buf, buf_len, NULL, 0, -seed);
+    res |= nbt_end_list(b, buf, buf_len);
+    res |= nbt_start_list(b, buf, buf_len, "Rotation", 8);
+    res |= nbt_add_float(b, buf, buf_len, NULL, 0, 90.0f);
+    res |= nbt_add_float(b, buf, buf_len, NULL, 0, -12.5f);
+    res |= nbt_end_list(b, buf, buf_len);
+    res |= nbt_add_char(b, buf, buf_len, "seenCredits", 11, 0);
+    res |= nbt_add_long(b, buf, buf_len, "LastDeathTime", 13, 1234567890123L + seed);
+    res |= nbt_add_long(b, buf, buf_len, "WorldUUIDMost", 13, -4000000000L);
+    res |= nbt_add_long(b, buf, buf_len, "WorldUUIDLeast", 14, 5000000000L);
+    res |= nbt_end_compound(b, buf, buf_len);
+
+    return res;
+}
+
+static char* hand_header(char* out, const nbt_type_t type, const char* name, const int name_len)
+{
+    out[0] = type;
+    out[1] = name_len >> 8;
+    out[2] = name_len;
+    memcpy(out + 3, name, name_len);
+
+    return out + 3 + name_len;
+}
+
+static char* hand_int(char* out, const uint32_t value)
+{
+    uint32_t big = bswap_32(value);
+    memcpy(out, &big, 4);
+    return out + 4;
+}
+
+static char* hand_long(char* out, const uint64_t value)
+{
+    uint64_t big = bswap_64(value);
+    memcpy(out, &big, 8);
+    return out + 8;
+}
+
+static char* hand_float(char* out, const float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    return hand_int(out, bits);
+}
+
+static char* hand_double(char* out, const double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    return hand_long(out, bits);
+}
+
+static char* hand_short(char* out, const uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value;
+    return out + 2;
+}
+
+/* The same player written byte by byte, as a serializer made for it would */
+static int build_player_by_hand(char* buf, const int seed)
+{
+    char* p = buf;
+
+    p = hand_header(p, nbt_compound, "", 0);
+    p = hand_int(hand_header(p, nbt_int, "DataVersion", 11), 3465);
+    p = hand_float(hand_header(p, nbt_float, "Health", 6), 20.0f);
+    p = hand_int(hand_header(p, nbt_int, "foodLevel", 9), 20);
+    p = hand_float(hand_header(p, nbt_float, "foodSaturationLevel", 19), 5.0f);
+    p = hand_int(hand_header(p, nbt_int, "XpLevel", 7), seed % 30);
+    p = hand_float(hand_header(p, nbt_float, "XpP", 3), 0.25f);
+    p = hand_int(hand_header(p, nbt_int, "Score", 5), seed);
+    p = hand_int(hand_header(p, nbt_int, "SelectedItemSlot", 16), seed % 9);
+    p = hand_int(hand_header(p, nbt_int, "playerGameType", 14), 0);
+    p = hand_header(p, nbt_byte, "OnGround", 8);
+    *p++ = 1;
+    p = hand_short(hand_header(p, nbt_short, "Air", 3), 300);
+    p = hand_short(hand_header(p, nbt_short, "Fire", 4), -20);
+    p = hand_float(hand_header(p, nbt_float, "FallDistance", 12), 0.0f);
+    p = hand_short(hand_header(p, nbt_string, "Dimension", 9), 19);
+    memcpy(p, "minecraft:overworld", 19);
+    p += 19;
+    p = hand_int(hand_header(p, nbt_int_array, "UUID", 4), 4);
+    for (int i = 0; i < 4; i++)
+    {
+        p = hand_int(p, seed + i);
+    }
+    p = hand_header(p, nbt_list, "Pos", 3);
+    *p++ = nbt_double;
+    p = hand_double(hand_double(hand_double(hand_int(p, 3), seed), 64.0), -seed);
+    p = hand_header(p, nbt_list, "Rotation", 8);
+    *p++ = nbt_float;
+    p = hand_float(hand_float(hand_int(p, 2), 90.0f), -12.5f);
+    p = hand_header(p, nbt_byte, "seenCredits", 11);
+    *p++ = 0;
+    p = hand_long(hand_header(p, nbt_long, "LastDeathTime", 13), 1234567890123L + seed);
+    p = hand_long(hand_header(p, nbt_long, "WorldUUIDMost", 13), -4000000000L);
+    p = hand_long(hand_header(p, nbt_long, "WorldUUIDLeast", 14), 5000000000L);
+    *p++ = nbt_end;
+
+    return p - buf;
+}
+
+/* The builder must write what a hand written serializer writes, and fail cleanly when the buffer is too small */
+void libnbt_build()
+{
+    const int buf_len = 1024;
+    char* buf = malloc(buf_len);
+    char* hand_buf = malloc(buf_len);
+
+    nbt_build b;
+    assert(build_player(&b, buf, buf_len, 7) == 0);
+    int player_len = build_player_by_hand(hand_buf, 7);
+    assert((int)b.offset == player_len);
+    assert(memcmp(buf, hand_buf, player_len) == 0);
+
+    /* An exact fit is enough, one byte less is not */
+    assert(build_player(&b, buf, player_len, 7) == 0);
+    assert(build_player(&b, buf, player_len - 1, 7) == NBT_NOMEM); // Only the last end tag is missing
+
+    /* A buffer given shorter than what is already built */
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, buf, buf_len, "player", 6) == 0);
+    assert(nbt_add_integer(&b, buf, buf_len, "level", 5, 7) == 0);
+    assert(nbt_add_char(&b, buf, 4, "x", 1, 1) == NBT_NOMEM);
+
+    /* The arrays given are left as they were */
+    int ints[3] = {1, 2, 3};
+    long longs[2] = {-1, 1L << 40};
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, buf, buf_len, "", 0) == 0);
+    assert(nbt_add_int_array(&b, buf, buf_len, "ints", 4, ints, 3) == 0);
+    assert(nbt_add_long_array(&b, buf, buf_len, "longs", 5, longs, 2) == 0);
+    assert(nbt_end_compound(&b, buf, buf_len) == 0);
+    assert(ints[0] == 1 && ints[2] == 3 && longs[0] == -1 && longs[1] == 1L << 40);
+
+    struct nbt_sized_buffer nbt_buf = {.content = buf, .len = b.offset};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_tok* tok;
+    double time_used;
+    int tok_len = tokenise_timed(&nbt_buf, &setting, &tok, &time_used);
+    nbt_init_parser(&parser, &nbt_buf, &setting);
+
+    nbt_query_cache* cache = nbt_create_query_cache(&setting);
+    struct nbt_index_t res;
+    struct nbt_array_view array;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".ints"), &res) == 0);
+    assert(nbt_get_array(&parser, &res, nbt_int_array, &array) == 0 && array.len == 3 && nbt_array_int(&array, 2) == 3);
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".longs"), &res) == 0);
+    assert(nbt_get_array(&parser, &res, nbt_long_array, &array) == 0 && array.len == 2 && nbt_array_long(&array, 1) == 1L << 40);
+
+    nbt_destroy_query_cache(cache);
+    nbt_destroy_parser(&parser);
+    free(tok);
+
+    /* Fields per second */
+    const int players = 200000;
+    const int fields = 20;
+
+    clock_t start = clock();
+    for (int i = 0; i < players; i++)
+    {
+        assert(build_player(&b, buf, buf_len, i) == 0);
+    }
+    double build_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < players; i++)
+    {
+        assert(build_player_by_hand(hand_buf, i) == player_len);
+    }
+    double hand_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    printf("Building %d players: builder %lf fields/s, by hand %lf fields/s\n", players, players * fields / build_time, players * fields / hand_time);
+
+    free(buf);
+    free(hand_buf);
+}
+
+/* Entities built by a growable builder must match those built in a buffer large enough */
+static void growable_against_fixed(const struct nbt_build_setting_t* setting, const int entities)
+{
+    int nbt_len;
+    char* fixed = build_entities(entities, &nbt_len);
+
+    nbt_build b;
+    assert(nbt_init_growable_build(&b, setting) == 0);
+
+    clock_t start = clock();
+    assert(nbt_start_compound(&b, NULL, 0, "", 0) == 0);
+    build_entity_list(&b, NULL, 0, "Entities", 8, entities);
+    assert(nbt_end_compound(&b, NULL, 0) == 0);
+
+    size_t len;
+    char* grown = nbt_finish_build(&b, &len);
+    double time_used = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(grown && (int)len == nbt_len);
+    assert(memcmp(grown, fixed, len) == 0);
+
+    printf("%d entities, %zu bytes: built in %lf with a growable buffer\n", entities, len, time_used);
+
+    if (setting->free) {
+        setting->free(grown);
+    }
+    else {
+        free(grown);
+    }
+    free(fixed);
+}
+
+/* Builders owning their buffer, grown through the hooks of the setting */
+void libnbt_growable_build()
+{
+    struct nbt_build_setting_t setting = {.init_len = 256, .alloc = counting_alloc, .realloc = counting_realloc, .free = counting_free};
+    struct nbt_build_setting_t alloc_only = {.init_len = 16, .alloc = counting_alloc, .free = counting_free};
+    struct nbt_build_setting_t defaults = {0};
+
+    /* From a few hundred bytes to a few megabytes, the buffer is doubled as needed */
+    const int sizes[] = {10, 1000, 20000};
+    for (int i = 0; i < 3; i++)
+    {
+        build_reallocs = 0;
+        growable_against_fixed(&setting, sizes[i]);
+
+        int doublings = 0;
+        for (long len = 256; len < sizes[i] * 160L; len *= 2) doublings++;
+        assert(build_reallocs <= doublings + 1);
+    }
+
+    build_allocs = build_frees = 0;
+    growable_against_fixed(&alloc_only, 1000);
+    assert(build_allocs > 1 && build_allocs == build_frees);
+
+    growable_against_fixed(&defaults, 1000);
+
+    /* The data is only handed back once it is complete */
+    build_frees = 0;
+    nbt_build b;
+    size_t len;
+    assert(nbt_init_growable_build(&b, &setting) == 0);
+    assert(nbt_finish_build(&b, &len) == NULL); // Nothing built yet
+    nbt_destroy_build(&b);
+    assert(build_frees == 1);
+
+    build_frees = 0;
+    assert(nbt_init_growable_build(&b, &setting) == 0);
+    assert(nbt_start_compound(&b, NULL, 0, "", 0) == 0);
+    assert(nbt_add_integer(&b, NULL, 0, "x", 1, 1) == 0);
+
+    assert(nbt_finish_build(&b, &len) == NULL);
+    nbt_destroy_build(&b);
+    assert(build_frees == 1);
+
+    /* A fixed builder has nothing to hand back */
+    char buf[16];
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, buf, sizeof(buf), "", 0) == 0);
+    assert(nbt_end_compound(&b, buf, sizeof(buf)) == 0);
+    assert(nbt_finish_build(&b, &len) == NULL);
+}
+
+struct memory_sink {
+    char* data;
+    size_t len;
+    size_t capacity;
+
+    int writes;
+    int patches;
+};
+
+static int memory_write(void* ctx, const char* data, size_t len)
+{
+    struct memory_sink* sink = ctx;
+    if (sink->len + len > sink->capacity) return -1;
+
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+    sink->writes++;
+
+    return 0;
+}
+
+static int memory_patch(void* ctx, size_t offset, const char* data, size_t len)
+{
+    struct memory_sink* sink = ctx;
+    if (offset + len > sink->len) return -1;
+
+    memcpy(sink->data + offset, data, len);
+    sink->patches++;
+
+    return 0;
+}
+
+static int file_write(void* ctx, const char* data, size_t len)
+{
+    return fwrite(data, 1, len, ctx) == len ? 0 : -1;
+}
+
+static int file_patch(void* ctx, size_t offset, const char* data, size_t len)
+{
+    FILE* file = ctx;
+    long end = ftell(file);
+
+    if (fseek(file, offset, SEEK_SET) || fwrite(data, 1, len, file) != len) return -1;
+    return fseek(file, end, SEEK_SET);
+}
+
+/* Streams lists of entities to `sink`, returns the largest the buffer of the builder got */
+static size_t stream_entity_lists(const struct nbt_build_sink_t* sink, const int lists, const int entities)
+{
+    struct nbt_build_setting_t setting = {0};
+
+    nbt_build b;
+    assert(nbt_init_stream_build(&b, &setting, sink) == 0);
+    assert(nbt_start_compound(&b, NULL, 0, "", 0) == 0);
+    for (int list = 0; list < lists; list++)
+    {
+        char name[16];
+        int name_len = list ? snprintf(name, sizeof(name), "Entities%d", list) : snprintf(name, sizeof(name), "Entities");
+
+        build_entity_list(&b, NULL, 0, name, name_len, entities);
+    }
+    assert(nbt_end_compound(&b, NULL, 0) == 0);
+    assert(nbt_flush_build(&b) == 0);
+
+    size_t buf_len = b.buf_len;
+    size_t len;
+    assert(nbt_finish_build(&b, &len) == NULL);
+    nbt_destroy_build(&b);
+
+    return buf_len;
+}
+
+/* Streamed data must be the same as data built in one buffer, with a buffer bounded by the depth when the sink can be patched */
+void libnbt_stream_build()
+{
+    const int lists = 3;
+    const int entities = 5000;
+
+    int nbt_len;
+    char* expected = build_entity_lists(lists, entities, &nbt_len);
+
+    struct memory_sink memory = {.data = malloc(nbt_len), .capacity = nbt_len};
+    struct nbt_build_sink_t patched = {.write = memory_write, .patch = memory_patch, .ctx = &memory, .flush_len = 4096};
+
+    clock_t start = clock();
+    size_t buf_len = stream_entity_lists(&patched, lists, entities);
+    double time_used = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(memory.len == (size_t)nbt_len);
+    assert(memcmp(memory.data, expected, nbt_len) == 0);
+    assert(memory.patches >= lists && buf_len <= 8192); // Lists open when the buffer is flushed are patched
+
+    printf("Streaming %d bytes: %d writes, %d patches, %zu bytes of buffer, %lf\n", nbt_len, memory.writes, memory.patches, buf_len, time_used);
+
+    /* A sink that cannot be patched, like a compressor, gets every list once it is complete */
+    memory.len = memory.writes = memory.patches = 0;
+    struct nbt_build_sink_t append_only = {.write = memory_write, .ctx = &memory, .flush_len = 4096};
+
+    buf_len = stream_entity_lists(&append_only, lists, entities);
+    assert(memory.len == (size_t)nbt_len);
+    assert(memcmp(memory.data, expected, nbt_len) == 0);
+    assert(memory.patches == 0 && buf_len < (size_t)nbt_len);
+
+    /* Without patch the whole of each list is held, the buffer grows with the largest list */
+    size_t list_len = nbt_len / lists;
+    assert(buf_len >= list_len);
+    printf("Streaming without patch: %zu bytes of buffer for lists of %zu bytes\n", buf_len, list_len);
+
+    /* A cap on the buffer stops a list too large to be held, and not the same list when it can be patched */
+    const size_t max_len = 16384;
+    struct nbt_build_sink_t capped = {.write = memory_write, .ctx = &memory, .flush_len = 4096, .max_len = max_len};
+    struct nbt_build_sink_t capped_patched = {.write = memory_write, .patch = memory_patch, .ctx = &memory, .flush_len = 4096, .max_len = max_len};
+    const struct nbt_build_sink_t* capped_sinks[2] = {&capped, &capped_patched};
+
+    for (int patch = 0; patch < 2; patch++)
+    {
+        memory.len = 0;
+        struct nbt_build_setting_t capped_setting = {0};
+        nbt_build capped_b;
+        assert(nbt_init_stream_build(&capped_b, &capped_setting, capped_sinks[patch]) == 0);
+        assert(nbt_start_compound(&capped_b, NULL, 0, "", 0) == 0);
+        assert(nbt_start_list(&capped_b, NULL, 0, "Values", 6) == 0);
+
+        int res = 0;
+        for (int i = 0; i < 10000 && res == 0; i++)
+        {
+            res = nbt_add_double(&capped_b, NULL, 0, NULL, 0, i);
+        }
+        assert(res == (patch ? 0 : NBT_NOMEM));
+        assert(capped_b.offset - capped_b.flushed <= max_len);
+
+        nbt_destroy_build(&capped_b);
+    }
+
+    /* A file */
+    FILE* file = tmpfile();
+    assert(file);
+    struct nbt_build_sink_t file_sink = {.write = file_write, .patch = file_patch, .ctx = file, .flush_len = 1 << 16};
+
+    stream_entity_lists(&file_sink, lists, entities);
+    assert(ftell(file) == nbt_len);
+
+    rewind(file);
+    memset(memory.data, 0, nbt_len);
+    assert(fread(memory.data, 1, nbt_len, file) == (size_t)nbt_len);
+    assert(memcmp(memory.data, expected, nbt_len) == 0);
+    fclose(file);
+
+    /* A failing sink stops the build */
+    memory.len = 0;
+    memory.capacity = 100;
+    struct nbt_build_setting_t setting = {0};
+    nbt_build b;
+    assert(nbt_init_stream_build(&b, &setting, &patched) == 0);
+    assert(nbt_start_compound(&b, NULL, 0, "", 0) == 0);
+
+    int res = 0;
+    for (int i = 0; i < 1000 && res == 0; i++)
+    {
+        res = nbt_add_double(&b, NULL, 0, "x", 1, i);
+    }
+    assert(res == NBT_WARN);
+    nbt_destroy_build(&b);
+
+    free(memory.data);
+    free(expected);
+}
+
+/* Arrays encoded a vector at a time must match the scalar encoding, at any length and alignment */
+void libnbt_encode()
+{
+    const int max = 4096;
+    int64_t* longs = malloc(sizeof(int64_t) * max);
+    int32_t* ints = malloc(sizeof(int32_t) * max);
+    char* out = malloc(max * 8 + 16);
+    char* expected = malloc(max * 8 + 16);
+
+    for (int i = 0; i < max; i++)
+    {
+        longs[i] = (int64_t)(UINT64_C(0x0102030405060708) * (uint64_t)(i + 1) ^ -(uint64_t)i);
+        ints[i] = (int32_t)(UINT32_C(0x01020304) * (uint32_t)(i + 1) ^ -(uint32_t)i);
+    }
+
+    for (int count = 0; count < 40; count++)
+    {
+        for (int offset = 0; offset < 3; offset++)
+        {
+            nbt_encode_longs_scalar(expected, longs, count);
+            nbt_encode_longs(out + offset, longs, count);
+            assert(memcmp(out + offset, expected, count * 8) == 0);
+
+            nbt_encode_ints_scalar(expected, ints, count);
+            nbt_encode_ints(out + offset, ints, count);
+            assert(memcmp(out + offset, expected, count * 4) == 0);
+        }
+    }
+    assert(char_to_int(expected + 4) == ints[1]);
+
+    /* GB/s over heightmap sized arrays */
+    const int rounds = 20000;
+    const double bytes = (double)rounds * max * 8;
+    double time_used[2];
+
+    for (int simd = 0; simd < 2; simd++)
+    {
+        clock_t start = clock();
+        for (int i = 0; i < rounds; i++)
+        {
+            if (simd) nbt_encode_longs(out, longs, max);
+            else nbt_encode_longs_scalar(out, longs, max);
+        }
+        time_used[simd] = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+        assert(char_to_long(out + (max - 1) * 8) == longs[max - 1]);
+    }
+
+    printf("Encoding long arrays of %d: scalar %lf GB/s, nbt_encode_longs (%s) %lf GB/s\n", max, bytes / time_used[0] / 1e9, nbt_encode_path(), bytes / time_used[1] / 1e9);
+
+    /* The builder leaves the arrays it is given as they were */
+    const int buf_len = max * 8 + 64;
+    char* buf = malloc(buf_len);
+    int64_t first = longs[0];
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, buf, buf_len, "", 0) == 0);
+    assert(nbt_add_long_array(&b, buf, buf_len, "MOTION_BLOCKING", 15, (long*)longs, max) == 0);
+    assert(nbt_end_compound(&b, buf, buf_len) == 0);
+    assert(longs[0] == first);
+    assert(char_to_long(buf + 3 + 1 + 2 + 15 + 4) == first);
+
+    free(buf);
+    free(longs);
+    free(ints);
+    free(out);
+    free(expected);
+}
+
+/* Adds every kind of list element by element, or with the bulk functions */
+static int build_number_lists(nbt_build* b, char* buf, const int buf_len, const bool bulk)
+{
+    char bytes[5] = {1, -2, 3, -4, 5};
+    short shorts[4] = {1, -2, 300, -32768};
+    int ints[6] = {1, -2, 3, 1 << 30, -5, 6};
+    long longs[3] = {1, -2, 1L << 40};
+    float floats[2] = {0.5f, -1.25f};
+    double doubles[3] = {1.0, 64.0, -1e300};
+    int res = 0;
+
+    nbt_init_build(b);
+    res |= nbt_start_compound(b, buf, buf_len, "", 0);
+
+    if (bulk) {
+        res |= nbt_add_char_list(b, buf, buf_len, "bytes", 5, bytes, 5);
+        res |= nbt_add_short_list(b, buf, buf_len, "shorts", 6, shorts, 4);
+        res |= nbt_add_integer_list(b, buf, buf_len, "ints", 4, ints, 6);
+        res |= nbt_add_long_list(b, buf, buf_len, "longs", 5, longs, 3);
+        res |= nbt_add_float_list(b, buf, buf_len, "floats", 6, floats, 2);
+        res |= nbt_add_double_list(b, buf, buf_len, "empty", 5, doubles, 0);
+
+        res |= nbt_start_list(b, buf, buf_len, "nested", 6);
+        res |= nbt_add_double_list(b, buf, buf_len, NULL, 0, doubles, 3);
+        res |= nbt_add_double_list(b, buf, buf_len, NULL, 0, doubles + 1, 2);
+        res |= nbt_end_list(b, buf, buf_len);
+    }
+    else {
+        res |= nbt_start_list(b, buf, buf_len, "bytes", 5);
+        for (int i = 0; i < 5; i++) res |= nbt_add_char(b, buf, buf_len, NULL, 0, bytes[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+
+        res |= nbt_start_list(b, buf, buf_len, "shorts", 6);
+        for (int i = 0; i < 4; i++) res |= nbt_add_short(b, buf, buf_len, NULL, 0, shorts[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+
+        res |= nbt_start_list(b, buf, buf_len, "ints", 4);
+        for (int i = 0; i < 6; i++) res |= nbt_add_integer(b, buf, buf_len, NULL, 0, ints[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+
+        res |= nbt_start_list(b, buf, buf_len, "longs", 5);
+        for (int i = 0; i < 3; i++) res |= nbt_add_long(b, buf, buf_len, NULL, 0, longs[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+
+        res |= nbt_start_list(b, buf, buf_len, "floats", 6);
+        for (int i = 0; i < 2; i++) res |= nbt_add_float(b, buf, buf_len, NULL, 0, floats[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+
+        /* An empty list gets the type of its elements only from the bulk function */
+        res |= nbt_start_list(b, buf, buf_len, "empty", 5);
+        res |= nbt_end_list(b, buf, buf_len);
+
+        res |= nbt_start_list(b, buf, buf_len, "nested", 6);
+        res |= nbt_start_list(b, buf, buf_len, NULL, 0);
+        for (int i = 0; i < 3; i++) res |= nbt_add_double(b, buf, buf_len, NULL, 0, doubles[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+        res |= nbt_start_list(b, buf, buf_len, NULL, 0);
+        for (int i = 1; i < 3; i++) res |= nbt_add_double(b, buf, buf_len, NULL, 0, doubles[i]);
+        res |= nbt_end_list(b, buf, buf_len);
+        res |= nbt_end_list(b, buf, buf_len);
+    }
+
+    res |= nbt_end_compound(b, buf, buf_len);
+    return res;
+}
+
+/* Lists written in one call must be the same as lists written element by element */
+void libnbt_list_build()
+{
+    const int buf_len = 1024;
+    char* buf = malloc(buf_len);
+    char* bulk_buf = malloc(buf_len);
+
+    nbt_build b, bulk_b;
+    assert(build_number_lists(&b, buf, buf_len, false) == 0);
+    assert(build_number_lists(&bulk_b, bulk_buf, buf_len, true) == 0);
+    assert(b.offset == bulk_b.offset);
+
+    /* Only the type of the empty list differs */
+    const char* empty = "\x09\x00\x05" "empty";
+    size_t header = 0;
+    while (header + 8 < b.offset && memcmp(buf + header, empty, 8)) header++;
+    assert(header + 8 < b.offset && buf[header + 8] == nbt_end && bulk_buf[header + 8] == nbt_double);
+    bulk_buf[header + 8] = nbt_end;
+    assert(memcmp(buf, bulk_buf, b.offset) == 0);
+
+    /* The lists written in one call can be read back */
+    struct nbt_sized_buffer nbt_buf = {.content = bulk_buf, .len = bulk_b.offset};
+    struct nbt_parser parser;
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    nbt_tok* tok;
+    double time_used;
+    int tok_len = tokenise_timed(&nbt_buf, &setting, &tok, &time_used);
+    nbt_init_parser(&parser, &nbt_buf, &setting);
+
+    nbt_query_cache* cache = nbt_create_query_cache(&setting);
+    struct nbt_index_t res;
+    int16_t s;
+    double d;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".shorts[3]"), &res) == 0);
+    assert(nbt_get_short(&parser, &res, &s) == 0 && s == -32768);
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".nested[1][1]"), &res) == 0);
+    assert(nbt_get_double(&parser, &res, &d) == 0 && d == -1e300);
+
+    const double doubles_built[3] = {1.0, 64.0, -1e300};
+    for (int i = 0; i < 3; i++)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "\"\".nested[0][%d]", i);
+        assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, path), &res) == 0);
+        assert(nbt_get_double(&parser, &res, &d) == 0 && d == doubles_built[i]);
+    }
+
+    int64_t l;
+    assert(nbt_find_query(tok, tok_len, &parser, nbt_cache_query(cache, "\"\".longs[2]"), &res) == 0);
+    assert(nbt_get_long(&parser, &res, &l) == 0 && l == (int64_t)1 << 40);
+
+    nbt_destroy_query_cache(cache);
+    nbt_destroy_parser(&parser);
+    free(tok);
+    free(buf);
+    free(bulk_buf);
+
+    /* A large list of doubles, element by element and in one call */
+    const int elements = 100000;
+    const int large_len = elements * 8 + 64;
+    double* doubles = malloc(sizeof(double) * elements);
+    char* large = malloc(large_len);
+    char* bulk_large = malloc(large_len);
+
+    for (int i = 0; i < elements; i++)
+    {
+        doubles[i] = i * 0.5;
+    }
+
+    clock_t start = clock();
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, large, large_len, "", 0) == 0);
+    assert(nbt_start_list(&b, large, large_len, "Values", 6) == 0);
+    for (int i = 0; i < elements; i++)
+    {
+        assert(nbt_add_double(&b, large, large_len, NULL, 0, doubles[i]) == 0);
+    }
+    assert(nbt_end_list(&b, large, large_len) == 0);
+    assert(nbt_end_compound(&b, large, large_len) == 0);
+    double element_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    nbt_init_build(&bulk_b);
+    assert(nbt_start_compound(&bulk_b, bulk_large, large_len, "", 0) == 0);
+    assert(nbt_add_double_list(&bulk_b, bulk_large, large_len, "Values", 6, doubles, elements) == 0);
+    assert(nbt_end_compound(&bulk_b, bulk_large, large_len) == 0);
+    double bulk_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(b.offset == bulk_b.offset && memcmp(large, bulk_large, b.offset) == 0);
+
+    printf("List of %d doubles: element by element %lf, in one call %lf\n", elements, element_time, bulk_time);
+
+    free(doubles);
+    free(large);
+    free(bulk_large);
+}
+
+/* Lists of doubles tokenised element by element and as a single token */
+void libnbt_collapsed()
+{
+    const int list_len = 100000;
+    const int buf_len = list_len * 8 + 64;
+    char* nbt_data = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, nbt_data, buf_len, "", 0) == 0);
+    assert(nbt_start_list(&b, nbt_data, buf_len, "Pos", 3) == 0);
+    for (int i = 0; i < list_len; i++)
+    {
+        assert(nbt_add_double(&b, nbt_data, buf_len, NULL, 0, i * 0.5) == 0);
+    }
+    assert(nbt_end_list(&b, nbt_data, buf_len) == 0);
+    assert(nbt_end_compound(&b, nbt_data, buf_len) == 0);
+
+    struct nbt_sized_buffer buf = {.content = nbt_data, .len = b.offset};
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser_setting_t collapse_setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free, .collapse_lists = true};
+
+    nbt_tok* tok;
+    nbt_tok* collapsed_tok;
+    double time_used, collapsed_time_used;
+    int tok_len = tokenise_timed(&buf, &setting, &tok, &time_used);
+    int collapsed_tok_len = tokenise_timed(&buf, &collapse_setting, &collapsed_tok, &collapsed_time_used);
+
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, &buf, &collapse_setting);
+
+    struct nbt_lookup_t path[3];
+    path[0] = (struct nbt_lookup_t){.type = nbt_compound, .name = ""};
+    path[1] = (struct nbt_lookup_t){.type = nbt_list, .name = "Pos", .index = list_len - 1};
+    path[2] = (struct nbt_lookup_t){.type = nbt_double};
+
+    struct nbt_index_t res = {0};
+    struct nbt_index_t collapsed_res = {0};
+    assert(nbt_find(tok, tok_len, &parser, path, 3, &res) == 0);
+
+    path[1].index = list_len - 1;
+    assert(nbt_find(collapsed_tok, collapsed_tok_len, &parser, path, 3, &collapsed_res) == 0);
+
+    assert(memcmp(&res, &collapsed_res, sizeof(struct nbt_index_t)) == 0);
+    assert(char_to_double(nbt_data + collapsed_res.start) == (list_len - 1) * 0.5);
+
+    printf("List of %d doubles: %d tokens in %lf, collapsed %d tokens in %lf\n", list_len, tok_len, time_used, collapsed_tok_len, collapsed_time_used);
+
+    nbt_destroy_parser(&parser);
+    free(nbt_data);
+    free(tok);
+    free(collapsed_tok);
+}
+
+static void dispatch_against_legacy(const char* name, struct nbt_sized_buffer* buf, const struct nbt_parser_setting_t* setting, const int rounds)
+{
+    struct nbt_parser parser;
+    nbt_init_parser(&parser, buf, setting);
+
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    assert(tok_len > 0);
+    nbt_tok* tok = calloc(tok_len, sizeof(nbt_tok));
+    nbt_tok* legacy_tok = calloc(tok_len, sizeof(nbt_tok));
+
+    clock_t start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        nbt_clear_parser(&parser, buf);
+        assert(legacy_tokenise(&parser, legacy_tok, tok_len) == 0);
+    }
+    double legacy_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        nbt_clear_parser(&parser, buf);
+        assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+    }
+    double tok_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+
+    assert(memcmp(tok, legacy_tok, sizeof(nbt_tok) * tok_len) == 0);
+
+    double tokens = (double)tok_len * rounds;
+    printf("%s: legacy %lf tokens/s, table driven %lf tokens/s\n", name, tokens / legacy_time, tokens / tok_time);
+
+    nbt_destroy_parser(&parser);
+    free(tok);
+    free(legacy_tok);
+}
+
+/* Both tokenisers must stop at the same place on every truncation of the data and every shorter token array, and resume to the same tokens */
+static void truncated_against_legacy(struct nbt_sized_buffer* buf, const struct nbt_parser_setting_t* setting)
+{
+    struct nbt_parser parser, legacy_parser;
+    nbt_init_parser(&parser, buf, setting);
+    int tok_len = nbt_tokenise(&parser, NULL, 0);
+    nbt_destroy_parser(&parser);
+
+    nbt_tok* tok = calloc(tok_len, sizeof(nbt_tok));
+    nbt_tok* legacy_tok = calloc(tok_len, sizeof(nbt_tok));
+
+    for (int len = 0; len <= buf->len; len++)
+    {
+        /* Open tokens keep the fields they are not given yet */
+        memset(tok, 0, sizeof(nbt_tok) * tok_len);
+        memset(legacy_tok, 0, sizeof(nbt_tok) * tok_len);
+
+        struct nbt_sized_buffer part = {.content = buf->content, .len = len};
+        nbt_init_parser(&parser, &part, setting);
+        nbt_init_parser(&legacy_parser, &part, setting);
+
+        int res = nbt_tokenise(&parser, tok, tok_len);
+        assert(res == legacy_tokenise(&legacy_parser, legacy_tok, tok_len));
+        assert(parser.current_token == legacy_parser.current_token && parser.current_byte == legacy_parser.current_byte);
+        assert(memcmp(tok, legacy_tok, sizeof(nbt_tok) * parser.current_token) == 0);
+
+        /* The rest of the data arrives */
+        part.len = buf->len;
+        assert(nbt_tokenise(&parser, tok, tok_len) == 0);
+        assert(legacy_tokenise(&legacy_parser, legacy_tok, tok_len) == 0);
+        assert(memcmp(tok, legacy_tok, sizeof(nbt_tok) * tok_len) == 0);
+
+        nbt_destroy_parser(&parser);
+        nbt_destroy_parser(&legacy_parser);
+    }
+
+    for (int len = 0; len < tok_len; len++)
+    {
+        memset(tok, 0, sizeof(nbt_tok) * tok_len);
+        memset(legacy_tok, 0, sizeof(nbt_tok) * tok_len);
+
+        nbt_init_parser(&parser, buf, setting);
+        nbt_init_parser(&legacy_parser, buf, setting);
+
+        assert(nbt_tokenise(&parser, tok, len) == NBT_NOMEM);
+        assert(legacy_tokenise(&legacy_parser, legacy_tok, len) == NBT_NOMEM);
+        assert(parser.current_token == legacy_parser.current_token);
+        assert(memcmp(tok, legacy_tok, sizeof(nbt_tok) * parser.current_token) == 0);
+
+        nbt_destroy_parser(&parser);
+        nbt_destroy_parser(&legacy_parser);
+    }
+
+    free(tok);
+    free(legacy_tok);
+}
+
+/* The table driven tokeniser must give the same tokens as the original one, kept in the tests */
+void libnbt_dispatch()
+{
+    struct nbt_parser_setting_t setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free};
+    struct nbt_parser_setting_t collapse_setting = {.list_meta_init_len = 30, .alloc = malloc, .free = free, .collapse_lists = true};
+
+    char* file_contents;
+    size_t file_len = 0;
+    file_contents = cog_load_whole_file("test/bigtest.nbt.uncompressed", &file_len);
+
+    struct nbt_sized_buffer buf = {.content = file_contents, .len = file_len};
+    dispatch_against_legacy("bigtest", &buf, &setting, 2000);
+    dispatch_against_legacy("bigtest collapsed", &buf, &collapse_setting, 2000);
+    truncated_against_legacy(&buf, &setting);
+    truncated_against_legacy(&buf, &collapse_setting);
+
+    int nbt_len;
+    char* entities = build_entities(5000, &nbt_len);
+    struct nbt_sized_buffer entities_buf = {.content = entities, .len = nbt_len};
+    dispatch_against_legacy("5000 entities", &entities_buf, &setting, 5);
+    dispatch_against_legacy("5000 entities collapsed", &entities_buf, &collapse_setting, 5);
+
+    /* Nested and empty lists */
+    const int buf_len = 256;
+    char* nested = malloc(buf_len);
+
+    nbt_build b;
+    nbt_init_build(&b);
+    assert(nbt_start_compound(&b, nested, buf_len, "", 0) == 0);
+    assert(nbt_start_list(&b, nested, buf_len, "Empty", 5) == 0);
+    assert(nbt_end_list(&b, nested, buf_len) == 0);
+    assert(nbt_start_list(&b, nested, buf_len, "Outer", 5) == 0);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(nbt_start_list(&b, nested, buf_len, NULL, 0) == 0);
+        for (int j = 0; j < i; j++)
+        {
+            assert(nbt_add_integer(&b, nested, buf_len, NULL, 0, j) == 0);
+        }
+        assert(nbt_end_list(&b, nested, buf_len) == 0);
+    }
+    assert(nbt_end_list(&b, nested, buf_len) == 0);
+    assert(nbt_add_char(&b, nested, buf_len, "After", 5, 1) == 0);
+    assert(nbt_end_compound(&b, nested, buf_len) == 0);
+
+    struct nbt_sized_buffer nested_buf = {.content = nested, .len = b.offset};
+    dispatch_against_legacy("Nested lists", &nested_buf, &setting, 1);
+    truncated_against_legacy(&nested_buf, &setting);
+
+    free(file_contents);
+    free(entities);
+    free(nested);
+}
+
 int main(int argc, char const *argv[])
 {
     libnbt_parse();
+    libnbt_dry_run();
+    libnbt_parse_stream();
+    libnbt_auto_grow();
+    libnbt_projection();
+    libnbt_skip();
+    libnbt_parallel();
+    libnbt_compact();
+    libnbt_query();
+    libnbt_batch();
+    libnbt_index();
+    libnbt_expr();
+    libnbt_iter();
+    libnbt_predicate();
+    libnbt_accessors();
+    libnbt_column();
+    libnbt_list_access();
+    libnbt_keys();
+    libnbt_build();
+    libnbt_growable_build();
+    libnbt_stream_build();
+    libnbt_encode();
+    libnbt_list_build();
+    libnbt_collapsed();
+    libnbt_dispatch();
 
     return 0;
 }
@@ -0,0 +1,488 @@
+/* The switch-based tokeniser the library had before its handler tables, kept as an oracle to test nbt_tokenise against */
+#include "legacy-tok.h"
+#include "../nbt_utils.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static struct nbt_metadata get_nbt_metadata(struct nbt_parser* parser)
+{
+    struct nbt_metadata result;
+
+    result.type = parser->nbt_data->content[parser->current_byte];
+    parser->current_byte++;
+
+    result.num_of_entries = char_to_int(parser->nbt_data->content + parser->current_byte);
+    parser->current_byte += 4;
+
+    return result;
+}
+
+static int nbt_get_identifier_len(const struct nbt_parser* parser)
+{
+    char id_len[2];
+
+    id_len[0] = parser->nbt_data->content[parser->current_byte];
+    id_len[1] = parser->nbt_data->content[parser->current_byte+1];
+
+    int length = char_to_short(id_len) + 2;
+
+    return length;
+
+}
+
+/* Returns the size of a fixed width primitive, 0 for other types */
+static int nbt_fixed_width(const nbt_type_t type)
+{
+    switch (type) {
+        case nbt_byte:
+            return 1;
+        case nbt_short:
+            return 2;
+        case nbt_int:
+        case nbt_float:
+            return 4;
+        case nbt_long:
+        case nbt_double:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/* Whether a list is stored as a single token covering all of its elements */
+static bool nbt_is_collapsed(const struct nbt_parser_setting_t* setting, const nbt_type_t elem_type, const int32_t entries)
+{
+    if (!setting->collapse_lists) return false;
+
+    return entries > 0 && nbt_fixed_width(elem_type) != 0;
+}
+
+/* Returns the length of the payload of a value of `type` starting at `offset`, including any length prefix */
+static int nbt_payload_len(char* data, const int data_len, const int offset, const nbt_type_t type)
+{
+    int width;
+
+    switch (type) {
+        case nbt_byte:
+            return 1;
+        case nbt_short:
+            return 2;
+        case nbt_int:
+        case nbt_float:
+            return 4;
+        case nbt_long:
+        case nbt_double:
+            return 8;
+
+        case nbt_string:
+            if (offset + 2 > data_len) return NBT_PARTIAL;
+            return char_to_ushort(data + offset) + 2;
+
+        case nbt_byte_array:
+            width = 1;
+            break;
+        case nbt_int_array:
+            width = 4;
+            break;
+        case nbt_long_array:
+            width = 8;
+            break;
+
+        default:
+            return NBT_WARN;
+    }
+
+    if (offset + 4 > data_len) return NBT_PARTIAL;
+
+    int32_t count = char_to_int(data + offset);
+    if (count < 0 || count > (INT32_MAX - 4) / width) return NBT_WARN;
+
+    return count * width + 4;
+}
+
+static int nbt_get_primitive_len(const struct nbt_parser *parser, const nbt_type_t type)
+{
+    int len = nbt_payload_len(parser->nbt_data->content, parser->nbt_data->len, parser->current_byte, type);
+    if (len < 0) return 0;
+
+    return len;
+}
+
+static int nbt_parse_simple_data(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    nbt_type_t current_type;
+    int total_len = 0;
+    int sup_token = parser->parent_token; //We need to save the parent token because the ID token is filled once only
+
+
+    parser->parent_token = parser->current_token;
+
+    parser->current_token++; //Allocates space for the ID token
+
+    /* Getting the type ID of the sata */
+    current_type = (nbt_type_t) (parser->nbt_data->content[parser->current_byte]);
+    parser->current_byte++;
+    total_len++;
+
+    /* Get the identifier of the data */
+    int id_len = nbt_get_identifier_len(parser);
+
+    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return NBT_NOMEM;
+
+    parser->current_token++;
+    parser->current_byte += id_len;
+    total_len += id_len;
+
+    /* Get primitve in the data */
+    int pr_len = nbt_get_primitive_len(parser, current_type);
+    if (0 == pr_len) return NBT_WARN;
+
+    nbt_tok pr_payload = {.type = nbt_primitive, .start = parser->current_byte, .end = parser->current_byte + pr_len - 1, .len = pr_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &pr_payload)) return NBT_NOMEM;
+
+    parser->current_token++;
+    parser->current_byte += pr_len;
+    total_len += pr_len;
+
+    /* Fill the ID token */
+    nbt_tok _payload = {.type = current_type, .start = parser->current_byte - total_len, .end = parser->current_byte - 1, .len = total_len, .parent = sup_token, .next = parser->current_token};
+    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return NBT_NOMEM;
+
+    parser->parent_token = sup_token; // Set parent token back to the original
+
+    return 0;
+}
+
+static int nbt_parse_element(struct nbt_parser* parser, nbt_type_t current_type, nbt_tok* tok, const int tok_len)
+{
+    int total_len = 0;
+    int sup_token = parser->parent_token; //We need to save the parent token because the ID token is filled once only
+
+    parser->parent_token = parser->current_token;
+
+    parser->current_token++; //Allocates space for the ID token
+
+    /* Get primitve in the data */
+    int pr_len = nbt_get_primitive_len(parser, current_type);
+    if (0 == pr_len) return NBT_WARN;
+
+    nbt_tok pr_payload = {.type = nbt_primitive, .start = parser->current_byte, .end = parser->current_byte + pr_len - 1, .len = pr_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &pr_payload)) return NBT_NOMEM;
+
+    parser->current_token++;
+    parser->current_byte += pr_len;
+    total_len += pr_len;
+    
+
+    /* Fill the ID token */
+    nbt_tok _payload = {.type = current_type, .start = parser->current_byte - total_len, .end = parser->current_byte - 1, .len = total_len, .parent = sup_token, .next = parser->current_token};
+    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return NBT_NOMEM;
+
+    parser->parent_token = sup_token; // Set parent token back to the original
+
+    return 0;
+}
+
+static int nbt_parse_compound_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    
+    nbt_tok _payload = {.type = nbt_compound, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token, .next = NBT_UNCHANGED};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+
+    parser->current_byte++; // Increment because we expect current byte to be on the byte of the ID
+
+    parser->parent_token = parser->current_token;
+    parser->current_token++;
+    
+    int total_len = 0;
+    /* Get the identifier from data */
+    int id_len = nbt_get_identifier_len(parser);
+
+    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return 1;
+
+    parser->current_token++;
+    parser->current_byte += id_len;
+    total_len += id_len;
+
+    return 0;
+}
+
+static int nbt_parse_element_compound_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    nbt_tok _payload = {.type = nbt_compound, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token, .next = NBT_UNCHANGED};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+
+    parser->parent_token = parser->current_token;
+    parser->current_token++;
+
+    return 0;
+}
+
+static int nbt_parse_compound_end(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    int len = parser->current_byte - nbt_tok_return_start(tok, parser->parent_token, tok_len) + 1;
+
+    nbt_tok _payload = {.type = NBT_UNCHANGED, .start = NBT_UNCHANGED, .end = parser->current_byte, .len = len, .parent = NBT_UNCHANGED, .next = parser->current_token};
+    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return 1;
+
+    parser->parent_token = nbt_tok_return_parent(tok, parser->parent_token, tok_len);
+    parser->current_byte++;
+
+    return 0;
+}
+
+static int nbt_parse_collapsed_list(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    struct nbt_metadata* meta = &parser->list_meta[parser->cur_index];
+    if (!nbt_is_collapsed(parser->setting, meta->type, meta->num_of_entries)) return 0;
+
+    int pr_len = nbt_fixed_width(meta->type) * meta->num_of_entries;
+
+    nbt_tok pr_payload = {.type = nbt_primitive, .start = parser->current_byte, .end = parser->current_byte + pr_len - 1, .len = pr_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &pr_payload)) return 1;
+
+    parser->current_token++;
+    parser->current_byte += pr_len;
+
+    meta->num_of_entries = 0; // Close the list straight away
+
+    return 0;
+}
+
+static int nbt_parse_list_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    nbt_tok _payload = {.type = nbt_list, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token, .next = NBT_UNCHANGED};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+
+    parser->parent_token = parser->current_token;
+    parser->current_token++;
+    parser->current_byte++;
+
+    /* Get the identifier from data */
+    int id_len = nbt_get_identifier_len(parser);
+
+    nbt_tok id_payload = {.type = nbt_identifier, .start = parser->current_byte, .end = parser->current_byte + id_len - 1, .len = id_len, .parent = parser->parent_token, .next = parser->current_token + 1};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &id_payload)) return 1;
+    
+    parser->current_token++;
+    parser->current_byte += id_len;
+
+    /* Get Metadata for the list */
+    struct nbt_metadata meta = get_nbt_metadata(parser);
+    if (parser->list_meta[parser->cur_index].type != nbt_end) parser->cur_index++;
+    if (nbt_add_meta(parser->cur_index, parser, &meta)) return NBT_LNOMEM;
+
+    return nbt_parse_collapsed_list(parser, tok, tok_len);
+}
+
+static int nbt_parse_element_list_start(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    nbt_tok _payload = {.type = nbt_list, .start = parser->current_byte, .end = NBT_UNCHANGED, .len = NBT_UNCHANGED, .parent = parser->parent_token, .next = NBT_UNCHANGED};
+    if (nbt_add_token(tok, tok_len, parser->current_token, &_payload)) return 1;
+
+    parser->parent_token = parser->current_token;
+    parser->current_token++;
+
+    struct nbt_metadata meta = get_nbt_metadata(parser);
+    if (nbt_add_meta(parser->cur_index, parser, &meta)) return NBT_LNOMEM;
+
+    return nbt_parse_collapsed_list(parser, tok, tok_len);
+}
+
+static int nbt_parse_list_end(struct nbt_parser* parser, nbt_tok* tok, const int tok_len)
+{
+    int len = parser->current_byte - nbt_tok_return_start(tok, parser->parent_token, tok_len);
+
+    nbt_tok _payload = {.type = NBT_UNCHANGED, .start = NBT_UNCHANGED, .end = parser->current_byte - 1, .len = len, .parent = NBT_UNCHANGED, .next = parser->current_token};
+    if (nbt_add_token(tok, tok_len, parser->parent_token, &_payload)) return 1;
+
+    parser->parent_token = nbt_tok_return_parent(tok, parser->parent_token, tok_len);
+
+    parser->list_meta[parser->cur_index].num_of_entries = NBT_NOT_AVAIL;
+
+    return 0;
+}
+
+/* Checks that the next step has all the data, tokens and list metadata it needs, so that a failed step leaves the parser untouched */
+static int nbt_check_step(const struct nbt_parser* parser, const nbt_type_t type, const bool in_list, const int tok_len)
+{
+    char* data = parser->nbt_data->content;
+    const int data_len = parser->nbt_data->len;
+
+    int offset = parser->current_byte;
+    int tokens = 0;
+
+    if (type == nbt_end) return 0;
+
+    if (in_list) {
+        tokens++; // The element token
+    }
+    else {
+        /* The type ID and the identifier */
+        if (offset + 3 > data_len) return NBT_PARTIAL;
+        offset += 3 + char_to_ushort(data + offset + 1);
+        tokens += 2;
+    }
+
+    switch (type) {
+        case nbt_compound:
+            break;
+
+        case nbt_list: {
+            if (offset + 5 > data_len) return NBT_PARTIAL;
+
+            nbt_type_t elem_type = data[offset];
+            int32_t entries = char_to_int(data + offset + 1);
+            offset += 5;
+
+            if (nbt_is_collapsed(parser->setting, elem_type, entries)) {
+                int width = nbt_fixed_width(elem_type);
+                if (entries > (INT32_MAX - offset) / width) return NBT_WARN;
+
+                offset += entries * width;
+                tokens++;
+            }
+
+            int index = parser->cur_index;
+            if (in_list || parser->list_meta[parser->cur_index].type != nbt_end) index++;
+            if (index >= parser->max_list) return NBT_LNOMEM;
+            break;
+        }
+
+        default: {
+            int pr_len = nbt_payload_len(data, data_len, offset, type);
+            if (pr_len < 0) return pr_len;
+
+            offset += pr_len;
+            tokens++;
+            break;
+        }
+    }
+
+    if (offset > data_len) return NBT_PARTIAL;
+    if (parser->current_token + tokens > tok_len) return NBT_NOMEM;
+
+    return 0;
+}
+
+/* The original switch-based tokeniser */
+static int nbt_tokenise_legacy_loop(nbt_parser *parser, nbt_tok* tok, const int tok_len, const int stop_parent)
+{
+    /* The root compound has already been closed */
+    if (parser->parent_token == NBT_NOT_AVAIL && parser->current_token > 0) return 0;
+
+    for (;;)
+    {
+        bool in_list = nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list;
+
+        char current_char;
+        if (in_list) {
+            current_char = parser->list_meta[parser->cur_index].type;
+        }
+        else {
+            if (parser->current_byte >= parser->nbt_data->len) return NBT_PARTIAL;
+            current_char = parser->nbt_data->content[parser->current_byte];
+        }
+
+        if (parser->parent_token == NBT_NOT_AVAIL && current_char != nbt_compound) return NBT_WARN;
+
+        int step_res = nbt_check_step(parser, current_char, in_list, tok_len);
+        if (step_res) return step_res;
+
+        // debug("current char is %d, index is %d", current_char, parser->current_byte);
+        switch (current_char) {
+            case nbt_byte:
+            case nbt_short:    
+            case nbt_int:
+            case nbt_long:
+            case nbt_float:
+            case nbt_double:
+            case nbt_byte_array:
+            case nbt_string:
+            case nbt_int_array:
+            case nbt_long_array: {
+                // debug("In %s: type id is %d", __FUNCTION__ , current_char);
+                
+                if (in_list) {
+                    int res = nbt_parse_element(parser, current_char, tok, tok_len);
+                    if (res) return res;
+                    parser->list_meta[parser->cur_index].num_of_entries--;
+                }
+                else {
+                    int res = nbt_parse_simple_data(parser, tok, tok_len);
+                    if (res) return res;
+                }
+                break;
+            }
+
+            case nbt_list: {
+                // debug("in nbt_list");
+                if (in_list) {
+                    parser->cur_index++;
+                    if (nbt_parse_element_list_start(parser, tok, tok_len)) return NBT_NOMEM;
+                }
+                else {
+                    if (nbt_parse_list_start(parser, tok, tok_len)) return NBT_NOMEM;
+                }    
+                break;
+            }
+
+            case nbt_compound: {
+                // debug("In %s:nbt_compound", __FUNCTION__ );
+                if (in_list) {
+                    if (nbt_parse_element_compound_start(parser, tok, tok_len)) return NBT_NOMEM;
+                }
+                else {
+                    if (nbt_parse_compound_start(parser, tok, tok_len)) return NBT_NOMEM;
+                }    
+                break;
+            }
+            /* Exit point */
+            case nbt_end: {
+                // debug("In %s:nbt_end",__FUNCTION__ );
+
+                if (nbt_parse_compound_end(parser, tok, tok_len)) return NBT_NOMEM;
+
+                if (parser->parent_token == NBT_NOT_AVAIL) return 0;
+
+                if (nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list && parser->list_meta[parser->cur_index].num_of_entries != NBT_NOT_AVAIL) parser->list_meta[parser->cur_index].num_of_entries--;
+                break;
+            }
+            default:
+                return NBT_WARN;
+                break;
+        }
+
+        bool has_list_end = false;
+        int entries = nbt_meta_return_entries(parser, parser->cur_index);
+        if (entries == 0 && parser->parent_token != NBT_NOT_AVAIL) has_list_end = true;
+
+        while (has_list_end)
+        {
+            if (nbt_parse_list_end(parser, tok, tok_len)) return NBT_NOMEM;
+            
+            if (parser->cur_index > 0) parser->cur_index--;
+
+            if (parser->parent_token != NBT_NOT_AVAIL && nbt_tok_return_type(tok, parser->parent_token, tok_len) == nbt_list) {
+                parser->list_meta[parser->cur_index].num_of_entries--;
+                if (parser->list_meta[parser->cur_index].num_of_entries > 0) {
+                    has_list_end = false;
+                }
+            }
+            else
+            {
+                has_list_end = false;
+            }
+        }
+
+        if (parser->parent_token == stop_parent) return 0;
+    }
+}
+
+int legacy_tokenise(nbt_parser *parser, nbt_tok* tok, const int tok_len)
+{
+    return nbt_tokenise_legacy_loop(parser, tok, tok_len, NBT_NOT_AVAIL);
+}
@@ -0,0 +1,9 @@
+#ifndef LEGACY_TOK_H
+#define LEGACY_TOK_H
+
+#include "../libnbt.h"
+
+/* Tokenises like nbt_tokenise into `tok_len` tokens given by the caller, without a dry run or growing storage */
+int legacy_tokenise(nbt_parser* parser, nbt_tok* tok, const int tok_len);
+
+#endif /* LEGACY_TOK_H */